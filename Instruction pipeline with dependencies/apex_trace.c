@@ -0,0 +1,31 @@
+/*
+ *  apex_trace.c
+ *  Contains the trace decoder: renders a binary pipeline trace written
+ *  with --trace as the per-cycle stage output of display mode.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+
+int
+main(int argc, char const* argv[])
+{
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "APEX_Help : Usage %s <trace_file> [output_file]\n",
+            argv[0]);
+    exit(1);
+  }
+
+  FILE* out = argc == 3 ? fopen(argv[2], "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "APEX_Error : Unable to open %s\n", argv[2]);
+    exit(1);
+  }
+  long cycles = APEX_trace_decode(argv[1], out);
+  if (fclose(out) != 0 || cycles < 0) {
+    exit(1);
+  }
+  fprintf(stderr, "APEX_CPU : Decoded %ld cycles\n", cycles);
+  return 0;
+}
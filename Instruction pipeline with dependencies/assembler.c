@@ -0,0 +1,840 @@
+/*
+ *  assembler.c
+ *  Contains the assembler for APEX source files (.s): labels, constants,
+ *  repeat and macro blocks and a data section on top of the instruction
+ *  format of file_parser.c.
+ *
+ *  One statement per line, ';' starts a comment:
+ *    name:                 labels the next instruction, or the next word
+ *                          in the data section
+ *    .equ name, expr       defines a constant
+ *    .rept expr ... .endr  repeats the lines in between
+ *    .macro name a, b ... .endm
+ *                          defines a macro, used as "name x, y"; \a and \b
+ *                          in its body become the arguments and \@ a
+ *                          number unique to the use
+ *    .data / .code         switches between the data and code sections
+ *    .org expr             moves to a data address
+ *    .word expr, ...       stores words at consecutive data addresses
+ *  Literals ("#expr") and directive operands are sums and differences of
+ *  numbers, constants and labels. In BZ and BNZ a code label stands for
+ *  its offset from the branch, everywhere else for its address. Constants
+ *  and repeat counts may only use numbers and earlier constants.
+ *
+ *  Assembled programs are cached as images (see image.c) in .apexcache
+ *  next to the source, named by a hash of the source and the assembler
+ *  version, so an unchanged source is mapped without assembling it.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+
+/* Bump when the same source would assemble differently */
+#define ASM_VERSION 2
+
+#define ASM_MAX_ERRORS 20
+#define ASM_MAX_DEPTH 64	// Nested macro uses and repeat blocks
+#define ASM_MAX_PARAMS 16
+#define ASM_MAX_REPEAT (1 << 24)
+#define ASM_MAX_STATEMENT 1024
+
+
+typedef struct APEX_Asm_Line
+{
+  char* text;		// Statement without comment and surrounding blanks
+  int line;		// Source line it came from
+} APEX_Asm_Line;
+
+typedef struct APEX_Asm_Macro
+{
+  char* name;
+  char* params[ASM_MAX_PARAMS];
+  int num_params;
+  APEX_Asm_Line* body;
+  int body_size;
+} APEX_Asm_Macro;
+
+enum
+{
+  SYM_CONST,
+  SYM_CODE,		// Address of an instruction
+  SYM_DATA		// Address of a data word
+};
+
+typedef struct APEX_Asm_Symbol
+{
+  char* name;		// NULL for a free slot
+  int value;
+  int kind;
+} APEX_Asm_Symbol;
+
+typedef struct APEX_Assembler
+{
+  const char* filename;
+  int errors;
+
+  /* Statements left once macros and repeat blocks are expanded */
+  APEX_Asm_Line* statements;
+  int num_statements;
+  int statement_capacity;
+
+  APEX_Asm_Macro* macros;
+  int num_macros;
+  int uses;		// Macro uses so far, the value of \@
+
+  /* Open addressing hash table, at most half full */
+  APEX_Asm_Symbol* symbols;
+  int symbol_capacity;
+  int num_symbols;
+
+  APEX_Instruction* code;
+  int code_size;
+  APEX_Memory data;
+} APEX_Assembler;
+
+static void
+asm_error(APEX_Assembler* as, int line, const char* format, ...)
+{
+  if (as->errors++ < ASM_MAX_ERRORS) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "APEX_Error : %s:%d: ", as->filename, line);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+  }
+}
+
+static int
+is_ident_start(char c)
+{
+  return isalpha((unsigned char)c) || c == '_';
+}
+
+static int
+is_ident(char c)
+{
+  return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+/* Length of the identifier at text, 0 if there is none */
+static int
+ident_length(const char* text)
+{
+  int len = 0;
+  if (is_ident_start(text[0])) {
+    while (is_ident(text[len])) {
+      len++;
+    }
+  }
+  return len;
+}
+
+static char*
+skip_blanks(char* text)
+{
+  while (*text == ' ' || *text == '\t') {
+    text++;
+  }
+  return text;
+}
+
+/* Length of the first word of text, which ends at a blank or a comma */
+static int
+word_length(const char* text)
+{
+  return strcspn(text, " \t,");
+}
+
+static int
+word_is(const char* text, const char* word)
+{
+  int len = word_length(text);
+  return len == (int)strlen(word) && strncmp(text, word, len) == 0;
+}
+
+/* Splits text in place at commas, returns the number of trimmed fields */
+static int
+split_fields(char* text, char** fields, int max)
+{
+  int count = 0;
+  while (count < max) {
+    char* comma = strchr(text, ',');
+    if (comma) {
+      *comma = '\0';
+    }
+    fields[count++] = APEX_trim(text);
+    if (!comma) {
+      break;
+    }
+    text = comma + 1;
+  }
+  return count;
+}
+
+static unsigned int
+symbol_slot(APEX_Asm_Symbol* symbols, int capacity, const char* name, int len)
+{
+  unsigned int slot = APEX_hash_bytes(APEX_HASH_INIT, name, len);
+  while (symbols[slot & (capacity - 1)].name &&
+         (strncmp(symbols[slot & (capacity - 1)].name, name, len) != 0 ||
+          symbols[slot & (capacity - 1)].name[len] != '\0')) {
+    slot++;
+  }
+  return slot & (capacity - 1);
+}
+
+static APEX_Asm_Symbol*
+find_symbol(APEX_Assembler* as, const char* name, int len)
+{
+  if (!as->symbol_capacity) {
+    return NULL;
+  }
+  APEX_Asm_Symbol* symbol =
+    &as->symbols[symbol_slot(as->symbols, as->symbol_capacity, name, len)];
+  return symbol->name ? symbol : NULL;
+}
+
+static void
+define_symbol(APEX_Assembler* as, const char* name, int len, int value,
+              int kind, int line)
+{
+  if (find_symbol(as, name, len)) {
+    asm_error(as, line, "'%.*s' is already defined", len, name);
+    return;
+  }
+  if (2 * (as->num_symbols + 1) > as->symbol_capacity) {
+    int capacity = as->symbol_capacity ? as->symbol_capacity * 2 : 256;
+    APEX_Asm_Symbol* symbols = calloc(capacity, sizeof(*symbols));
+    if (!symbols) {
+      asm_error(as, line, "out of memory");
+      return;
+    }
+    for (int i = 0; i < as->symbol_capacity; ++i) {
+      APEX_Asm_Symbol* old = &as->symbols[i];
+      if (old->name) {
+        symbols[symbol_slot(symbols, capacity, old->name,
+                            strlen(old->name))] = *old;
+      }
+    }
+    free(as->symbols);
+    as->symbols = symbols;
+    as->symbol_capacity = capacity;
+  }
+  APEX_Asm_Symbol* symbol =
+    &as->symbols[symbol_slot(as->symbols, as->symbol_capacity, name, len)];
+  symbol->name = strndup(name, len);
+  symbol->value = value;
+  symbol->kind = kind;
+  as->num_symbols++;
+}
+
+/*
+ * Evaluates a sum and difference of numbers and symbols. Code labels
+ * count from base, which is the branch address in BZ and BNZ and 0
+ * elsewhere. Returns -1 after reporting a bad expression.
+ */
+static int
+eval_expr(APEX_Assembler* as, const char* text, int base, int line,
+          int* value)
+{
+  const char* s = text;
+  long long total = 0;
+  int sign = 1;
+  while (1) {
+    while (*s == ' ' || *s == '\t') {
+      s++;
+    }
+    if (*s == '+' || *s == '-') {
+      sign = *s++ == '-' ? -sign : sign;
+      continue;
+    }
+
+    long long term;
+    if (isdigit((unsigned char)*s)) {
+      char* end;
+      int hex = s[0] == '0' && (s[1] == 'x' || s[1] == 'X');
+      errno = 0;
+      term = strtoll(s, &end, hex ? 16 : 10);
+      if (errno || term > UINT_MAX) {
+        break;
+      }
+      s = end;
+    } else if (is_ident_start(*s)) {
+      int len = ident_length(s);
+      APEX_Asm_Symbol* symbol = find_symbol(as, s, len);
+      if (!symbol) {
+        asm_error(as, line, "unknown symbol '%.*s'", len, s);
+        return -1;
+      }
+      term = symbol->kind == SYM_CODE ? (long long)symbol->value - base
+                                      : symbol->value;
+      s += len;
+    } else {
+      break;
+    }
+    total += sign * term;
+    if (total > UINT_MAX || total < INT_MIN) {
+      break;
+    }
+
+    while (*s == ' ' || *s == '\t') {
+      s++;
+    }
+    if (!*s) {
+      /* Literals wrap like the 32-bit registers they end up in */
+      *value = (int)(unsigned int)total;
+      return 0;
+    }
+    if (*s != '+' && *s != '-') {
+      break;
+    }
+    sign = *s++ == '-' ? -1 : 1;
+  }
+  asm_error(as, line, "bad expression '%s'", text);
+  return -1;
+}
+
+static void
+add_statement(APEX_Assembler* as, char* text, int line)
+{
+  if (as->num_statements == as->statement_capacity) {
+    int capacity = as->statement_capacity ? as->statement_capacity * 2 : 1024;
+    APEX_Asm_Line* grown =
+      realloc(as->statements, sizeof(*grown) * capacity);
+    if (!grown) {
+      asm_error(as, line, "out of memory");
+      free(text);
+      return;
+    }
+    as->statements = grown;
+    as->statement_capacity = capacity;
+  }
+  as->statements[as->num_statements].text = text;
+  as->statements[as->num_statements++].line = line;
+}
+
+/* Index of the line closing the block opened at lines[start], or -1 */
+static int
+block_end(APEX_Asm_Line* lines, int count, int start, const char* open,
+          const char* close)
+{
+  int depth = 1;
+  for (int i = start + 1; i < count; ++i) {
+    if (word_is(lines[i].text, open)) {
+      depth++;
+    } else if (word_is(lines[i].text, close) && --depth == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static APEX_Asm_Macro*
+find_macro(APEX_Assembler* as, const char* name, int len)
+{
+  for (int i = 0; i < as->num_macros; ++i) {
+    if (strncmp(as->macros[i].name, name, len) == 0 &&
+        as->macros[i].name[len] == '\0') {
+      return &as->macros[i];
+    }
+  }
+  return NULL;
+}
+
+/* Records the macro whose ".macro name params" line is text */
+static void
+define_macro(APEX_Assembler* as, char* text, APEX_Asm_Line* body, int size,
+             int line)
+{
+  char* name = skip_blanks(text + word_length(text));
+  int len = word_length(name);
+  if (!len || ident_length(name) != len) {
+    asm_error(as, line, "expected macro name");
+    return;
+  }
+  if (find_macro(as, name, len)) {
+    asm_error(as, line, "macro '%.*s' is already defined", len, name);
+    return;
+  }
+  APEX_Asm_Macro* grown =
+    realloc(as->macros, sizeof(*grown) * (as->num_macros + 1));
+  if (!grown) {
+    asm_error(as, line, "out of memory");
+    return;
+  }
+  as->macros = grown;
+
+  APEX_Asm_Macro* macro = &as->macros[as->num_macros];
+  memset(macro, 0, sizeof(*macro));
+  char* params = skip_blanks(name + len);
+  if (*params == ',') {
+    params++;
+  }
+  char* fields[ASM_MAX_PARAMS + 1];
+  int count = *APEX_trim(params)
+                ? split_fields(params, fields, ASM_MAX_PARAMS + 1)
+                : 0;
+  if (count > ASM_MAX_PARAMS) {
+    asm_error(as, line, "more than %d macro parameters", ASM_MAX_PARAMS);
+    return;
+  }
+  macro->name = strndup(name, len);
+  macro->body = calloc(size ? size : 1, sizeof(*macro->body));
+  if (!macro->name || !macro->body) {
+    free(macro->name);
+    free(macro->body);
+    asm_error(as, line, "out of memory");
+    return;
+  }
+  for (int i = 0; i < size; ++i) {
+    macro->body[i].text = strdup(body[i].text);
+    macro->body[i].line = body[i].line;
+  }
+  macro->body_size = size;
+  for (int i = 0; i < count; ++i) {
+    macro->params[macro->num_params++] = strdup(fields[i]);
+  }
+  as->num_macros++;
+}
+
+/* Returns text with every \param replaced by its argument and \@ by use */
+static char*
+substitute(const char* text, APEX_Asm_Macro* macro, char** args, int use)
+{
+  size_t capacity = strlen(text) + 64;
+  size_t len = 0;
+  char* out = malloc(capacity);
+  while (out && *text) {
+    const char* value = NULL;
+    int skip = 1;
+    char number[16];
+    if (text[0] == '\\' && text[1] == '@') {
+      snprintf(number, sizeof(number), "%d", use);
+      value = number;
+      skip = 2;
+    } else if (text[0] == '\\') {
+      for (int i = 0; i < macro->num_params; ++i) {
+        int plen = strlen(macro->params[i]);
+        if (strncmp(text + 1, macro->params[i], plen) == 0 &&
+            !is_ident(text[1 + plen])) {
+          value = args[i];
+          skip = 1 + plen;
+          break;
+        }
+      }
+    }
+    size_t add = value ? strlen(value) : 1;
+    if (len + add + 1 > capacity) {
+      capacity = 2 * (len + add + 1);
+      char* grown = realloc(out, capacity);
+      if (!grown) {
+        free(out);
+        return NULL;
+      }
+      out = grown;
+    }
+    if (value) {
+      memcpy(out + len, value, add);
+      text += skip;
+    } else {
+      out[len] = *text++;
+    }
+    len += add;
+  }
+  if (out) {
+    out[len] = '\0';
+  }
+  return out;
+}
+
+static void expand(APEX_Assembler* as, APEX_Asm_Line* lines, int count,
+                   int depth);
+
+static void
+use_macro(APEX_Assembler* as, APEX_Asm_Macro* macro, char* args, int line,
+          int depth)
+{
+  char* fields[ASM_MAX_PARAMS + 1];
+  args = skip_blanks(args);
+  if (*args == ',') {
+    args++;
+  }
+  int count =
+    *APEX_trim(args) ? split_fields(args, fields, ASM_MAX_PARAMS + 1) : 0;
+  if (count != macro->num_params) {
+    asm_error(as, line, "macro '%s' takes %d arguments", macro->name,
+              macro->num_params);
+    return;
+  }
+
+  int use = as->uses++;
+  APEX_Asm_Line* body = malloc(sizeof(*body) * (macro->body_size + 1));
+  if (!body) {
+    asm_error(as, line, "out of memory");
+    return;
+  }
+  for (int i = 0; i < macro->body_size; ++i) {
+    body[i].text = substitute(macro->body[i].text, macro, fields, use);
+    body[i].line = macro->body[i].line;
+    if (!body[i].text) {
+      body[i].text = strdup("");
+      asm_error(as, line, "out of memory");
+    }
+  }
+  expand(as, body, macro->body_size, depth + 1);
+  for (int i = 0; i < macro->body_size; ++i) {
+    free(body[i].text);
+  }
+  free(body);
+}
+
+/*
+ * Expands macro uses and repeat blocks of lines into statements, and
+ * defines constants and macros on the way.
+ */
+static void
+expand(APEX_Assembler* as, APEX_Asm_Line* lines, int count, int depth)
+{
+  if (depth > ASM_MAX_DEPTH) {
+    asm_error(as, count ? lines[0].line : 0,
+              "macros or repeat blocks nested too deeply");
+    return;
+  }
+
+  for (int i = 0; i < count && as->errors < ASM_MAX_ERRORS; ++i) {
+    char* text = lines[i].text;
+    int line = lines[i].line;
+
+    /* A label becomes a statement of its own */
+    int len = ident_length(text);
+    if (len && text[len] == ':') {
+      add_statement(as, strndup(text, len + 1), line);
+      text = skip_blanks(text + len + 1);
+    }
+    if (!*text) {
+      continue;
+    }
+
+    char* rest = skip_blanks(text + word_length(text));
+    if (word_is(text, ".macro") || word_is(text, ".rept")) {
+      int macro = word_is(text, ".macro");
+      int end = block_end(lines, count, i, macro ? ".macro" : ".rept",
+                          macro ? ".endm" : ".endr");
+      if (end < 0) {
+        asm_error(as, line, "%s without %s", macro ? ".macro" : ".rept",
+                  macro ? ".endm" : ".endr");
+        return;
+      }
+      int times;
+      if (macro) {
+        define_macro(as, text, &lines[i + 1], end - i - 1, line);
+      } else if (eval_expr(as, rest, 0, line, &times) == 0) {
+        if (times < 0 || times > ASM_MAX_REPEAT) {
+          asm_error(as, line, "bad repeat count %d", times);
+        }
+        for (int r = 0; r < times && times <= ASM_MAX_REPEAT &&
+                        as->errors == 0; ++r) {
+          expand(as, &lines[i + 1], end - i - 1, depth + 1);
+        }
+      }
+      i = end;
+    } else if (word_is(text, ".endm") || word_is(text, ".endr")) {
+      asm_error(as, line, "%.*s without its block", word_length(text), text);
+    } else if (word_is(text, ".equ")) {
+      char* fields[3];
+      int value;
+      char* copy = strdup(rest);
+      if (!copy || split_fields(copy, fields, 3) != 2 ||
+          !fields[0][0] || fields[0][ident_length(fields[0])]) {
+        asm_error(as, line, "expected .equ name, value");
+      } else if (eval_expr(as, fields[1], 0, line, &value) == 0) {
+        define_symbol(as, fields[0], strlen(fields[0]), value, SYM_CONST,
+                      line);
+      }
+      free(copy);
+    } else {
+      APEX_Asm_Macro* macro = find_macro(as, text, word_length(text));
+      if (macro) {
+        char* args = strdup(text + word_length(text));
+        if (args) {
+          use_macro(as, macro, args, line, depth);
+        }
+        free(args);
+      } else {
+        add_statement(as, strdup(text), line);
+      }
+    }
+  }
+}
+
+/*
+ * Rewrites the literals of an instruction statement to numbers and parses
+ * it at address pc into ins.
+ */
+static void
+encode(APEX_Assembler* as, char* text, int pc, int line, APEX_Instruction* ins)
+{
+  char out[ASM_MAX_STATEMENT];
+  int len = word_length(text);
+  int branch = word_is(text, "BZ") || word_is(text, "BNZ");
+  int used = snprintf(out, sizeof(out), "%.*s", len, text);
+
+  char* rest = skip_blanks(text + len);
+  char* fields[8];
+  if (*rest == ',') {
+    rest++;
+  }
+  int count = *rest ? split_fields(rest, fields, 8) : 0;
+  for (int i = 0; i < count && used < (int)sizeof(out); ++i) {
+    int value;
+    if (i == count - 1 && !*fields[i]) {
+      break;
+    }
+    if (fields[i][0] != '#') {
+      used += snprintf(out + used, sizeof(out) - used, ",%s", fields[i]);
+    } else if (eval_expr(as, fields[i] + 1, branch ? pc : 0, line, &value) ==
+               0) {
+      used += snprintf(out + used, sizeof(out) - used, ",#%d", value);
+    } else {
+      return;
+    }
+  }
+  if (used >= (int)sizeof(out)) {
+    asm_error(as, line, "statement too long");
+  } else if (APEX_parse_instruction(ins, out, used, as->filename, line) != 0) {
+    as->errors++;
+  }
+}
+
+/*
+ * Lays out the statements. The first pass defines labels and counts
+ * instructions, the second encodes instructions and stores data words.
+ */
+static void
+assemble_pass(APEX_Assembler* as, int pass)
+{
+  int in_code = 1;
+  int code_size = 0;
+  int address = 0;
+  for (int i = 0; i < as->num_statements; ++i) {
+    char* text = as->statements[i].text;
+    int line = as->statements[i].line;
+    int len = strlen(text);
+    char* rest = skip_blanks(text + word_length(text));
+    int value;
+
+    if (text[len - 1] == ':') {
+      if (pass == 1) {
+        define_symbol(as, text, len - 1, in_code ? 4000 + 4 * code_size : address,
+                      in_code ? SYM_CODE : SYM_DATA, line);
+      }
+    } else if (word_is(text, ".data")) {
+      in_code = 0;
+    } else if (word_is(text, ".code") || word_is(text, ".text")) {
+      in_code = 1;
+    } else if (word_is(text, ".org")) {
+      if (in_code) {
+        asm_error(as, line, ".org outside the data section");
+      } else if (eval_expr(as, rest, 0, line, &value) == 0) {
+        address = value;
+      }
+    } else if (word_is(text, ".word")) {
+      char* copy = strdup(rest);
+      char* fields[64];
+      int count = copy ? split_fields(copy, fields, 64) : 0;
+      if (in_code) {
+        asm_error(as, line, ".word outside the data section");
+        count = 0;
+      }
+      for (int w = 0; w < count; ++w, ++address) {
+        if (address < 0 || (unsigned int)address >= APEX_MEMORY_MAX_WORDS) {
+          asm_error(as, line, "data address %d out of range", address);
+          break;
+        }
+        if (pass == 2 && eval_expr(as, fields[w], 0, line, &value) == 0) {
+          *APEX_memory_word(&as->data, address, 1) = value;
+        }
+      }
+      free(copy);
+    } else if (text[0] == '.') {
+      if (pass == 1) {
+        asm_error(as, line, "unknown directive %.*s", word_length(text), text);
+      }
+    } else if (!in_code) {
+      if (pass == 1) {
+        asm_error(as, line, "instruction in the data section");
+      }
+    } else {
+      if (pass == 2) {
+        encode(as, text, 4000 + 4 * code_size, line, &as->code[code_size]);
+      }
+      code_size++;
+    }
+  }
+  as->code_size = code_size;
+}
+
+static void
+free_assembler(APEX_Assembler* as)
+{
+  for (int i = 0; i < as->num_statements; ++i) {
+    free(as->statements[i].text);
+  }
+  free(as->statements);
+  for (int i = 0; i < as->num_macros; ++i) {
+    APEX_Asm_Macro* macro = &as->macros[i];
+    for (int j = 0; j < macro->body_size && macro->body; ++j) {
+      free(macro->body[j].text);
+    }
+    for (int j = 0; j < macro->num_params; ++j) {
+      free(macro->params[j]);
+    }
+    free(macro->body);
+    free(macro->name);
+  }
+  free(as->macros);
+  for (int i = 0; i < as->symbol_capacity; ++i) {
+    free(as->symbols[i].name);
+  }
+  free(as->symbols);
+  free(as->code);
+  APEX_memory_free(&as->data);
+}
+
+/* Assembles size bytes of source into as->code and as->data */
+static int
+assemble(APEX_Assembler* as, char* source, size_t size)
+{
+  /* Comments and blanks go, lines stay numbered */
+  int count = 1;
+  for (size_t i = 0; i < size; ++i) {
+    count += source[i] == '\n';
+  }
+  APEX_Asm_Line* lines = malloc(sizeof(*lines) * count);
+  if (!lines) {
+    return -1;
+  }
+  char* text = source;
+  for (int i = 0; i < count; ++i) {
+    char* newline = strchr(text, '\n');
+    if (newline) {
+      *newline = '\0';
+    }
+    char* comment = strchr(text, ';');
+    if (comment) {
+      *comment = '\0';
+    }
+    lines[i].text = APEX_trim(text);
+    lines[i].line = i + 1;
+    text = newline ? newline + 1 : text + strlen(text);
+  }
+
+  expand(as, lines, count, 0);
+  free(lines);
+  if (!as->errors) {
+    assemble_pass(as, 1);
+  }
+  if (!as->errors && as->code_size == 0) {
+    fprintf(stderr, "APEX_Error : %s: no instructions\n", as->filename);
+    return -1;
+  }
+  if (!as->errors) {
+    as->code = calloc(as->code_size, sizeof(*as->code));
+    if (!as->code) {
+      return -1;
+    }
+    assemble_pass(as, 2);
+  }
+  if (as->errors > ASM_MAX_ERRORS) {
+    fprintf(stderr, "APEX_Error : %s: %d more errors\n", as->filename,
+            as->errors - ASM_MAX_ERRORS);
+  }
+  return as->errors ? -1 : 0;
+}
+
+static char*
+read_source(const char* path, size_t* size)
+{
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    return NULL;
+  }
+  char* source = NULL;
+  struct stat st;
+  if (fstat(fileno(fp), &st) == 0 && (source = malloc(st.st_size + 1))) {
+    *size = fread(source, 1, st.st_size, fp);
+    source[*size] = '\0';
+  }
+  fclose(fp);
+  return source;
+}
+
+/*
+ * Loads the assembler source at path into cpu, from the cache when the
+ * source is unchanged. Returns 1 if path is not assembler source (.s),
+ * and -1 if it does not assemble.
+ */
+int
+APEX_asm_load(APEX_CPU* cpu, const char* path)
+{
+  size_t len = strlen(path);
+  if (len < 3 || strcmp(path + len - 2, ".s") != 0) {
+    return 1;
+  }
+
+  size_t size;
+  char* source = read_source(path, &size);
+  if (!source) {
+    return -1;
+  }
+
+  /* The cache lives in .apexcache next to the source */
+  char version[32];
+  snprintf(version, sizeof(version), "APEX assembler %d\n", ASM_VERSION);
+  unsigned long long hash =
+    APEX_hash_bytes(APEX_hash_bytes(APEX_HASH_INIT, version, strlen(version)),
+                    source, size);
+  const char* slash = strrchr(path, '/');
+  char cache_dir[4000];
+  char cache_path[4096];
+  snprintf(cache_dir, sizeof(cache_dir), "%.*s.apexcache",
+           slash ? (int)(slash - path + 1) : 0, path);
+  snprintf(cache_path, sizeof(cache_path), "%s/%016llx.apexbin", cache_dir,
+           hash);
+  if (APEX_image_load(cpu, cache_path) == 0) {
+    free(source);
+    return 0;
+  }
+
+  APEX_Assembler* as = calloc(1, sizeof(*as));
+  if (!as) {
+    free(source);
+    return -1;
+  }
+  as->filename = path;
+  int status = assemble(as, source, size);
+  free(source);
+  if (status == 0) {
+    mkdir(cache_dir, 0777);
+    /* Without a usable cache the assembled memories are kept as they are */
+    if (APEX_image_write(cache_path, as->code, as->code_size, &as->data) != 0 ||
+        APEX_image_load(cpu, cache_path) != 0) {
+      cpu->code_memory = as->code;
+      cpu->code_memory_size = as->code_size;
+      cpu->memory = as->data;
+      as->code = NULL;
+      memset(&as->data, 0, sizeof(as->data));
+    }
+  }
+  free_assembler(as);
+  free(as);
+  return status;
+}
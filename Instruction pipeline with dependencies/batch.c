@@ -0,0 +1,351 @@
+/*
+ *  batch.c
+ *  Contains the batch runner: simulates every program of a manifest in
+ *  one process on a work-stealing thread pool and writes one summary
+ *
+ *  Manifest lines are "<input_file> [cycles] [display|simulate|functional]",
+ *  the cycles may be left out before a mode. Blank lines and lines
+ *  starting with '#' are ignored. Every job gets its
+ *  own APEX_CPU whose output goes to a private memory stream, so only a
+ *  hash and the size of the output reach the summary.
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+typedef struct APEX_Batch_Job
+{
+  char* program;
+  char mode[16];
+  int cycles;
+  int status;		// 0 when the program loaded and ran
+  int clock;
+  long retired;
+  int halted;
+  size_t output_size;
+  unsigned long long output_hash;	// FNV-1a of the output
+  double seconds;
+} APEX_Batch_Job;
+
+/*
+ * Each worker owns a range of job indices. The owner takes from the
+ * bottom, idle workers steal from the top of another worker's range.
+ */
+typedef struct APEX_Batch_Queue
+{
+  int top;
+  int bottom;
+  pthread_mutex_t lock;
+} APEX_Batch_Queue;
+
+typedef struct APEX_Batch_Pool
+{
+  APEX_Batch_Job* jobs;
+  APEX_Batch_Queue* queues;
+  int workers;
+} APEX_Batch_Pool;
+
+typedef struct APEX_Batch_Worker
+{
+  APEX_Batch_Pool* pool;
+  int id;
+  long stolen;
+} APEX_Batch_Worker;
+
+static void
+run_job(APEX_Batch_Job* job)
+{
+  char* output = NULL;
+  size_t size = 0;
+  double start = APEX_now_seconds();
+  FILE* out = open_memstream(&output, &size);
+  APEX_CPU* cpu = out ? APEX_cpu_init(job->program) : NULL;
+
+  job->status = -1;
+  if (cpu) {
+    cpu->out = out;
+    cpu->log = out;
+    cpu->f = job->mode;
+    cpu->display = strcmp(job->mode, "display") == 0;
+    cpu->cycle = job->cycles;
+    APEX_cpu_print_code_memory(cpu);
+    if (strcmp(job->mode, "functional") == 0) {
+      APEX_cpu_run_functional(cpu);
+      job->halted = cpu->halt != 0;
+      job->retired = cpu->clock;
+    } else {
+      APEX_cpu_run(cpu);
+      job->halted = APEX_cpu_finished(cpu);
+      job->retired = cpu->retired;
+    }
+    job->status = 0;
+    job->clock = cpu->clock;
+    APEX_cpu_stop(cpu);
+  }
+  if (out) {
+    fclose(out);
+    job->output_size = size;
+    job->output_hash = APEX_hash_bytes(APEX_HASH_INIT, output, size);
+    free(output);
+  }
+  job->seconds = APEX_now_seconds() - start;
+}
+
+/* Returns the next job for worker id, stealing when its own range is empty */
+static int
+next_job(APEX_Batch_Worker* worker)
+{
+  APEX_Batch_Pool* pool = worker->pool;
+  APEX_Batch_Queue* own = &pool->queues[worker->id];
+  int job = -1;
+
+  pthread_mutex_lock(&own->lock);
+  if (own->top < own->bottom) {
+    job = --own->bottom;
+  }
+  pthread_mutex_unlock(&own->lock);
+
+  for (int i = 1; job < 0 && i < pool->workers; ++i) {
+    APEX_Batch_Queue* victim =
+      &pool->queues[(worker->id + i) % pool->workers];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->top < victim->bottom) {
+      job = victim->top++;
+      worker->stolen++;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return job;
+}
+
+static void*
+batch_worker(void* arg)
+{
+  APEX_Batch_Worker* worker = arg;
+  int job;
+
+  /* Jobs are never added, so no work anywhere means the batch is done */
+  while ((job = next_job(worker)) >= 0) {
+    run_job(&worker->pool->jobs[job]);
+  }
+  return NULL;
+}
+
+#define MANIFEST_SPACE " \t\r\n"
+
+static int
+is_mode(const char* field)
+{
+  return strcmp(field, "display") == 0 || strcmp(field, "simulate") == 0 ||
+         strcmp(field, "functional") == 0;
+}
+
+/*
+ * Fills job from the fields after the input file, continuing the strtok
+ * of its manifest line. Returns -1 with the problem reported if they are
+ * malformed.
+ */
+static int
+parse_job_fields(APEX_Batch_Job* job, const char* manifest, int line_number)
+{
+  char* cycles = strtok(NULL, MANIFEST_SPACE);
+  char* mode = strtok(NULL, MANIFEST_SPACE);
+  char* extra = strtok(NULL, MANIFEST_SPACE);
+
+  if (cycles && !mode && is_mode(cycles)) {
+    mode = cycles;
+    cycles = NULL;
+  }
+  if (cycles) {
+    char* end;
+    long value = strtol(cycles, &end, 10);
+    if (end == cycles || *end || value < INT_MIN || value > INT_MAX) {
+      fprintf(stderr, "APEX_Error : %s:%d: cycles %s is not a number\n",
+              manifest, line_number, cycles);
+      return -1;
+    }
+    job->cycles = value;
+  }
+  if (mode) {
+    if (!is_mode(mode)) {
+      fprintf(stderr, "APEX_Error : %s:%d: unknown mode %s\n", manifest,
+              line_number, mode);
+      return -1;
+    }
+    snprintf(job->mode, sizeof(job->mode), "%s", mode);
+  }
+  if (extra) {
+    fprintf(stderr, "APEX_Error : %s:%d: unexpected %s\n", manifest,
+            line_number, extra);
+    return -1;
+  }
+  return 0;
+}
+
+/* Reads the manifest, returns the number of jobs or -1 on error */
+static int
+read_manifest(const char* manifest, int cycles, APEX_Batch_Job** jobs)
+{
+  FILE* fp = fopen(manifest, "r");
+  char* line = NULL;
+  size_t len = 0;
+  int count = 0;
+  int capacity = 0;
+  int error = 0;
+  *jobs = NULL;
+
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open manifest %s\n", manifest);
+    return -1;
+  }
+
+  int line_number = 0;
+  while (getline(&line, &len, fp) != -1) {
+    APEX_Batch_Job job = { 0 };
+    line_number++;
+
+    job.cycles = cycles;
+    strcpy(job.mode, "simulate");
+    char* program = strtok(line, MANIFEST_SPACE);
+    if (!program || program[0] == '#') {
+      continue;
+    }
+    if (parse_job_fields(&job, manifest, line_number) != 0) {
+      error = 1;
+      break;
+    }
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      APEX_Batch_Job* grown = realloc(*jobs, sizeof(**jobs) * capacity);
+      if (!grown) {
+        error = 1;
+        break;
+      }
+      *jobs = grown;
+    }
+    job.program = strdup(program);
+    (*jobs)[count++] = job;
+  }
+  free(line);
+  fclose(fp);
+  if (error) {
+    for (int i = 0; i < count; ++i) {
+      free((*jobs)[i].program);
+    }
+    return -1;
+  }
+  return count;
+}
+
+static int
+write_summary(const char* summary, APEX_Batch_Job* jobs, int count,
+              double seconds, long stolen)
+{
+  FILE* fp = fopen(summary, "w");
+  if (!fp) {
+    return -1;
+  }
+
+  int failed = 0;
+  long cycles = 0;
+  fprintf(fp, "# program mode cycles status clock retired halted "
+              "output_bytes output_hash seconds\n");
+  for (int i = 0; i < count; ++i) {
+    APEX_Batch_Job* job = &jobs[i];
+    fprintf(fp, "%s %s %d %s %d %ld %d %zu %016llx %.6f\n", job->program,
+            job->mode, job->cycles, job->status ? "error" : "ok", job->clock,
+            job->retired, job->halted, job->output_size, job->output_hash,
+            job->seconds);
+    failed += job->status != 0;
+    cycles += job->clock;
+  }
+  fprintf(fp, "# jobs %d failed %d cycles %ld stolen %ld seconds %.3f\n",
+          count, failed, cycles, stolen, seconds);
+  return fclose(fp) == 0 ? 0 : -1;
+}
+
+/*
+ *  Batch loop: runs every job of manifest on threads workers and writes
+ *  one line per job, in manifest order, to summary. cycles is the budget
+ *  of jobs that do not give their own. Returns -1 if the batch could not
+ *  run or any job failed to load.
+ */
+int
+APEX_batch_run(const char* manifest, const char* summary, int cycles,
+               int threads)
+{
+  APEX_Batch_Job* jobs;
+  int count = read_manifest(manifest, cycles, &jobs);
+  if (count < 0) {
+    free(jobs);
+    return -1;
+  }
+
+  if (threads > count) {
+    threads = count > 0 ? count : 1;
+  }
+  APEX_Batch_Pool pool = { jobs, calloc(threads, sizeof(APEX_Batch_Queue)),
+                           threads };
+  APEX_Batch_Worker* workers = calloc(threads, sizeof(*workers));
+  pthread_t* handles = calloc(threads, sizeof(*handles));
+  if (!pool.queues || !workers || !handles) {
+    free(pool.queues);
+    free(workers);
+    free(handles);
+    free(jobs);
+    return -1;
+  }
+
+  /* Contiguous starting ranges; stealing evens out the job lengths */
+  for (int i = 0; i < threads; ++i) {
+    pool.queues[i].top = (long)count * i / threads;
+    pool.queues[i].bottom = (long)count * (i + 1) / threads;
+    pthread_mutex_init(&pool.queues[i].lock, NULL);
+    workers[i].pool = &pool;
+    workers[i].id = i;
+  }
+
+  double start = APEX_now_seconds();
+  int started = 0;
+  while (started < threads &&
+         pthread_create(&handles[started], NULL, batch_worker,
+                        &workers[started]) == 0) {
+    started++;
+  }
+  /* Without threads the ranges of all workers drain through worker 0 */
+  if (started == 0) {
+    batch_worker(&workers[0]);
+  }
+  long stolen = 0;
+  for (int i = 0; i < started; ++i) {
+    pthread_join(handles[i], NULL);
+  }
+  for (int i = 0; i < threads; ++i) {
+    stolen += workers[i].stolen;
+    pthread_mutex_destroy(&pool.queues[i].lock);
+  }
+  double seconds = APEX_now_seconds() - start;
+
+  int status = write_summary(summary, jobs, count, seconds, stolen);
+  if (status != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", summary);
+  }
+  for (int i = 0; i < count; ++i) {
+    status |= jobs[i].status;
+    free(jobs[i].program);
+  }
+  fprintf(stderr, "APEX_CPU : Ran %d jobs on %d threads in %.3f s, summary "
+                  "in %s\n", count, threads, seconds, summary);
+
+  free(pool.queues);
+  free(workers);
+  free(handles);
+  free(jobs);
+  return status ? -1 : 0;
+}
@@ -0,0 +1,321 @@
+/*
+ *  checkpoint.c
+ *  Contains binary checkpoint and restore of the complete APEX_CPU state
+ *
+ *  File layout (host byte order):
+ *    APEX_Checkpoint_Header
+ *    scalar state, latches, forwarding arrays and flags
+ *    code memory   (code_memory_size APEX_Instruction records)
+ *    data memory   (page count, then number and words of every page)
+ *  The header records the layout sizes so a checkpoint is only restored
+ *  by a build with the same APEX_CPU layout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+#define CHECKPOINT_MAGIC "APEXCKPT"
+
+typedef struct APEX_Checkpoint_Header
+{
+  char magic[8];
+  int version;
+  int stage_size;	// sizeof(CPU_Stage)
+  int instruction_size;	// sizeof(APEX_Instruction)
+  int page_words;	// APEX_PAGE_WORDS
+  int code_memory_size;
+} APEX_Checkpoint_Header;
+
+/* Child processes still writing a checkpoint */
+static pid_t pending[16];
+static int num_pending;
+
+/*
+ * Reads or writes one field. Every field of the state goes through this
+ * table so save and restore can never disagree on the layout.
+ */
+typedef size_t (*Transfer)(void* ptr, size_t size, size_t n, FILE* fp);
+
+static size_t
+read_field(void* ptr, size_t size, size_t n, FILE* fp)
+{
+  return fread(ptr, size, n, fp);
+}
+
+static size_t
+write_field(void* ptr, size_t size, size_t n, FILE* fp)
+{
+  return fwrite(ptr, size, n, fp);
+}
+
+/* Only allocated pages are saved, restore allocates them again */
+static int
+transfer_memory(APEX_Memory* memory, FILE* fp, Transfer io)
+{
+  int pages = memory->pages;
+  if (io(&pages, sizeof(pages), 1, fp) != 1 || pages < 0) {
+    return -1;
+  }
+  unsigned int page = 0;
+  for (int i = 0; i < pages; ++i, ++page) {
+    int* words = NULL;
+    if (io == write_field) {
+      words = APEX_memory_next(memory, &page);
+    }
+    if (io(&page, sizeof(page), 1, fp) != 1) {
+      return -1;
+    }
+    if (!words) {
+      words = APEX_memory_page(memory, page, 1);
+    }
+    if (!words ||
+        io(words, sizeof(int), APEX_PAGE_WORDS, fp) != APEX_PAGE_WORDS) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int
+transfer_state(APEX_CPU* cpu, FILE* fp, Transfer io)
+{
+  struct
+  {
+    void* ptr;
+    size_t size;
+  } fields[] = {
+    { &cpu->clock, sizeof(cpu->clock) },
+    { &cpu->pc, sizeof(cpu->pc) },
+    { cpu->regs, sizeof(cpu->regs) },
+    { cpu->stage, sizeof(cpu->stage) },
+    { cpu->stage_set, sizeof(cpu->stage_set) },
+    { cpu->stage_check, sizeof(cpu->stage_check) },
+    { &cpu->score, sizeof(cpu->score) },
+    { &cpu->retired, sizeof(cpu->retired) },
+    { &cpu->decode_stalls, sizeof(cpu->decode_stalls) },
+    { &cpu->execute_busy, sizeof(cpu->execute_busy) },
+    { &cpu->flushes, sizeof(cpu->flushes) },
+    { cpu->cpi, sizeof(cpu->cpi) },
+    { cpu->bubble, sizeof(cpu->bubble) },
+    { &cpu->cycle_cause, sizeof(cpu->cycle_cause) },
+    { &cpu->last_completed, sizeof(cpu->last_completed) },
+    { &cpu->halt, sizeof(cpu->halt) },
+    { &cpu->zflag, sizeof(cpu->zflag) },
+    { &cpu->nzflag, sizeof(cpu->nzflag) },
+    { &cpu->config, sizeof(cpu->config) },
+    { &cpu->ex_wait, sizeof(cpu->ex_wait) },
+  };
+
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+    if (io(fields[i].ptr, fields[i].size, 1, fp) != 1) {
+      return -1;
+    }
+  }
+  if (io(cpu->code_memory, sizeof(*cpu->code_memory),
+         cpu->code_memory_size, fp) != (size_t)cpu->code_memory_size) {
+    return -1;
+  }
+  return transfer_memory(&cpu->memory, fp, io);
+}
+
+/*
+ * The pipeline indexes tables with the opcode and register fields of
+ * code memory and of the latches, so a restored file is checked like an
+ * image before it is run. Returns 0 if every record is in range.
+ */
+static int
+check_state(const APEX_CPU* cpu)
+{
+  if (APEX_check_code(cpu->code_memory, cpu->code_memory_size) >= 0) {
+    return -1;
+  }
+  for (int i = 0; i < NUM_STAGES; ++i) {
+    const CPU_Stage* stage = &cpu->stage[i];
+    if (stage->opcode >= NUM_OPCODES || stage->rd >= 32 ||
+        stage->rs1 >= 32 || stage->rs2 >= 32) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void
+fill_header(APEX_Checkpoint_Header* header, APEX_CPU* cpu)
+{
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+  header->version = APEX_CHECKPOINT_VERSION;
+  header->stage_size = sizeof(CPU_Stage);
+  header->instruction_size = sizeof(APEX_Instruction);
+  header->page_words = APEX_PAGE_WORDS;
+  header->code_memory_size = cpu->code_memory_size;
+}
+
+/* Writes the checkpoint to a temporary file and renames it into place */
+static int
+write_checkpoint(APEX_CPU* cpu, const char* path)
+{
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE* fp = fopen(tmp_path, "wb");
+  if (!fp) {
+    return -1;
+  }
+
+  APEX_Checkpoint_Header header;
+  fill_header(&header, cpu);
+  int status = fwrite(&header, sizeof(header), 1, fp) == 1 ? 0 : -1;
+  if (!status) {
+    status = transfer_state(cpu, fp, write_field);
+  }
+  if (fclose(fp) != 0) {
+    status = -1;
+  }
+  if (!status && rename(tmp_path, path) != 0) {
+    status = -1;
+  }
+  if (status) {
+    remove(tmp_path);
+  }
+  return status;
+}
+
+/* Set once a checkpoint of this process failed to be written */
+static int any_failed;
+
+/* Reaps finished checkpoint writers, or all of them if block is set */
+static int
+reap_pending(int block)
+{
+  int status = 0;
+  int kept = 0;
+
+  for (int i = 0; i < num_pending; ++i) {
+    int child_status;
+    pid_t done = waitpid(pending[i], &child_status, block ? 0 : WNOHANG);
+    if (done == 0) {
+      pending[kept++] = pending[i];
+    } else if (done < 0 || !WIFEXITED(child_status) ||
+               WEXITSTATUS(child_status) != 0) {
+      status = -1;
+      any_failed = 1;
+    }
+  }
+  num_pending = kept;
+  return status;
+}
+
+/*
+ * Saves the complete CPU state to path. The file is written by a forked
+ * child working on a copy-on-write image of the process, so the caller
+ * continues simulating immediately. Falls back to writing in place if
+ * fork is unavailable.
+ */
+int
+APEX_cpu_checkpoint(APEX_CPU* cpu, const char* path)
+{
+  if (reap_pending(0) != 0) {
+    fprintf(stderr, "APEX_Error : A previous checkpoint failed\n");
+  }
+
+  pid_t pid = -1;
+  if (num_pending < (int)(sizeof(pending) / sizeof(pending[0]))) {
+    fflush(NULL);
+    pid = fork();
+  }
+  if (pid == 0) {
+    _exit(write_checkpoint(cpu, path) == 0 ? 0 : 1);
+  }
+  if (pid < 0) {
+    int status = write_checkpoint(cpu, path);
+    any_failed |= status != 0;
+    return status;
+  }
+  pending[num_pending++] = pid;
+  return 0;
+}
+
+/*
+ * Reports a checkpoint that was asked for but not taken because the run
+ * never was at the start of its cycle. Returns -1 in that case, otherwise 0.
+ */
+int
+APEX_checkpoint_missed(APEX_CPU* cpu, int taken)
+{
+  if (!cpu->checkpoint_path || taken) {
+    return 0;
+  }
+  fprintf(cpu->log, "APEX_Error : Checkpoint cycle %d not reached, run "
+                    "ended at cycle %d, %s not written\n", cpu->checkpoint_at,
+          cpu->clock, cpu->checkpoint_path);
+  return -1;
+}
+
+/*
+ * Waits for all outstanding checkpoint writers. Returns -1 if any
+ * checkpoint of this process failed, including those reaped earlier.
+ */
+int
+APEX_cpu_checkpoint_wait(void)
+{
+  reap_pending(1);
+  return any_failed ? -1 : 0;
+}
+
+/*
+ * Creates an APEX cpu from a checkpoint written by APEX_cpu_checkpoint.
+ * Run options (display mode, cycle limit) are not part of the saved
+ * state and must be set by the caller.
+ */
+APEX_CPU*
+APEX_cpu_restore(const char* path)
+{
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    return NULL;
+  }
+
+  APEX_CPU* cpu = calloc(1, sizeof(*cpu));
+  APEX_Checkpoint_Header header;
+  APEX_Checkpoint_Header expected;
+  if (!cpu || fread(&header, sizeof(header), 1, fp) != 1) {
+    goto fail;
+  }
+
+  cpu->code_memory_size = header.code_memory_size;
+  fill_header(&expected, cpu);
+  if (memcmp(&header, &expected, sizeof(header)) != 0 ||
+      header.code_memory_size <= 0) {
+    fprintf(stderr, "APEX_Error : %s is not a compatible checkpoint\n", path);
+    goto fail;
+  }
+
+  cpu->code_memory = malloc(sizeof(*cpu->code_memory) * cpu->code_memory_size);
+  if (!cpu->code_memory ||
+      transfer_state(cpu, fp, read_field) != 0) {
+    goto fail;
+  }
+  if (check_state(cpu) != 0) {
+    fprintf(stderr, "APEX_Error : %s is not a compatible checkpoint\n", path);
+    goto fail;
+  }
+  fclose(fp);
+  cpu->out = stdout;
+  cpu->log = stderr;
+  return cpu;
+
+fail:
+  if (cpu) {
+    free(cpu->code_memory);
+    APEX_memory_free(&cpu->memory);
+    free(cpu);
+  }
+  fclose(fp);
+  return NULL;
+}
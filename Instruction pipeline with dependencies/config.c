@@ -0,0 +1,184 @@
+/*
+ *  config.c
+ *  Contains the run configuration of the pipeline, read from a file of
+ *  "<key> = <value>" lines. Blank lines and '#' comments are skipped.
+ *
+ *  Keys:
+ *    latency.<OPCODE>  EX cycles of an opcode (default 1, MUL 2)
+ *    mem_latency       cycles of a LOAD, LDR or STORE access (default 1)
+ *    forwarding        on or off (default on); without forwarding a
+ *                      source waits until its producer has written back
+ *    mem_size          bytes of data address space, with an optional K, M
+ *                      or G suffix, up to 4G (default 16000); LOAD and
+ *                      STORE addresses wrap around it
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cpu.h"
+
+/* Upper bound of a latency, keeps a mistyped value from stalling forever */
+#define CONFIG_MAX_LATENCY 1000
+
+/*
+ * Returns 1 if some opcode holds EX beyond its base cycles (MUL's second
+ * cycle is base), or decode waits for writeback. Only then can a cycle
+ * leave the pipeline unchanged and be skipped by APEX_cpu_advance.
+ */
+static int
+config_may_hold(const APEX_Config* config)
+{
+  if (!config->forwarding) {
+    return 1;
+  }
+  for (int op = 0; op < NUM_OPCODES; ++op) {
+    int ins_class = opcode_info[op].ins_class;
+    if (ins_class == CLASS_NONE) {
+      continue;
+    }
+    if (config->latency[op] > (op == OP_MUL ? 2 : 1)) {
+      return 1;
+    }
+    if ((ins_class == CLASS_LOAD || ins_class == CLASS_STORE) &&
+        config->mem_latency > 1) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void
+APEX_config_default(APEX_Config* config)
+{
+  memset(config, 0, sizeof(*config));
+  for (int op = 0; op < NUM_OPCODES; ++op) {
+    config->latency[op] = 1;
+  }
+  config->latency[OP_MUL] = 2;
+  config->mem_latency = 1;
+  config->forwarding = 1;
+  config->mem_words = 4000;
+  config->may_hold = config_may_hold(config);
+}
+
+static int
+parse_latency(const char* value, int* latency)
+{
+  char* end;
+  long n = strtol(value, &end, 10);
+  if (end == value || *end || n < 1 || n > CONFIG_MAX_LATENCY) {
+    return -1;
+  }
+  *latency = n;
+  return 0;
+}
+
+/* Reads a size in bytes, a whole number of words up to 4 GB */
+static int
+parse_mem_size(const char* value, unsigned int* words)
+{
+  char* end;
+  unsigned long long n = strtoull(value, &end, 10);
+  if (end == value || value[0] == '-') {
+    return -1;
+  }
+  int shift = 0;
+  if (*end) {
+    const char* suffixes = "KMG";
+    const char* suffix = strchr(suffixes, toupper((unsigned char)*end));
+    if (!suffix || end[1]) {
+      return -1;
+    }
+    shift = 10 * (int)(suffix - suffixes + 1);
+  }
+  if (n == 0 || n > (4ull << 30) >> shift) {
+    return -1;
+  }
+  n <<= shift;
+  if (n % sizeof(int)) {
+    return -1;
+  }
+  *words = n / sizeof(int);
+  return 0;
+}
+
+static int
+set_parameter(APEX_Config* config, const char* key, const char* value)
+{
+  if (strncmp(key, "latency.", 8) == 0) {
+    for (int op = 0; op < NUM_OPCODES; ++op) {
+      if (opcode_info[op].ins_class != CLASS_NONE &&
+          strcasecmp(key + 8, opcode_info[op].name) == 0) {
+        return parse_latency(value, &config->latency[op]);
+      }
+    }
+    return -1;
+  }
+  if (strcmp(key, "mem_latency") == 0) {
+    return parse_latency(value, &config->mem_latency);
+  }
+  if (strcmp(key, "mem_size") == 0) {
+    return parse_mem_size(value, &config->mem_words);
+  }
+  if (strcmp(key, "forwarding") == 0) {
+    if (strcmp(value, "on") == 0 || strcmp(value, "1") == 0) {
+      config->forwarding = 1;
+    } else if (strcmp(value, "off") == 0 || strcmp(value, "0") == 0) {
+      config->forwarding = 0;
+    } else {
+      return -1;
+    }
+    return 0;
+  }
+  return -1;
+}
+
+/* Sets one parameter, returns -1 for an unknown key or a bad value */
+int
+APEX_config_set(APEX_Config* config, const char* key, const char* value)
+{
+  int status = set_parameter(config, key, value);
+  config->may_hold = config_may_hold(config);
+  return status;
+}
+
+/* Applies the settings of a config file on top of config */
+int
+APEX_config_load(APEX_Config* config, const char* path)
+{
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open config %s\n", path);
+    return -1;
+  }
+
+  char line[1024];
+  int line_number = 0;
+  int status = 0;
+  while (status == 0 && fgets(line, sizeof(line), fp)) {
+    line_number++;
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    char* key = APEX_trim(line);
+    if (!*key) {
+      continue;
+    }
+    char* equals = strchr(key, '=');
+    if (equals) {
+      *equals = '\0';
+      key = APEX_trim(key);
+    }
+    if (!equals || APEX_config_set(config, key, APEX_trim(equals + 1)) != 0) {
+      fprintf(stderr, "APEX_Error : %s:%d: bad setting %s\n", path,
+              line_number, key);
+      status = -1;
+    }
+  }
+  fclose(fp);
+  return status;
+}
@@ -6,6 +6,7 @@
  *  Gaurav Kothari (gkothar1@binghamton.edu)
  *  State University of New York, Binghamton
  */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +16,16 @@
 /* Set this flag to 1 to enable debug messages */
 #define ENABLE_DEBUG_MESSAGES 1
 
+/* R0-R15, whose forwarding and valid bits are swept every cycle */
+#define LOW_REGS 0xFFFFu
+
+/* Bit of register reg in the valid and forwarding masks */
+static inline unsigned int
+reg_bit(int reg)
+{
+	return 1u << reg;
+}
+
 /*
  * This function creates and initializes APEX cpu.
  *
@@ -28,53 +39,119 @@ APEX_cpu_init(const char* filename)
 		return NULL;
 	}
 
-	APEX_CPU* cpu = malloc(sizeof(*cpu));
+	APEX_CPU* cpu = calloc(1, sizeof(*cpu));
 	if (!cpu) {
 		return NULL;
 	}
 
   /* Initialize PC, Registers and all pipeline stages */
 	cpu->pc = 4000;
-	cpu->halt=0;
 	memset(cpu->regs, 0, sizeof(int) * 32);
-	memset(cpu->regs_valid, 1, sizeof(int) * 32);
-	memset(cpu->stage, 0, sizeof(CPU_Stage) * NUM_STAGES);
-	memset(cpu->data_memory, 0, sizeof(int) * 4000);
-	memset(cpu->stage_set,1,sizeof(int) * 5 * 2);
-	memset(cpu->stage_check,0,sizeof(int) * 5 * 2);
-	memset(cpu->regs_forward,0,sizeof(int) *32);
-	memset(cpu->ex_forward,0,sizeof(int) * 32);
-	memset(cpu->wb_forward,0,sizeof(int) * 32);
-	memset(cpu->mem_forward,0,sizeof(int) * 32);
+	APEX_config_default(&cpu->config);
+	APEX_cpu_reset_pipeline(cpu);
 
-  /* Parse input file and create code memory */
-	cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
+  /* Map a binary image as is, assemble .s source, otherwise parse input file */
+	int status;
+	APEX_ZONE(ZONE_IMAGE, status = APEX_image_load(cpu, filename));
+	if (status > 0) {
+		APEX_ZONE(ZONE_ASSEMBLE, status = APEX_asm_load(cpu, filename));
+	}
+	if (status > 0) {
+		APEX_ZONE(ZONE_PARSE, cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size));
+		status = cpu->code_memory ? 0 : -1;
+	}
 
-	if (!cpu->code_memory) {
+	if (status != 0) {
+		APEX_memory_free(&cpu->memory);
 		free(cpu);
 		return NULL;
 	}
 
+	cpu->out = stdout;
+	cpu->log = stderr;
+	return cpu;
+}
+
+/*
+ * Prints the loaded program when debug messages are enabled
+ */
+void
+APEX_cpu_print_code_memory(APEX_CPU* cpu)
+{
 	if (ENABLE_DEBUG_MESSAGES) {
-		fprintf(stderr,"APEX_CPU : Initialized APEX CPU, loaded %d instructions\n",cpu->code_memory_size);
-		fprintf(stderr, "APEX_CPU : Printing Code Memory\n");
-		printf("%-9s %-9s %-9s %-9s %-9s\n", "opcode", "rd", "rs1", "rs2", "imm");
+		fprintf(cpu->log, "APEX_CPU : Initialized APEX CPU, loaded %d instructions\n",cpu->code_memory_size);
+		fprintf(cpu->log, "APEX_CPU : Printing Code Memory\n");
+		fprintf(cpu->out, "%-9s %-9s %-9s %-9s %-9s\n", "opcode", "rd", "rs1", "rs2", "imm");
 
 		for (int i = 0; i < cpu->code_memory_size; ++i) {
-			printf("%-9s %-9d %-9d %-9d %-9d\n",
-				cpu->code_memory[i].opcode,
+			fprintf(cpu->out, "%-9s %-9d %-9d %-9d %-9d\n",
+				opcode_info[cpu->code_memory[i].opcode].name,
 				cpu->code_memory[i].rd,
 				cpu->code_memory[i].rs1,
 				cpu->code_memory[i].rs2,
 				cpu->code_memory[i].imm);
 		}
 	}
+}
+
+/*
+ * Returns a private copy of the CPU for another run over the same code
+ * memory. The copy never displays, profiles or checkpoints, and is
+ * released with APEX_cpu_free_clone since code memory stays with the
+ * original. Data memory pages are copied, the original is only read.
+ */
+APEX_CPU*
+APEX_cpu_clone(APEX_CPU* cpu)
+{
+	APEX_CPU* copy = malloc(sizeof(*copy));
+	if (copy) {
+		memcpy(copy, cpu, sizeof(*copy));
+		copy->display = 0;
+		copy->trace = NULL;
+		copy->trace_record = NULL;
+		copy->timeline = NULL;
+		copy->seq_profile = NULL;
+		copy->lanes = NULL;
+		copy->checkpoint_path = NULL;
+		if (APEX_memory_copy(&copy->memory, &cpu->memory) != 0) {
+			free(copy);
+			return NULL;
+		}
+	}
+	return copy;
+}
+
+void
+APEX_cpu_free_clone(APEX_CPU* copy)
+{
+	if (copy) {
+		APEX_memory_free(&copy->memory);
+		free(copy);
+	}
+}
+
+/*
+ * Empties all pipeline latches and hazard state, leaving the
+ * architectural state (pc, registers, flags, memory) untouched.
+ * Used at start-up and when a functional run hands over to the pipeline.
+ */
+void
+APEX_cpu_reset_pipeline(APEX_CPU* cpu)
+{
+	cpu->halt=0;
+	cpu->drain=0;
+	cpu->ex_wait=0;
+	memset(cpu->stage, 0, sizeof(CPU_Stage) * NUM_STAGES);
+	memset(cpu->stage_set,1,sizeof(int) * 5 * 2);
+	memset(cpu->stage_check,0,sizeof(int) * 5 * 2);
+	memset(cpu->score.ready, 0, sizeof(cpu->score.ready));
+	cpu->score.ready[PATH_RF]=~0u;
+	memset(cpu->bubble, CPI_FETCH, sizeof(cpu->bubble));
 
   /* Make all stages busy except Fetch stage, initally to start the pipeline */
 	for (int i = 1; i < NUM_STAGES; ++i) {
 		cpu->stage[i].busy = 1;
 	}
-	return cpu;
 }
 
 /*
@@ -86,7 +163,10 @@ APEX_cpu_init(const char* filename)
 void
 APEX_cpu_stop(APEX_CPU* cpu)
 {
-	free(cpu->code_memory);
+	APEX_profile_free(cpu);
+	free(cpu->fused);
+	APEX_image_release(cpu);
+	APEX_memory_free(&cpu->memory);
 	free(cpu);
 }
 
@@ -103,65 +183,239 @@ get_code_index(int pc)
 }
 
 static void
-print_instruction(CPU_Stage* stage)
+print_instruction(FILE* out, CPU_Stage* stage)
 {
-	if (strcmp(stage->opcode, "STORE") == 0) {
-		printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rs1, stage->rs2, stage->imm);
+	const char* name = opcode_info[stage->opcode].name;
+
+	switch (stage->opcode) {
+	case OP_STORE:
+		fprintf(out, "%s,R%d,R%d,#%d ", name, stage->rs1, stage->rs2, stage->imm);
+		break;
+	case OP_MOVC:
+		fprintf(out, "%s,R%d,#%d ", name, stage->rd, stage->imm);
+		break;
+	case OP_JUMP:
+		fprintf(out, "%s,R%d,#%d", name, stage->rs1, stage->imm);
+		break;
+	case OP_ADD:
+	case OP_SUB:
+	case OP_MUL:
+	case OP_AND:
+	case OP_OR:
+	case OP_XOR:
+	case OP_LDR:
+		fprintf(out, "%s,R%d,R%d,R%d", name, stage->rd, stage->rs1, stage->rs2);
+		break;
+	case OP_LOAD:
+		fprintf(out, "%s,R%d,R%d,#%d", name, stage->rd, stage->rs1, stage->imm);
+		break;
+	case OP_BZ:
+	case OP_BNZ:
+		fprintf(out, "%s,#%d", name, stage->imm);
+		break;
+	case OP_HALT:
+	case OP_NOP:
+		fprintf(out, "%s", name);
+		break;
+	default:
+		break;
 	}
-	if (strcmp(stage->opcode, "MOVC") == 0) {
-		printf("%s,R%d,#%d ", stage->opcode, stage->rd, stage->imm);
+}
+
+/* Debug function which dumps the cpu stage
+ * content
+ *
+ * Note : You are not supposed to edit this function
+ *
+ */
+static void
+print_stage_content(FILE* out, char* name, CPU_Stage* stage)
+{
+	fprintf(out, "%-15s: pc(%d) ", name, stage->pc);
+	print_instruction(out, stage);
+	fprintf(out, "\n");
+}
+
+static char* stage_names[NUM_STAGES] = {
+	"Fetch", "Decode/RF", "Execute", "Memory", "Writeback"
+};
+
+/* Prints latch index as display mode does, for the trace decoder */
+void
+APEX_print_stage(FILE* out, int index, CPU_Stage* stage)
+{
+	print_stage_content(out, stage_names[index], stage);
+}
+
+/* Prints the instruction in a latch as display mode does */
+void
+APEX_print_instruction(FILE* out, CPU_Stage* stage)
+{
+	print_instruction(out, stage);
+}
+
+/* Shows a latch in the display text, the binary trace and the timeline */
+static void
+show_stage(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	int index = stage - cpu->stage;
+
+	if (cpu->display & APEX_DISPLAY_TEXT) {
+		print_stage_content(cpu->out, stage_names[index], stage);
 	}
-	if(strcmp(stage->opcode, "HALT") == 0) {
-		printf("%s",stage->opcode);
+	if (cpu->display & APEX_DISPLAY_TRACE) {
+		cpu->trace_record->pc[index] = stage->pc;
+		cpu->trace_record->opcode[index] = stage->opcode;
+		cpu->trace_record->shown |= 1u << index;
 	}
-	if(strcmp(stage->opcode, "JUMP") == 0) {
-		printf("%s,R%d,#%d",stage->opcode,stage->rs1,stage->imm);
+	if (cpu->display & APEX_DISPLAY_TIMELINE) {
+		APEX_timeline_stage(cpu->timeline, index, stage);
 	}
+}
 
-	if (strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "SUB") == 0 || strcmp(stage->opcode, "MUL") == 0) {
-		printf("%s,R%d,R%d,R%d",stage->opcode,stage->rd,stage->rs1,stage->rs2);
-	}
-	if (strcmp(stage->opcode, "AND") == 0){
-		printf("%s,R%d,R%d,R%d",stage->opcode,stage->rd,stage->rs1,stage->rs2);
-	}
-	if(strcmp(stage->opcode, "OR") == 0) {
-		printf("%s,R%d,R%d,R%d",stage->opcode,stage->rd,stage->rs1,stage->rs2);
+/*
+ * Per-opcode stage handlers
+ *
+ * Every stage hands its latch to a handler selected by the latch opcode.
+ * The handler tables below are dispatched according to APEX_DISPATCH
+ * (see cpu.h): a compiler generated switch, an indirect call through the
+ * table, or computed-goto threaded code.
+ */
+typedef int (*APEX_Stage_Handler)(APEX_CPU* cpu, CPU_Stage* stage);
+
+#define DISPATCH_SWITCH_CASE(op) \
+	case OP_##op: return handlers[OP_##op](cpu, stage);
+#define DISPATCH_THREADED_LABEL(op) [OP_##op] = &&dispatch_##op,
+#define DISPATCH_THREADED_CASE(op) \
+	dispatch_##op: return handlers[OP_##op](cpu, stage);
+
+#if APEX_DISPATCH == APEX_DISPATCH_TABLE
+#define DISPATCH_BODY \
+	return handlers[stage->opcode](cpu, stage);
+#elif APEX_DISPATCH == APEX_DISPATCH_THREADED
+#define DISPATCH_BODY \
+	static void* const labels[NUM_OPCODES] = { APEX_OPCODES(DISPATCH_THREADED_LABEL) }; \
+	goto *labels[stage->opcode]; \
+	APEX_OPCODES(DISPATCH_THREADED_CASE)
+#else
+#define DISPATCH_BODY \
+	switch (stage->opcode) { \
+	APEX_OPCODES(DISPATCH_SWITCH_CASE) \
+	default: return 0; \
+	}
+#endif
+
+/* Defines a function that runs the handler of table for a latch */
+#define DEFINE_DISPATCHER(name, table) \
+	static inline int \
+	name(APEX_CPU* cpu, CPU_Stage* stage) \
+	{ \
+		const APEX_Stage_Handler* const handlers = table; \
+		DISPATCH_BODY \
+	}
+
+/* Handler for opcodes with nothing to do in a stage */
+static int
+handle_none(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	return 0;
+}
+
+static int
+is_flag_producer(int opcode)
+{
+	return opcode_info[opcode].sets_flags;
+}
+
+/*
+ * Cycles an instruction holds EX beyond the base pipeline. MUL's second
+ * cycle is kept by its own handlers. Memory latency is charged here as
+ * well: in this in-order pipeline a hold in EX delays exactly the
+ * instructions a hold in MEM would.
+ */
+static int
+extra_latency(APEX_CPU* cpu, int opcode)
+{
+	int ins_class = opcode_info[opcode].ins_class;
+	if (ins_class == CLASS_NONE) {
+		return 0;
 	}
-	if(strcmp(stage->opcode, "LOAD") == 0) {
-		printf("%s,R%d,R%d,#%d",stage->opcode,stage->rd,stage->rs1,stage->imm);
+	int extra = cpu->config.latency[opcode] - 1;
+	if (opcode == OP_MUL && extra > 0) {
+		extra--;
 	}
-	if(strcmp(stage->opcode, "LDR") == 0) {
-		printf("%s,R%d,R%d,R%d",stage->opcode,stage->rd,stage->rs1,stage->rs2);
+	if (ins_class == CLASS_LOAD || ins_class == CLASS_STORE) {
+		extra += cpu->config.mem_latency - 1;
 	}
+	return extra;
+}
 
-	if(strcmp(stage->opcode,"XOR") == 0) {
-		printf("%s,R%d,R%d,R%d",stage->opcode,stage->rd,stage->rs1,stage->rs2);
-	}
-	if(strcmp(stage->opcode,"NOP") == 0) {
-		printf("%s",stage->opcode);
-	}
-	if(strcmp(stage->opcode,"BZ") == 0) {
-		printf("%s,#%d",stage->opcode,stage->imm);
+/* Returns 1 if the latch holds a bubble */
+static inline int
+inert_latch(CPU_Stage* stage)
+{
+	return stage->opcode == OP_NONE || stage->opcode == OP_NOP;
+}
+
+/*
+ * CPI cause of the cycles EX holds an instruction of opcode: MUL, a
+ * BZ/BNZ waiting for its flags, or configured latency
+ */
+static int
+execute_hold_cause(APEX_CPU* cpu, int opcode)
+{
+	if (opcode == OP_MUL) {
+		return CPI_MUL;
 	}
-	if(strcmp(stage->opcode,"BNZ") == 0) {
-		printf("%s,#%d",stage->opcode,stage->imm);
+	if ((opcode == OP_BZ || opcode == OP_BNZ) && !cpu->stage_check[2][1]) {
+		return CPI_BRANCH_FLAGS;
 	}
+	return CPI_EX_LATENCY;
 }
 
-/* Debug function which dumps the cpu stage
- * content
- *
- * Note : You are not supposed to edit this function
- *
+/*
+ *  Fetch stage handlers, indexed by the opcode in the MEM latch.
+ *  A non-zero result holds fetch for the cycle.
  */
-static void
-print_stage_content(char* name, CPU_Stage* stage)
+static int
+fetch_gate_jump(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	return 1;
+}
+
+static int
+fetch_gate_bz(APEX_CPU* cpu, CPU_Stage* stage)
 {
-	printf("%-15s: pc(%d) ", name, stage->pc);
-	print_instruction(stage);
-	printf("\n");
+	return cpu->zflag;
 }
 
+static int
+fetch_gate_bnz(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	return cpu->nzflag;
+}
+
+static const APEX_Stage_Handler fetch_gate_handlers[NUM_OPCODES] = {
+	[OP_NONE] = handle_none,
+	[OP_MOVC] = handle_none,
+	[OP_ADD] = handle_none,
+	[OP_SUB] = handle_none,
+	[OP_MUL] = handle_none,
+	[OP_AND] = handle_none,
+	[OP_OR] = handle_none,
+	[OP_XOR] = handle_none,
+	[OP_LOAD] = handle_none,
+	[OP_LDR] = handle_none,
+	[OP_STORE] = handle_none,
+	[OP_BZ] = fetch_gate_bz,
+	[OP_BNZ] = fetch_gate_bnz,
+	[OP_JUMP] = fetch_gate_jump,
+	[OP_HALT] = handle_none,
+	[OP_NOP] = handle_none,
+};
+
+DEFINE_DISPATCHER(dispatch_fetch_gate, fetch_gate_handlers)
+
 /*
  *  Fetch Stage of APEX Pipeline
  *
@@ -172,633 +426,694 @@ int
 fetch(APEX_CPU* cpu)
 {
 	CPU_Stage* stage = &cpu->stage[F];
-	//printf("F : %d, %d, %d, %d\n",cpu->stage_check[0][0] ,cpu->stage_check[0][1],cpu->stage_set[0][0],cpu->stage_set[1][0] );
-	if (!cpu->stage_check[0][0] && !cpu->stage_check[0][1] && cpu->stage_set[0][0] && !cpu->halt && strcmp((&cpu->stage[MEM])->opcode, "JUMP") != 0 &&
-	 (strcmp((&cpu->stage[MEM])->opcode, "BZ") != 0 || !cpu->zflag) && ( strcmp((&cpu->stage[MEM])->opcode, "BNZ") != 0 || !cpu->nzflag)) {  
+	if (!cpu->stage_check[0][0] && !cpu->stage_check[0][1] && cpu->stage_set[0][0] && !cpu->halt &&
+		!dispatch_fetch_gate(cpu, &cpu->stage[MEM])) {
     /* Store current PC in fetch latch */
 		stage->pc = cpu->pc;
 
 
     /* Index into code memory using this pc and copy all instruction fields into
-     * fetch latch
+     * fetch latch. Fetching outside code memory yields an empty latch, and a
+     * draining pipeline is fed NOPs.
      */
-		APEX_Instruction* current_ins = &cpu->code_memory[get_code_index(cpu->pc)];
-		strcpy(stage->opcode, current_ins->opcode);
+		static const APEX_Instruction no_instruction;
+		static const APEX_Instruction drain_instruction = { .opcode = OP_NOP };
+		int index = get_code_index(cpu->pc);
+		const APEX_Instruction* current_ins = &no_instruction;
+		if (cpu->drain) {
+			current_ins = &drain_instruction;
+		}
+		else if (index >= 0 && index < cpu->code_memory_size) {
+			current_ins = &cpu->code_memory[index];
+		}
+		stage->opcode = current_ins->opcode;
 		stage->rd = current_ins->rd;
 		stage->rs1 = current_ins->rs1;
 		stage->rs2 = current_ins->rs2;
 		stage->imm = current_ins->imm;
-    //stage->rd = current_ins->rd;
+		cpu->bubble[F] = cpu->drain ? CPI_HALT : current_ins == &no_instruction ? CPI_FETCH : CPI_NOP;
+		stage->id = 0;
+		if ((cpu->display & APEX_DISPLAY_TIMELINE) &&
+			current_ins != &no_instruction && current_ins != &drain_instruction) {
+			stage->id = APEX_timeline_fetch(cpu->timeline);
+		}
 
     /* Update PC for next instruction */
-		cpu->pc += 4;
+		if (!cpu->drain) {
+			cpu->pc += 4;
+		}
 
     /* Copy data from fetch latch to decode latch*/
 
 		if(cpu ->stage_set[1][0])
 		{
 			cpu->stage[DRF] = cpu->stage[F];
+			cpu->bubble[DRF] = cpu->bubble[F];
 			cpu->stage_set[0][0]=1;
 		}
 		else
 		{
 			cpu ->stage_set[0][0]=0;
 		}
-		if (strcmp((cpu->f),"display")==0) {
-			print_stage_content("Fetch", stage);
+		if (cpu->display) {
+			show_stage(cpu, stage);
 		}
-     // struct CPU_Stage Apex;
-     // cpu->stage[F]=Apex;
 	}
 
 	else if(!cpu->stage_set[0][0] && cpu->stage_set[1][0]) {
 		cpu->stage_set[0][0] = 1;
-        cpu->stage[DRF]=cpu->stage[F];
-		if (strcmp((cpu->f),"display")==0) {
-			print_stage_content("Fetch", stage);
+		cpu->stage[DRF]=cpu->stage[F];
+		cpu->bubble[DRF] = cpu->bubble[F];
+		if (cpu->display) {
+			show_stage(cpu, stage);
 		}
-	} 
-	else if(strcmp((cpu->f),"display")==0) {
-		print_stage_content("Fetch", stage);
+	}
+	else if(cpu->display) {
+		show_stage(cpu, stage);
 	}
 
 	return 0;
 }
 
-/*
- *  Decode Stage of APEX Pipeline
- *
- *  Note : You are free to edit this function according to your
- *         implementation
- */
-int
-decode(APEX_CPU* cpu)
+/* Holds the instruction in decode for this cycle */
+static void
+decode_stall(APEX_CPU* cpu)
 {
-	CPU_Stage* stage = &cpu->stage[DRF];
+	cpu->stage_check[1][1]=1;
+	cpu->stage_set[1][0]=0;
+}
 
-	if(strcmp(stage->opcode,"BNZ")==0 || strcmp(stage->opcode,"BZ")==0)
-	{
-		if(strcmp((&cpu->stage[MEM])->opcode,"ADD")!=0 && strcmp((&cpu->stage[MEM])->opcode,"SUB")!=0 && strcmp((&cpu->stage[MEM])->opcode,"MUL")!=0 && strcmp((&cpu->stage[WB])->opcode,"ADD")!=0 && strcmp((&cpu->stage[WB])->opcode,"SUB")!=0 && strcmp((&cpu->stage[WB])->opcode,"MUL")!=0)
-		{
-			cpu->stage_check[1][1]=0;
-	// cpu->stage_set[1][0] = 1;
+/* Sources of an instruction */
+#define SRC_RS1 1
+#define SRC_RS2 2
 
-		}	
+/* Rule that clears a decode stall */
+enum
+{
+	CHECK_KEEP,		// Stall stays as it is
+	CHECK_FORWARD,	// Sources on EX, MEM or in the register file
+	CHECK_RF,		// Sources in the register file
+	CHECK_FLAGS		// No flag producer in MEM or WB
+};
+
+/* Paths the sources are read from */
+enum
+{
+	READ_NONE,
+	READ_ANY,		// EX, then MEM, then the register file
+	READ_AFTER_LOAD,	// Only MEM while a LOAD is in the MEM latch
+	READ_LDR,		// READ_ANY, then register file or last EX result
+	READ_FLAGS,		// Waits for the flag producers
+	READ_HALT		// Stops fetch
+};
+
+/* Point at which decode marks the destination register invalid */
+enum
+{
+	CLAIM_NONE,
+	CLAIM_FIRST,	// Before the sources are read
+	CLAIM_AFTER,	// Once the sources are read without a stall
+	CLAIM_BETWEEN	// Between two reads of the sources
+};
+
+/* Decode hazard descriptor of an opcode */
+typedef struct APEX_Decode_Info
+{
+	unsigned char sources;	// SRC_* the instruction reads
+	unsigned char check;	// CHECK_* rule clearing a stall
+	unsigned char read;	// READ_* paths of the sources
+	unsigned char required;	// SRC_* whose failed read stalls decode
+	unsigned char claim;	// CLAIM_* point for rd
+} APEX_Decode_Info;
+
+#define TWO_SOURCES (SRC_RS1 | SRC_RS2)
+
+static const APEX_Decode_Info decode_info[NUM_OPCODES] = {
+	[OP_NONE] = { 0, CHECK_KEEP, READ_NONE, 0, CLAIM_NONE },
+	[OP_MOVC] = { 0, CHECK_KEEP, READ_NONE, 0, CLAIM_FIRST },
+	[OP_ADD] = { TWO_SOURCES, CHECK_FORWARD, READ_AFTER_LOAD, TWO_SOURCES, CLAIM_AFTER },
+	[OP_SUB] = { TWO_SOURCES, CHECK_FORWARD, READ_AFTER_LOAD, TWO_SOURCES, CLAIM_AFTER },
+	[OP_MUL] = { TWO_SOURCES, CHECK_FORWARD, READ_AFTER_LOAD, TWO_SOURCES, CLAIM_AFTER },
+	[OP_AND] = { TWO_SOURCES, CHECK_FORWARD, READ_ANY, SRC_RS2, CLAIM_AFTER },
+	[OP_OR] = { TWO_SOURCES, CHECK_FORWARD, READ_ANY, SRC_RS2, CLAIM_AFTER },
+	[OP_XOR] = { TWO_SOURCES, CHECK_FORWARD, READ_ANY, SRC_RS2, CLAIM_BETWEEN },
+	[OP_LOAD] = { SRC_RS1, CHECK_RF, READ_ANY, SRC_RS1, CLAIM_AFTER },
+	[OP_LDR] = { TWO_SOURCES, CHECK_RF, READ_LDR, SRC_RS2, CLAIM_FIRST },
+	[OP_STORE] = { TWO_SOURCES, CHECK_FORWARD, READ_AFTER_LOAD, TWO_SOURCES, CLAIM_NONE },
+	[OP_BZ] = { 0, CHECK_FLAGS, READ_FLAGS, 0, CLAIM_NONE },
+	[OP_BNZ] = { 0, CHECK_FLAGS, READ_FLAGS, 0, CLAIM_NONE },
+	[OP_JUMP] = { SRC_RS1, CHECK_RF, READ_ANY, SRC_RS1, CLAIM_AFTER },
+	[OP_HALT] = { 0, CHECK_KEEP, READ_HALT, 0, CLAIM_NONE },
+	[OP_NOP] = { 0, CHECK_KEEP, READ_NONE, 0, CLAIM_NONE },
+};
+
+/* Register mask of the sources of an instruction */
+static inline unsigned int
+source_regs(CPU_Stage* stage, int sources)
+{
+	unsigned int regs = 0;
+	if (sources & SRC_RS1) {
+		regs |= reg_bit(stage->rs1);
 	}
-	if(strcmp(stage->opcode,"ADD")==0 || strcmp(stage->opcode,"SUB")==0 || strcmp(stage->opcode, "MUL")== 0) {
-		int temp1 = 0;
-		int temp2 = 0;
-	//	printf("STORE PRE rs1 : %d, %d, %d\n", cpu->ex_forward[stage->rs1] , cpu->mem_forward[stage->rs1] , cpu->regs_valid[stage->rs1]);
-		if(cpu->ex_forward[stage->rs1] == 1 || cpu->mem_forward[stage->rs1] == 1 || cpu->regs_valid[stage->rs1] == 1 )
-		{
-			temp1 = 1;
-		}
-	//	printf("STORE PRE rs2 : %d, %d, %d\n", cpu->ex_forward[stage->rs2] , cpu->mem_forward[stage->rs2] , cpu->regs_valid[stage->rs2]);
-		if(cpu->ex_forward[stage->rs2] == 1 || cpu->mem_forward[stage->rs2] == 1 || cpu->regs_valid[stage->rs2] == 1  )
-		{
-			temp2 = 1;
-		}   
-		if (temp1 && temp2)
-		{
-			cpu->stage_check[1][1]=0;
-  			//cpu ->stage_set[1][0]=1;
-		} 
+	if (sources & SRC_RS2) {
+		regs |= reg_bit(stage->rs2);
 	}
+	return regs;
+}
 
-	if(strcmp(stage->opcode,"AND")==0) {
-		int temp1 = 0;
-		int temp2 = 0;
-		if(cpu->ex_forward[stage->rs1] == 1 || cpu->mem_forward[stage->rs1] == 1 || cpu->regs_valid[stage->rs1] == 1 )
-		{
-			temp1 = 1;
+/* Makes value the result of reg on a forwarding path */
+static inline void
+publish(APEX_CPU* cpu, int path, int reg, int value)
+{
+	cpu->score.ready[path] |= reg_bit(reg);
+	cpu->score.value[path][reg] = value;
+}
+
+/* Marks reg as pending a write by the instruction in decode */
+static inline void
+invalidate(APEX_CPU* cpu, int reg)
+{
+	cpu->score.ready[PATH_RF] &= ~reg_bit(reg);
+}
+
+static int
+flags_pending(APEX_CPU* cpu)
+{
+	return is_flag_producer(cpu->stage[MEM].opcode) || is_flag_producer(cpu->stage[WB].opcode);
+}
+
+/* Registers an older instruction still in EX, MEM or WB writes */
+static unsigned int
+pending_writes(APEX_CPU* cpu)
+{
+	unsigned int pending = 0;
+	for (int i = EX; i <= WB; ++i) {
+		int ins_class = opcode_info[cpu->stage[i].opcode].ins_class;
+		if (ins_class == CLASS_ALU || ins_class == CLASS_MUL || ins_class == CLASS_LOAD) {
+			pending |= reg_bit(cpu->stage[i].rd);
 		}
-	//	printf("STORE PRE rs2 : %d, %d, %d\n", cpu->ex_forward[stage->rs2] , cpu->mem_forward[stage->rs2] , cpu->regs_valid[stage->rs2]);
-		if(cpu->ex_forward[stage->rs2] == 1 || cpu->mem_forward[stage->rs2] == 1 || cpu->regs_valid[stage->rs2] == 1  )
-		{
-			temp2 = 1;
-		}   
-		if (temp1 && temp2)
-		{
-			cpu->stage_check[1][1]=0;
-  			//cpu ->stage_set[1][0]=1;
-		} 
 	}
+	return pending;
+}
 
-	if(strcmp(stage->opcode,"OR")==0) {
-		int temp1 = 0;
-		int temp2 = 0;
-		if(cpu->ex_forward[stage->rs1] == 1 || cpu->mem_forward[stage->rs1] == 1 || cpu->regs_valid[stage->rs1] == 1 )
-		{
-			temp1 = 1;
-		}
-	//	printf("STORE PRE rs2 : %d, %d, %d\n", cpu->ex_forward[stage->rs2] , cpu->mem_forward[stage->rs2] , cpu->regs_valid[stage->rs2]);
-		if(cpu->ex_forward[stage->rs2] == 1 || cpu->mem_forward[stage->rs2] == 1 || cpu->regs_valid[stage->rs2] == 1  )
-		{
-			temp2 = 1;
-		}   
-		if (temp1 && temp2)
-		{
-			cpu->stage_check[1][1]=0;
-  			//cpu ->stage_set[1][0]=1;
-		} 
+/*
+ * Reads reg from EX, MEM or the register file, in that order, given the
+ * registers each of them may supply. Returns 0 if none of them does.
+ */
+static inline int
+read_any(APEX_CPU* cpu, unsigned int ex, unsigned int mem, unsigned int rf, int reg, int* value)
+{
+	unsigned int bit = reg_bit(reg);
+
+	if (ex & bit) {
+		*value = cpu->score.value[PATH_EX][reg];
+	}
+	else if (mem & bit) {
+		*value = cpu->score.value[PATH_MEM][reg];
+	}
+	else if (rf & bit) {
+		*value = cpu->regs[reg];
 	}
+	else {
+		return 0;
+	}
+	return 1;
+}
 
-	if(strcmp(stage->opcode,"XOR")==0) {
-		int temp1 = 0;
-		int temp2 = 0;
-		if(cpu->ex_forward[stage->rs1] == 1 || cpu->mem_forward[stage->rs1] == 1 || cpu->regs_valid[stage->rs1] == 1 )
-		{
-			temp1 = 1;
-		}
-	//	printf("STORE PRE rs2 : %d, %d, %d\n", cpu->ex_forward[stage->rs2] , cpu->mem_forward[stage->rs2] , cpu->regs_valid[stage->rs2]);
-		if(cpu->ex_forward[stage->rs2] == 1 || cpu->mem_forward[stage->rs2] == 1 || cpu->regs_valid[stage->rs2] == 1  )
-		{
-			temp2 = 1;
-		}   
-		if (temp1 && temp2)
-		{
-			cpu->stage_check[1][1]=0;
-  			//cpu ->stage_set[1][0]=1;
-		} 
+/* Reads the sources, stalling decode if a required one is not found */
+static inline void
+read_sources(APEX_CPU* cpu, CPU_Stage* stage, const APEX_Decode_Info* info, unsigned int ex, unsigned int mem, unsigned int rf)
+{
+	if ((info->sources & SRC_RS1) && !read_any(cpu, ex, mem, rf, stage->rs1, &stage->rs1_value) &&
+		(info->required & SRC_RS1)) {
+		decode_stall(cpu);
+	}
+	if ((info->sources & SRC_RS2) && !read_any(cpu, ex, mem, rf, stage->rs2, &stage->rs2_value) &&
+		(info->required & SRC_RS2)) {
+		decode_stall(cpu);
 	}
+}
 
-	if(strcmp(stage->opcode,"LDR")== 0) {
-		if(cpu->regs_valid[stage->rs1] && (cpu->regs_valid[stage->rs2]))
-		{
-			cpu->stage_check[1][1]=0;
-		} 
+/* Reads reg for READ_LDR: register file first, then the last EX result */
+static inline int
+read_ldr(APEX_CPU* cpu, unsigned int last, int reg, int* value)
+{
+	unsigned int bit = reg_bit(reg);
+
+	if (cpu->score.ready[PATH_RF] & bit) {
+		*value = cpu->regs[reg];
+	}
+	else if (last & bit) {
+		*value = cpu->score.value[PATH_LAST][reg];
 	}
+	else {
+		return 0;
+	}
+	return 1;
+}
 
-	if(strcmp(stage->opcode,"STORE")== 0) {
-		int temp1 = 0;
-		int temp2 = 0;
-	//	printf("STORE PRE rs1 : %d, %d, %d\n", cpu->ex_forward[stage->rs1] , cpu->mem_forward[stage->rs1] , cpu->regs_valid[stage->rs1]);
-		if(cpu->ex_forward[stage->rs1] == 1 || cpu->mem_forward[stage->rs1] == 1 || cpu->regs_valid[stage->rs1] == 1 )
-		{
-			temp1 = 1;
+/*
+ *  Decode hazard unit, one ready test per instruction. Clears the decode
+ *  stall once the sources the descriptor waits for are available.
+ */
+static void
+decode_check(APEX_CPU* cpu, CPU_Stage* stage, const APEX_Decode_Info* info)
+{
+	unsigned int ready = cpu->score.ready[PATH_RF];
+	unsigned int needed = source_regs(stage, info->sources);
+
+	switch (info->check) {
+	case CHECK_FORWARD:
+		if (cpu->config.forwarding) {
+			ready |= cpu->score.ready[PATH_EX] | cpu->score.ready[PATH_MEM];
 		}
-	//	printf("STORE PRE rs2 : %d, %d, %d\n", cpu->ex_forward[stage->rs2] , cpu->mem_forward[stage->rs2] , cpu->regs_valid[stage->rs2]);
-		if(cpu->ex_forward[stage->rs2] == 1 || cpu->mem_forward[stage->rs2] == 1 || cpu->regs_valid[stage->rs2] == 1  )
-		{
-			temp2 = 1;
-		}   
-		if (temp1 && temp2)
-		{
+		/* fall through */
+	case CHECK_RF:
+		if ((ready & needed) == needed) {
 			cpu->stage_check[1][1]=0;
-  			//cpu ->stage_set[1][0]=1;
-		} 
-	}
-
-	if(strcmp(stage->opcode,"LOAD")==0) {
-		if(cpu->regs_valid[stage->rs1])
-		{
+		}
+		break;
+	case CHECK_FLAGS:
+		if (!flags_pending(cpu)) {
 			cpu->stage_check[1][1]=0;
 		}
+		break;
+	default:
+		break;
 	}
+}
 
-	if(strcmp(stage->opcode,"JUMP")==0) {
-		if(cpu->regs_valid[stage->rs1])
-		{
-			cpu->stage_check[1][1]=0;
+/*
+ *  Reads the sources from the paths the descriptor names, preferring
+ *  forwarded values, and marks the destination register invalid.
+ */
+static void
+decode_read(APEX_CPU* cpu, CPU_Stage* stage, const APEX_Decode_Info* info)
+{
+	APEX_Scoreboard* score = &cpu->score;
+	unsigned int forwarded = cpu->config.forwarding ? ~0u : 0;
+	unsigned int ex = score->ready[PATH_EX] & forwarded;
+	unsigned int mem = score->ready[PATH_MEM] & forwarded;
+	unsigned int trusted = ~0u;
+
+	if (info->claim == CLAIM_FIRST) {
+		invalidate(cpu, stage->rd);
+	}
+
+	switch (info->read) {
+	case READ_NONE:
+		return;
+	case READ_FLAGS:
+		if (flags_pending(cpu)) {
+			decode_stall(cpu);
 		}
+		return;
+	case READ_HALT:
+		cpu->halt=1;
+		return;
+	case READ_AFTER_LOAD:
+		/* EX and the register file are not trusted behind a LOAD */
+		if (cpu->stage[MEM].opcode == OP_LOAD) {
+			ex = 0;
+			trusted = 0;
+		}
+		break;
+	default:
+		break;
 	}
 
-	//printf("DRF : %d, %d, %d, %d\n",cpu->stage_check[1][0] ,cpu->stage_check[1][1] , cpu ->stage_set[1][0] ,cpu->halt );
-	if(!cpu->stage_check[1][0] && !cpu->stage_check[1][1]  && !cpu->halt) {
-		
-    /* Read data from register file for store */
-		if (strcmp(stage->opcode, "STORE") == 0) {
-
-			if(cpu->ex_forward[stage->rs1] == 1 && strcmp((&cpu->stage[MEM])->opcode, "LOAD") != 0)
-			{
-	//			printf("1\n");
-				stage->rs1_value = cpu->ex_data[stage->rs1];
-			}
-			else if(cpu->mem_forward[stage->rs1] == 1)
-			{
-	//			printf("2\n");
-				stage->rs1_value = cpu->mem_data[stage->rs1];
-			}
-			else if(strcmp((&cpu->stage[MEM])->opcode, "LOAD") != 0 && cpu->regs_valid[stage->rs1] == 1)
-			{
-	//			printf("3\n");
-				stage->rs1_value = cpu->regs[stage->rs1];
-			}
-			else {
-	//			printf("4\n");
-				cpu->stage_check[1][1]=1;
-				cpu ->stage_set[1][0]=0;
-			}
-
-			if(cpu->ex_forward[stage->rs2] == 1 && strcmp((&cpu->stage[MEM])->opcode, "LOAD") != 0)
-			{
-	//			printf("5\n");
-				stage->rs2_value = cpu->ex_data[stage->rs2];
-			}
-			else if(cpu->mem_forward[stage->rs2] == 1)
-			{
-	//			printf("6\n");
-				stage->rs2_value = cpu->mem_data[stage->rs2];
-			}
-			else if(strcmp((&cpu->stage[MEM])->opcode, "LOAD") != 0 && cpu->regs_valid[stage->rs2] == 1)
-			{
-	//			printf("7\n");
-				stage->rs2_value = cpu->regs[stage->rs2];
-			}
-			else{
-	//			printf("8\n");
-				cpu->stage_check[1][1]=1;
-				cpu ->stage_set[1][0]=0;
-			}
-	//		printf("DRF STORE : %d, %d",cpu->stage_check[1][1],cpu ->stage_set[1][0]);
-		}
-		if (strcmp(stage->opcode, "LOAD") == 0) {
-   // cpu->regs_valid[stage->rd]= 0; //busy
-
-    if(cpu->ex_forward[stage->rs1] == 1)
-    {
-    	stage->rs1_value = cpu->ex_data[stage->rs1];
-    }
-    else if(cpu->mem_forward[stage->rs1] == 1)
-    {
-    	stage->rs1_value = cpu->mem_data[stage->rs1];
-    }
-    else if(cpu->regs_valid[stage->rs1] == 1)
-    {
-    	stage->rs1_value = cpu->regs[stage->rs1];
-    }
-
-    else {
-    	cpu->stage_check[1][1]=1;
-    	cpu->stage_set[1][0]=0;
-    }  
-    if (!cpu->stage_check[1][1])
-    {
-    	cpu->regs_valid[stage->rd]=0;
-    }
-}
-
-if (strcmp(stage->opcode, "LDR") == 0) {
-	cpu->regs_valid[stage->rd]= 0;
-	if(cpu->ex_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->ex_data[stage->rs1];
+	read_sources(cpu, stage, info, ex, mem, score->ready[PATH_RF] & trusted);
+	if (info->claim == CLAIM_BETWEEN) {
+		invalidate(cpu, stage->rd);
+		read_sources(cpu, stage, info, ex, mem, score->ready[PATH_RF]);
 	}
-	else if(cpu->mem_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->mem_data[stage->rs1];
+	if (info->read == READ_LDR) {
+		unsigned int last = score->ready[PATH_LAST] & forwarded;
+		if (!read_ldr(cpu, last, stage->rs1, &stage->rs1_value)) {
+			decode_stall(cpu);
+		}
+		if (!read_ldr(cpu, last, stage->rs2, &stage->rs2_value)) {
+			decode_stall(cpu);
+		}
 	}
-	else if(cpu->regs_valid[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->regs[stage->rs1];
+	if (info->claim == CLAIM_AFTER && !cpu->stage_check[1][1]) {
+		invalidate(cpu, stage->rd);
 	}
+}
 
-	if(cpu->ex_forward[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->ex_data[stage->rs2];
+/* CPI cause of the bubble left in EX when decode holds its instruction */
+static int
+decode_hold_cause(APEX_CPU* cpu, CPU_Stage* stage, const APEX_Decode_Info* info)
+{
+	if (cpu->halt) {
+		return CPI_HALT;
 	}
-	else if(cpu->mem_forward[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->mem_data[stage->rs2];
+	if (inert_latch(stage)) {
+		return cpu->bubble[DRF];
 	}
-	else if(cpu->regs_valid[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->regs[stage->rs2];
+	if (!cpu->stage_check[1][1]) {
+		/* EX was not freed by the instruction that just left it */
+		return execute_hold_cause(cpu, cpu->stage[MEM].opcode);
 	}
-
-	else {
-		cpu->stage_check[1][1]=1;
-		cpu->stage_set[1][0]=0;
-	}  
+	if (info->read == READ_FLAGS) {
+		return CPI_BRANCH_FLAGS;
+	}
+	if (info->read == READ_AFTER_LOAD && cpu->stage[MEM].opcode == OP_LOAD) {
+		return CPI_LOAD_RAW;
+	}
+	unsigned int needed = source_regs(stage, info->sources);
+	for (int i = MEM; i <= WB; ++i) {
+		if (opcode_info[cpu->stage[i].opcode].ins_class == CLASS_LOAD &&
+			(needed & reg_bit(cpu->stage[i].rd))) {
+			return CPI_LOAD_RAW;
+		}
+	}
+	return CPI_RAW;
 }
 
+/*
+ *  Decode Stage of APEX Pipeline
+ *
+ *  Note : You are free to edit this function according to your
+ *         implementation
+ */
+int
+decode(APEX_CPU* cpu)
+{
+	CPU_Stage* stage = &cpu->stage[DRF];
+	const APEX_Decode_Info* info = &decode_info[stage->opcode];
+	int delivered = 0;
 
+	decode_check(cpu, stage, info);
 
-     /* No Register file read needed for MOVC */
-if (strcmp(stage->opcode, "MOVC") == 0) {
-	cpu->regs_valid[stage->rd] = 0;
+  /* Without forwarding, sources wait until their producers have written back */
+	if (!cpu->config.forwarding && !cpu->stage_check[1][1] &&
+		(pending_writes(cpu) & source_regs(stage, info->sources))) {
+		decode_stall(cpu);
+	}
 
+	if(!cpu->stage_check[1][0] && !cpu->stage_check[1][1]  && !cpu->halt) {
+		decode_read(cpu, stage, info);
 
+    /* Copy data from decode latch to execute latch*/
+		if(!cpu->stage_check[1][1] && cpu->stage_set[2][0]) {
+			cpu->stage_set[1][0]=1;
+			cpu->stage[EX] = cpu->stage[DRF];
+			cpu->bubble[EX] = cpu->bubble[DRF];
+			cpu->ex_wait = extra_latency(cpu, stage->opcode);
+			delivered = 1;
+		}
 
+		if (cpu->display) {
+			show_stage(cpu, stage);
+		}
+	}
+	else if(cpu->display) {
+		show_stage(cpu, stage);
+	}
+	if (!delivered && inert_latch(&cpu->stage[EX])) {
+		cpu->bubble[EX] = decode_hold_cause(cpu, stage, info);
+	}
+	return 0;
 }
 
-if(strcmp(stage->opcode,"BNZ")==0 || strcmp(stage->opcode,"BZ")==0)
+/* Squashes the two instructions fetched behind a taken control transfer */
+static void
+flush_fetched(APEX_CPU* cpu)
 {
-	if(strcmp((&cpu->stage[MEM])->opcode,"ADD")==0 || strcmp((&cpu->stage[MEM])->opcode,"SUB")==0 || strcmp((&cpu->stage[MEM])->opcode,"MUL")==0 || strcmp((&cpu->stage[WB])->opcode,"ADD")==0 || strcmp((&cpu->stage[WB])->opcode,"SUB")==0 || strcmp((&cpu->stage[WB])->opcode,"MUL")==0)
-	{
-		cpu->stage_check[1][1]=1;
-		cpu->stage_set[1][0] = 0;
-
-	}	
+	if (cpu->display & APEX_DISPLAY_TIMELINE) {
+		APEX_timeline_flush(cpu);
+	}
+	cpu->stage[F].opcode = OP_NOP;
+	cpu->stage[DRF].opcode = OP_NOP;
+	cpu->bubble[F] = CPI_FLUSH;
+	cpu->bubble[DRF] = CPI_FLUSH;
+	cpu->flushes++;
 }
 
-if(strcmp(stage->opcode,"XOR") == 0) {
-	//cpu->regs_valid[stage->rd]=0;
-
-	if(cpu->ex_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->ex_data[stage->rs1];
-	}
-	else if(cpu->mem_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->mem_data[stage->rs1];
-	}
-	else if(cpu->regs_valid[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->regs[stage->rs1];
-	}
-
-	if(cpu->ex_forward[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->ex_data[stage->rs2];
-	}
-	else if(cpu->mem_forward[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->mem_data[stage->rs2];
-	}
-	else if(cpu->regs_valid[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->regs[stage->rs2];
-	}
-
-	else{
-		cpu->stage_check[1][1]=1;
-		cpu ->stage_set[1][0]=0;
-
-	}
-	if (!cpu->stage_check[1][1])
-    {
-    	cpu->regs_valid[stage->rd]=0;
-    }
-
+/* Publishes an EX result for forwarding */
+static void
+forward_ex_result(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	publish(cpu, PATH_LAST, stage->rd, stage->buffer);
+	publish(cpu, PATH_EX, stage->rd, stage->buffer);
+}
 
+/*
+ *  Execute issue handlers, run when the EX latch is not busy
+ */
+static int
+execute_store(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	stage->mem_address=(stage->rs2_value)+(stage->imm);
+	return 0;
 }
 
-
-
-if (strcmp(stage->opcode, "AND") == 0) {
-	//cpu->regs_valid[stage->rd]=0;
-	if(cpu->ex_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->ex_data[stage->rs1];
-	}
-	else if(cpu->mem_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->mem_data[stage->rs1];
-	}
-	else if(cpu->regs_valid[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->regs[stage->rs1];
-	}
-
-	if(cpu->ex_forward[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->ex_data[stage->rs2];
-	}
-	else if(cpu->mem_forward[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->mem_data[stage->rs2];
-	}
-	else if(cpu->regs_valid[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->regs[stage->rs2];
-	}
-
-	else{
-		cpu->stage_check[1][1]=1;
-		cpu ->stage_set[1][0]=0;
-
+/*
+ * LOAD and LDR publish their stale buffer as the EX result of the register
+ * numbered like the memory address. Kept as it shapes the timing, but only
+ * for addresses that name a register.
+ */
+static void
+forward_load_address(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	if ((unsigned int)stage->mem_address < 32) {
+		publish(cpu, PATH_EX, stage->mem_address, stage->buffer);
 	}
-	if (!cpu->stage_check[1][1])
-    {
-    	cpu->regs_valid[stage->rd]=0;
-    }
 }
 
-if(strcmp(stage->opcode,"HALT")==0)
+static int
+execute_load(APEX_CPU* cpu, CPU_Stage* stage)
 {
-	cpu->halt=1;
+	stage->mem_address=(stage->rs1_value)+(stage->imm);
+	forward_load_address(cpu, stage);
+	return 0;
 }
 
-if(strcmp(stage->opcode, "JUMP")==0)
+static int
+execute_ldr(APEX_CPU* cpu, CPU_Stage* stage)
 {
-	if(cpu->ex_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->ex_data[stage->rs1];
-	}
-	else if(cpu->mem_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->mem_data[stage->rs1];
-	}
-
-	else if(cpu->regs_valid[stage->rs1])
-	{
-		stage->rs1_value=cpu->regs[stage->rs1];
-	}
-	else{
-		cpu->stage_check[1][1]=1;
-		cpu -> stage_set[1][0]=0;
-
-	}
-	if (!cpu->stage_check[1][1])
-    {
-    	cpu->regs_valid[stage->rd]=0;
-    }
+	stage->mem_address=(stage->rs1_value)+(stage->rs2_value);
+	forward_load_address(cpu, stage);
+	return 0;
 }
-if (strcmp(stage->opcode, "OR") == 0) {
-	//cpu->regs_valid[stage->rd]=0;
-	if(cpu->ex_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->ex_data[stage->rs1];
-	}
-	else if(cpu->mem_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->mem_data[stage->rs1];
-	}
-	else if(cpu->regs_valid[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->regs[stage->rs1];
-	}
 
-	if(cpu->ex_forward[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->ex_data[stage->rs2];
-	}
-	else if(cpu->mem_forward[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->mem_data[stage->rs2];
-	}
-	else if(cpu->regs_valid[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->regs[stage->rs2];
-	}
-
-
-	else{
-		cpu->stage_check[1][1]=1;
-		cpu -> stage_set[1][0]=0;
-	}
-	if (!cpu->stage_check[1][1])
-    {
-    	cpu->regs_valid[stage->rd]=0;
-    }
+static int
+execute_jump(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	cpu->pc=(stage->rs1_value)+(stage->imm);
+	flush_fetched(cpu);
+	cpu->halt=0;
+	return 0;
 }
 
-
-if (strcmp(stage->opcode, "SUB") == 0 || strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "MUL") == 0) {
-	
-
-	if(cpu->ex_forward[stage->rs1] == 1 && strcmp((&cpu->stage[MEM])->opcode, "LOAD") != 0)
-	{
-		stage->rs1_value = cpu->ex_data[stage->rs1];
-	}
-	else if(cpu->mem_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->mem_data[stage->rs1];
-	}
-	else if(strcmp((&cpu->stage[MEM])->opcode, "LOAD") != 0 && cpu->regs_valid[stage->rs1] == 1)
+/* Resolves BZ/BNZ, or holds it in EX while the flag producer is in WB */
+static void
+execute_branch(APEX_CPU* cpu, CPU_Stage* stage, int taken)
+{
+	if(is_flag_producer(cpu->stage[WB].opcode))
 	{
-		stage->rs1_value = cpu->regs[stage->rs1];
-	}
-	else{
+		cpu->stage_check[2][0] = 1;
 		cpu->stage_check[1][1]=1;
-		cpu -> stage_set[1][0]=0;
-	}
-
-	if(cpu->ex_forward[stage->rs2] == 1 && strcmp((&cpu->stage[MEM])->opcode, "LOAD") != 0)
-	{
-		stage->rs2_value = cpu->ex_data[stage->rs2];
+		(&cpu->stage[DRF])->stalled =1;
+		(&cpu->stage[F])->stalled =1;
 	}
-	else if(cpu->mem_forward[stage->rs2] == 1)
+	else if(taken)
 	{
-		stage->rs2_value = cpu->mem_data[stage->rs2];
-	}
-	else if(strcmp((&cpu->stage[MEM])->opcode, "LOAD") != 0 && cpu->regs_valid[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->regs[stage->rs2];
-	}
-	else{
-		cpu->stage_check[1][1]=1;
-		cpu -> stage_set[1][0]=0;
+		cpu->pc=(stage->pc)+(stage->imm);
+		flush_fetched(cpu);
+		cpu->halt=0;
 	}
-    if (!cpu->stage_check[1][1])
-    {
-    	cpu->regs_valid[stage->rd]=0;
-    }
+}
 
+static int
+execute_bz(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	execute_branch(cpu, stage, cpu->zflag == 1);
+	return 0;
 }
 
-if (strcmp(stage->opcode, "XOR") == 0) {
-	cpu->regs_valid[stage->rd]=0;
-	if(cpu->ex_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->ex_data[stage->rs1];
-	}
-	else if(cpu->mem_forward[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->mem_data[stage->rs1];
-	}
-	else if(cpu->regs_valid[stage->rs1] == 1)
-	{
-		stage->rs1_value = cpu->regs[stage->rs1];
-	}
+static int
+execute_bnz(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	execute_branch(cpu, stage, cpu->zflag == 0);
+	return 0;
+}
 
-	if(cpu->ex_forward[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->ex_data[stage->rs2];
-	}
-	else if(cpu->mem_forward[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->mem_data[stage->rs2];
-	}
-	else if(cpu->regs_valid[stage->rs2] == 1)
-	{
-		stage->rs2_value = cpu->regs[stage->rs2];
-	}
+static int
+execute_halt(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	cpu->halt++;
+	return 0;
+}
 
-	else{
-		cpu->stage_check[1][1]=1;
-		cpu -> stage_set[1][0]=0;
-	}
-	if (!cpu->stage_check[1][1])
-    {
-    	cpu->regs_valid[stage->rd]=0;
-    }
+static int
+execute_movc(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	stage->buffer=0+(stage->imm);
+	cpu->score.value[PATH_LAST][stage->rd]=stage->buffer;
+	publish(cpu, PATH_EX, stage->rd, stage->buffer);
+	return 0;
 }
 
+/* MUL occupies EX for a second cycle, unless configured single-cycle */
+static int
+execute_mul(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	if (cpu->config.latency[OP_MUL] < 2) {
+		stage->buffer=(stage->rs1_value)*(stage->rs2_value);
+		forward_ex_result(cpu, stage);
+		return 0;
+	}
+	cpu->stage_check[2][0]=1;
+	cpu->stage_check[1][1]=1;
+	cpu ->stage_set[1][0] = 0;
+	return 0;
+}
 
+static int
+execute_add(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	stage->buffer=(stage->rs1_value)+(stage->rs2_value);
+	forward_ex_result(cpu, stage);
+	return 0;
+}
 
+static int
+execute_sub(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	stage->buffer=(stage->rs1_value)-(stage->rs2_value);
+	forward_ex_result(cpu, stage);
+	return 0;
+}
 
-if (strcmp(stage->opcode, "LDR") == 0) {
-	//cpu->regs_valid[stage->rd]=0;
-	if((cpu->regs_valid[stage->rs1]) && (cpu->regs_valid[stage->rs2])) {
-		stage->rs1_value=cpu->regs[stage->rs1];
-		stage->rs2_value=cpu->regs[stage->rs2];  
-	}
+static int
+execute_and(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	stage->buffer=(stage->rs1_value)&(stage->rs2_value);
+	forward_ex_result(cpu, stage);
+	return 0;
+}
 
-	else if(cpu->regs_forward[stage->rs1] && (cpu->regs_valid[stage->rs2]))
-	{
-		stage->rs1_value=cpu->regs_data[stage->rs1];
-		stage->rs2_value=cpu->regs[stage->rs2];
+static int
+execute_or(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	stage->buffer=(stage->rs1_value)|(stage->rs2_value);
+	forward_ex_result(cpu, stage);
+	return 0;
+}
 
-	}
+static int
+execute_xor(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	stage->buffer=(stage->rs1_value)^(stage->rs2_value);
+	forward_ex_result(cpu, stage);
+	return 0;
+}
 
-	else if(cpu->regs_valid[stage->rs1] && (cpu->regs_forward[stage->rs2]))
-	{
-		stage->rs1_value=cpu->regs[stage->rs1];
-		stage->rs2_value=cpu->regs_data[stage->rs2];
-	}
+static const APEX_Stage_Handler execute_handlers[NUM_OPCODES] = {
+	[OP_NONE] = handle_none,
+	[OP_MOVC] = execute_movc,
+	[OP_ADD] = execute_add,
+	[OP_SUB] = execute_sub,
+	[OP_MUL] = execute_mul,
+	[OP_AND] = execute_and,
+	[OP_OR] = execute_or,
+	[OP_XOR] = execute_xor,
+	[OP_LOAD] = execute_load,
+	[OP_LDR] = execute_ldr,
+	[OP_STORE] = execute_store,
+	[OP_BZ] = execute_bz,
+	[OP_BNZ] = execute_bnz,
+	[OP_JUMP] = execute_jump,
+	[OP_HALT] = execute_halt,
+	[OP_NOP] = handle_none,
+};
+
+DEFINE_DISPATCHER(dispatch_execute, execute_handlers)
 
-	else if(cpu->regs_valid[stage->rs2] && (cpu->regs_forward[stage->rs1]))
-	{
-		stage->rs2_value=cpu->regs[stage->rs2];
-		stage->rs1_value=cpu->regs_data[stage->rs1];
+/*
+ *  Execute completion handlers, run while the EX latch is busy.
+ *  They return 1 if the instruction left EX this cycle.
+ */
+static int
+execute_finish_mul(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	if (!cpu->stage_check[2][0]) {
+		return 0;
 	}
+	cpu->stage_check[2][0]=0;
+	cpu->stage_set[2][0]  = 1;
+	cpu->stage_check[1][1]=0;
+	cpu ->stage_set[1][0] = 1;
+	stage->buffer=(stage->rs1_value)*(stage->rs2_value);
+	publish(cpu, PATH_EX, stage->rd, stage->buffer);
+	cpu->score.ready[PATH_LAST] |= reg_bit(stage->rd);
+	cpu->stage[MEM] = cpu->stage[EX];
+	return 1;
+}
 
-	else if(cpu->regs_forward[stage->rs1] && (cpu->regs_forward[stage->rs2]))
-	{
-		stage->rs1_value=cpu->regs_data[stage->rs1];
-		stage->rs2_value=cpu->regs_data[stage->rs2];
+/* Resolves a BZ/BNZ that was held for its flags */
+static int
+execute_finish_branch(APEX_CPU* cpu, CPU_Stage* stage, int taken)
+{
+	if (!cpu->stage_check[2][0]) {
+		return 0;
 	}
+	cpu->stage_check[2][0] = 0;
+	cpu->stage_check[1][0]=0;
+	cpu->stage_check[0][0]=0;
 
-	else{
-		cpu->stage_check[1][1]=1;
-		cpu -> stage_set[1][0]=0;
+	if(taken)
+	{
+		cpu->pc=(stage->pc)+(stage->imm);
+		flush_fetched(cpu);
 	}
-	if (!cpu->stage_check[1][1])
-    {
-    	cpu->regs_valid[stage->rd]=0;
-    }
+	cpu->stage[MEM] = cpu->stage[EX];
+	return 1;
 }
 
-    /* Copy data from decode latch to execute latch*/
-     //printf("DRF EX check : %d,%d\n",cpu->stage_check[1][1] , cpu->stage_set[2][0] );
-if(!cpu->stage_check[1][1] && cpu->stage_set[2][0]) {
-	cpu->stage_set[1][0]=1;
-	cpu->stage[EX] = cpu->stage[DRF];
-}  
-
-    /*else if(!(&cpu->stage[EX])->busy){
-    struct CPU_Stage Bubble;
-    cpu->stage[EX]=Bubble;
-    }*/
-if (strcmp((cpu->f),"display")==0) {
-	print_stage_content("Decode/RF", stage);
-}
-     //struct CPU_Stage Apex;
-      //cpu->stage[DRF]=Apex;
+static int
+execute_finish_bz(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	return execute_finish_branch(cpu, stage, cpu->zflag == 1);
 }
-else if(!cpu->stage_set[2][0] && !cpu->stage_set[1][0] ) {
-	if(strcmp((cpu->f),"display")==0) {
-		print_stage_content("Decode/RF", stage);
-	}
-	//cpu->stage_set[1][0]=1;
+
+static int
+execute_finish_bnz(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	return execute_finish_branch(cpu, stage, cpu->zflag == 0);
 }
 
-else if(strcmp((cpu->f),"display")==0) {
-	print_stage_content("Decode/RF", stage);
-} 
-return 0;
+static const APEX_Stage_Handler execute_finish_handlers[NUM_OPCODES] = {
+	[OP_NONE] = handle_none,
+	[OP_MOVC] = handle_none,
+	[OP_ADD] = handle_none,
+	[OP_SUB] = handle_none,
+	[OP_MUL] = execute_finish_mul,
+	[OP_AND] = handle_none,
+	[OP_OR] = handle_none,
+	[OP_XOR] = handle_none,
+	[OP_LOAD] = handle_none,
+	[OP_LDR] = handle_none,
+	[OP_STORE] = handle_none,
+	[OP_BZ] = execute_finish_bz,
+	[OP_BNZ] = execute_finish_bnz,
+	[OP_JUMP] = handle_none,
+	[OP_HALT] = handle_none,
+	[OP_NOP] = handle_none,
+};
+
+DEFINE_DISPATCHER(dispatch_execute_finish, execute_finish_handlers)
+
+/* Sets the CPI cause of a bubble execute leaves in MEM */
+static inline void
+tag_execute_bubble(APEX_CPU* cpu)
+{
+	CPU_Stage* stage = &cpu->stage[EX];
+	if (inert_latch(&cpu->stage[MEM])) {
+		cpu->bubble[MEM] = inert_latch(stage) ? cpu->bubble[EX] : execute_hold_cause(cpu, stage->opcode);
+	}
 }
 
 /*
@@ -812,242 +1127,110 @@ execute(APEX_CPU* cpu)
 {
 	CPU_Stage* stage = &cpu->stage[EX];
 
-	if (!cpu->stage_check[2][0] && !cpu->stage_check[2][1])
-	{
-   /* Store */
-		if (strcmp(stage->opcode, "STORE") == 0) {
-			stage->mem_address=(stage->rs2_value)+(stage->imm);
-		}
-
-		if (strcmp(stage->opcode, "LOAD") == 0) {
-			stage->mem_address=(stage->rs1_value)+(stage->imm);
-			cpu->ex_forward[stage->mem_address]=1;
-			(cpu->ex_data[stage->mem_address])=stage->buffer;
-
-
-		}
-		if (strcmp(stage->opcode, "LDR") == 0) {
-			stage->mem_address=(stage->rs1_value)+(stage->rs2_value);
-
-			cpu->ex_forward[stage->mem_address]=1;
-			(cpu->ex_data[stage->mem_address])=stage->buffer;
-
-		}
-
-		if(strcmp(stage->opcode, "JUMP") == 0)
-		{
-			cpu->pc=(stage->rs1_value)+(stage->imm);
-			//cpu->ins_completed = (cpu->pc - 4000) /4;
-			strcpy(cpu->stage[F].opcode,"NOP");
-			strcpy(cpu->stage[DRF].opcode,"NOP");
-			cpu->halt=0;
-			//cpu->ex_forward[stage->rd]=1;
-
-		}
-
-		if(strcmp(stage->opcode, "BZ") == 0) {
-
-			if(strcmp((&cpu->stage[WB])->opcode,"ADD")==0 || strcmp((&cpu->stage[WB])->opcode,"SUB")==0 || strcmp((&cpu->stage[WB])->opcode,"MUL")==0)
-			{
-				cpu->stage_check[2][0] = 1;
-				cpu->stage_check[1][1]=1;
-				(&cpu->stage[DRF])->stalled =1;
-				(&cpu->stage[F])->stalled =1;
-
-			}
-			else {
-
-				if(cpu->zflag == 1)
-				{
-					cpu->pc=(stage->pc)+(stage->imm);
-					strcpy(cpu->stage[F].opcode,"NOP");
-					strcpy(cpu->stage[DRF].opcode,"NOP");
-					cpu->halt=0;
-					//cpu->ins_completed = (cpu->pc - 4000) /4;
-				}
-
-			}
-		}
-		if(strcmp(stage->opcode, "BNZ") == 0) {
-
-			if(strcmp((&cpu->stage[WB])->opcode,"ADD")==0 || strcmp((&cpu->stage[WB])->opcode,"SUB")==0 || strcmp((&cpu->stage[WB])->opcode,"MUL")==0)
-			{
-				cpu->stage_check[2][0] = 1;
-				cpu->stage_check[1][1]=1;
-				(&cpu->stage[DRF])->stalled =1;
-				(&cpu->stage[F])->stalled =1;
-			}
-			else {
-
-				if(cpu->zflag == 0)
-				{
-					cpu->pc=(stage->pc)+(stage->imm);
-					strcpy(cpu->stage[F].opcode,"NOP");
-					strcpy(cpu->stage[DRF].opcode,"NOP");
-					cpu->halt=0;
-					//cpu->ins_completed = (cpu->pc - 4000) /4;
-				}
-
-			}
-		}
-		if(strcmp(stage->opcode,"HALT")==0)
-		{
-			cpu->halt++;
+  /* Configured extra latency: EX and decode hold, MEM gets bubbles */
+	if (cpu->ex_wait > 0) {
+		cpu->ex_wait--;
+		cpu->stage_check[2][1]=1;
+		cpu->stage_check[1][1]=1;
+		cpu->stage_set[1][0]=0;
+		cpu->stage_set[2][0]=0;
+		if (cpu->display) {
+			show_stage(cpu, stage);
 		}
+		tag_execute_bubble(cpu);
+		return 0;
+	}
+	if (cpu->stage_check[2][1]) {
+		cpu->stage_check[2][1]=0;
+		cpu->stage_check[1][1]=0;
+		cpu->stage_set[1][0]=1;
+	}
 
-   /* MOVC */
-		if (strcmp(stage->opcode, "MOVC") == 0) {
-			stage->buffer=0+(stage->imm);
-			(cpu->regs_data[stage->rd])=stage->buffer;
-			cpu->ex_forward[stage->rd]=1;
-			(cpu->ex_data[stage->rd])=stage->buffer;
-
-		}
+	if (!cpu->stage_check[2][0] && !cpu->stage_check[2][1])
+	{
+		dispatch_execute(cpu, stage);
 
-		if (strcmp(stage->opcode, "MUL") == 0) {
-   //	stage->buffer=(stage->rs1_value)+(stage->rs2_value);
-			cpu->stage_check[2][0]=1;
-			cpu->stage_check[1][1]=1;
-			cpu ->stage_set[1][0] = 0;
-    //cpu->stage_check[0][1]=1;
+  /* Copy data from Execute latch to Memory latch*/
+		if(!cpu->stage_check[2][0]) {
+			cpu->stage[MEM] = cpu->stage[EX];
+			cpu->stage_set[2][0]=1; //free
 		}
-		if (strcmp(stage->opcode, "ADD") == 0) {
-			stage->buffer=(stage->rs1_value)+(stage->rs2_value);
-			(cpu->regs_forward[stage->rd])=1;
-			(cpu->regs_data[stage->rd])=stage->buffer;
-			cpu->ex_forward[stage->rd]=1;
-			(cpu->ex_data[stage->rd])=stage->buffer;
+		else {
+			struct CPU_Stage Bubble = {0};
+			cpu->stage[MEM]=Bubble;
+			cpu->stage_set[2][0]=0;
 		}
 
-		if (strcmp(stage->opcode, "XOR") == 0) {
-			stage->buffer=(stage->rs1_value)^(stage->rs2_value);
-			(cpu->regs_forward[stage->rd])=1;
-			(cpu->regs_data[stage->rd])=stage->buffer;
-			cpu->ex_forward[stage->rd]=1;
-			(cpu->ex_data[stage->rd])=stage->buffer;
+		if (cpu->display) {
+			show_stage(cpu, stage);
 		}
-
-		if(strcmp(stage->opcode, "SUB") == 0) {
-			stage->buffer=(stage->rs1_value)-(stage->rs2_value);
-			(cpu->regs_forward[stage->rd])=1;
-			(cpu->regs_data[stage->rd])=stage->buffer;
-			cpu->ex_forward[stage->rd]=1;
-			(cpu->ex_data[stage->rd])=stage->buffer;
-		}
-
-		if (strcmp(stage->opcode, "AND") == 0) {
-			stage->buffer=(stage->rs1_value)&(stage->rs2_value);
-			(cpu->regs_forward[stage->rd])=1;
-			(cpu->regs_data[stage->rd])=stage->buffer;
-			cpu->ex_forward[stage->rd]=1;
-			(cpu->ex_data[stage->rd])=stage->buffer;
-
-
+		if(!cpu->stage_check[2][0]) {
+			struct CPU_Stage Apex = {0};
+			cpu->stage[EX]=Apex;
 		}
-
-		if (strcmp(stage->opcode, "OR") == 0) {
-			stage->buffer=(stage->rs1_value)|(stage->rs2_value);
-			(cpu->regs_forward[stage->rd])=1;
-			(cpu->regs_data[stage->rd])=stage->buffer;
-			cpu->ex_forward[stage->rd]=1;
-			(cpu->ex_data[stage->rd])=stage->buffer;
-
-
+	}
+	else if (dispatch_execute_finish(cpu, stage)) {
+		if (cpu->display) {
+			show_stage(cpu, stage);
 		}
-
-  /* Copy data from Execute latch to Memory latch*/
-		if(!cpu->stage_check[2][0]) {
-			cpu->stage[MEM] = cpu->stage[EX];
-    cpu->stage_set[2][0]=1; //free
-}
-else {
-	struct CPU_Stage Bubble;
-	cpu->stage[MEM]=Bubble;
-	cpu->stage_set[2][0]=0;  
-}
-
-if (strcmp((cpu->f),"display")==0) {
-	print_stage_content("Execute", stage);
-} 
-if(!cpu->stage_check[2][0]) {
-	struct CPU_Stage Apex;
-	cpu->stage[EX]=Apex;
-}
+		struct CPU_Stage Bubble = {0};
+		cpu->stage[EX]=Bubble;
+	}
+	else if (cpu->display) {
+		show_stage(cpu, stage);
+	}
+	if(stage->opcode == OP_HALT) {
+		cpu->stage[MEM] = cpu->stage[EX];
+	}
+	tag_execute_bubble(cpu);
+	return 0;
 }
-else if(strcmp(stage->opcode, "MUL") == 0 && cpu->stage_check[2][0]) {
-	cpu->stage_check[2][0]=0;
-	cpu->stage_set[2][0]  = 1;
-	cpu->stage_check[1][1]=0;
-    //cpu->stage_check[0][1]=0;
-	cpu ->stage_set[1][0] = 1;
-	stage->buffer=(stage->rs1_value)*(stage->rs2_value);
-	cpu->ex_forward[stage->rd] = 1;
-	cpu->ex_data[stage->rd] = stage->buffer;
-	(cpu->regs_forward[stage->rd])=1;
-	cpu->stage[MEM] = cpu->stage[EX];
-
-	if (strcmp((cpu->f),"display")==0) {
-		print_stage_content("Execute", stage);
-	} 
-	struct CPU_Stage Bubble;
-	cpu->stage[EX]=Bubble;
 
+/*
+ *  Memory stage handlers
+ */
+static int
+memory_store(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	APEX_memory_write(cpu, stage->mem_address, stage->rs1_value);
+	return 0;
 }
 
-else if(strcmp(stage->opcode, "BZ") == 0 && cpu->stage_check[2][0]) {
-	cpu->stage_check[2][0] = 0;
-	cpu->stage_check[1][0]=0;
-	cpu->stage_check[0][0]=0;
-
-	if(cpu->zflag == 1)
-	{
-		cpu->pc=(stage->pc)+(stage->imm);
-		strcpy(cpu->stage[F].opcode,"NOP");
-		strcpy(cpu->stage[DRF].opcode,"NOP");
-		//cpu->ins_completed = (cpu->pc - 4000) /4;
-	}	
-	cpu->stage[MEM] = cpu->stage[EX];
-
-	if (strcmp((cpu->f),"display")==0) {
-		print_stage_content("Execute", stage);
-	} 
-	struct CPU_Stage Bubble;
-	cpu->stage[EX]=Bubble;
-
+static int
+memory_load(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	stage->buffer=APEX_memory_read(cpu, stage->mem_address);
+	publish(cpu, PATH_MEM, stage->rd, stage->buffer);
+	return 0;
 }
 
-else if(strcmp(stage->opcode, "BNZ") == 0 && cpu->stage_check[2][0]) {
-	cpu->stage_check[2][0] = 0;
-	cpu->stage_check[1][0]=0;
-	cpu->stage_check[0][0]=0;
-
-	if(cpu->zflag == 0)
-	{
-		cpu->pc=(stage->pc)+(stage->imm);
-		strcpy(cpu->stage[F].opcode,"NOP");
-		strcpy(cpu->stage[DRF].opcode,"NOP");
-		//cpu->ins_completed = (cpu->pc - 4000) /4;
-	}	cpu->stage[MEM] = cpu->stage[EX];
-
-	if (strcmp((cpu->f),"display")==0) {
-		print_stage_content("Execute", stage);
-	} 
-	struct CPU_Stage Bubble;
-	cpu->stage[EX]=Bubble;
-
-}  
-else {
-	if (strcmp((cpu->f),"display")==0) {
-		print_stage_content("Execute", stage);
-	}
-} 
-if(strcmp(stage->opcode, "HALT") == 0) {
-	cpu->stage[MEM] = cpu->stage[EX];	
-}  
-return 0;
-
+static int
+memory_halt(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	cpu->halt++;
+	return 0;
 }
 
+static const APEX_Stage_Handler memory_handlers[NUM_OPCODES] = {
+	[OP_NONE] = handle_none,
+	[OP_MOVC] = handle_none,
+	[OP_ADD] = handle_none,
+	[OP_SUB] = handle_none,
+	[OP_MUL] = handle_none,
+	[OP_AND] = handle_none,
+	[OP_OR] = handle_none,
+	[OP_XOR] = handle_none,
+	[OP_LOAD] = memory_load,
+	[OP_LDR] = memory_load,
+	[OP_STORE] = memory_store,
+	[OP_BZ] = handle_none,
+	[OP_BNZ] = handle_none,
+	[OP_JUMP] = handle_none,
+	[OP_HALT] = memory_halt,
+	[OP_NOP] = handle_none,
+};
+
+DEFINE_DISPATCHER(dispatch_memory, memory_handlers)
 
 /*
  *  Memory Stage of APEX Pipeline
@@ -1058,50 +1241,98 @@ return 0;
 int
 memory(APEX_CPU* cpu)
 {
-	for(int i=0;i<16;i++) {
-		cpu->mem_data[i]=cpu->ex_data[i];
-		cpu->mem_forward[i]=cpu->ex_forward[i];
-		cpu->ex_forward[i]=0;
-	}
+	/* Last cycle's EX results move to MEM; values are only read under their bit */
+	APEX_Scoreboard* score = &cpu->score;
+	for(unsigned int moved = score->ready[PATH_EX] & LOW_REGS; moved; moved &= moved - 1) {
+		int i = __builtin_ctz(moved);
+		score->value[PATH_MEM][i]=score->value[PATH_EX][i];
+	}
+	score->ready[PATH_MEM] = (score->ready[PATH_MEM] & ~LOW_REGS) | (score->ready[PATH_EX] & LOW_REGS);
+	score->ready[PATH_EX] &= ~LOW_REGS;
 	CPU_Stage* stage = &cpu->stage[MEM];
 	if (!cpu->stage_check[3][0] && !cpu->stage_check[3][1]) {
-  /* Store */
-		if (strcmp(stage->opcode, "STORE") == 0) {
-			cpu->data_memory[stage->mem_address]=stage->rs1_value;  
-		}
-		if (strcmp(stage->opcode, "LDR") == 0) {
-			stage->buffer=cpu->data_memory[stage->mem_address %4000];
-			(cpu->mem_forward[stage->rd])=1;
-			(cpu->mem_data[stage->rd])=stage->buffer;
+		dispatch_memory(cpu, stage);
 
-		}
-		if (strcmp(stage->opcode, "LOAD") == 0) {
-			stage->buffer=cpu->data_memory[stage->mem_address %4000];
-			(cpu->mem_forward[stage->rd])=1;
-			(cpu->mem_data[stage->rd])=stage->buffer;
+   /* Copy data from memory latch to writeback latch*/
 
+		cpu->stage[WB] = cpu->stage[MEM];
+		cpu->bubble[WB] = cpu->bubble[MEM];
+		cpu->stage_set[3][0]=1;
+		if (cpu->display) {
+			show_stage(cpu, stage);
 		}
+		struct CPU_Stage Apex = {0};
+		cpu->stage[MEM]=Apex;
+	}
 
+	return 0;
+}
 
-		if(strcmp(stage->opcode,"HALT")==0)
-		{
-			cpu->halt++;
-		}
+/*
+ *  Writeback stage handlers
+ */
+static int
+writeback_result(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	cpu->regs[stage->rd] = stage->buffer;
+	cpu->score.ready[PATH_RF] |= reg_bit(stage->rd);
+	cpu->score.ready[PATH_MEM] &= ~reg_bit(stage->rd);
+	cpu->last_completed = (stage->pc - 4000) /4;
+	return 0;
+}
 
-   /* Copy data from decode latch to execute latch*/
+/* ADD, SUB and MUL also set the zero flags */
+static int
+writeback_arith(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	writeback_result(cpu, stage);
+	if((cpu->regs[stage->rd]) == 0)
+	{
+		cpu->zflag=1;
+		cpu->nzflag=0;
+	}
+	else {
+		cpu->zflag=0;
+		cpu->nzflag=1;
+	}
+	return 0;
+}
 
-		cpu->stage[WB] = cpu->stage[MEM];
-		cpu->stage_set[3][0]=1;
-		if (strcmp((cpu->f),"display")==0) {
-			print_stage_content("Memory", stage);
-		}
-		struct CPU_Stage Apex;
-		cpu->stage[MEM]=Apex;
-	}    
+static int
+writeback_store(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	cpu->last_completed = (stage->pc - 4000) /4;
+	return 0;
+}
 
+static int
+writeback_halt(APEX_CPU* cpu, CPU_Stage* stage)
+{
+	cpu->halt++;
 	return 0;
 }
 
+static const APEX_Stage_Handler writeback_handlers[NUM_OPCODES] = {
+	[OP_NONE] = handle_none,
+	[OP_MOVC] = writeback_result,
+	[OP_ADD] = writeback_arith,
+	[OP_SUB] = writeback_arith,
+	[OP_MUL] = writeback_arith,
+	[OP_AND] = writeback_result,
+	[OP_OR] = writeback_result,
+	[OP_XOR] = writeback_result,
+	[OP_LOAD] = writeback_result,
+	[OP_LDR] = writeback_result,
+	[OP_STORE] = writeback_store,
+	[OP_BZ] = handle_none,
+	[OP_BNZ] = handle_none,
+	[OP_JUMP] = handle_none,
+	[OP_HALT] = writeback_halt,
+	[OP_NOP] = handle_none,
+};
+
+DEFINE_DISPATCHER(dispatch_writeback, writeback_handlers)
+
 /*
  *  Writeback Stage of APEX Pipeline
  *
@@ -1110,115 +1341,37 @@ memory(APEX_CPU* cpu)
  */
 int writeback(APEX_CPU* cpu)
 {
-	for(int i = 0;i<16;i++){
-		cpu->regs_valid[i]=1;
-	}
+	cpu->score.ready[PATH_RF] |= LOW_REGS;
 	CPU_Stage* stage = &cpu->stage[WB];
+	int cause = cpu->bubble[WB];
 	if (!cpu->stage_check[4][0] && !cpu->stage_check[4][1]) {
     /* Update register file */
-		cpu->regs_valid[0]=1;
-		if (strcmp(stage->opcode, "MOVC") == 0) {
-			cpu->regs[stage->rd] = stage->buffer;
-			cpu->regs_valid[stage->rd]=1;
-			cpu->mem_forward[stage->rd] = 0;
-			cpu->ins_completed = (stage->pc - 4000) /4;
-		}
-		if (strcmp(stage->opcode, "LOAD") == 0) {
-			cpu->regs[stage->rd] = stage->buffer;
-			cpu->regs_valid[stage->rd]=1;
-			cpu->mem_forward[stage->rd] = 0;
-			cpu->ins_completed = (stage->pc - 4000) /4;
-		}
-		if (strcmp(stage->opcode, "LDR") == 0) {
-			cpu->regs[stage->rd] = stage->buffer;
-			cpu->regs_valid[stage->rd]=1;
-			cpu->mem_forward[stage->rd] = 0;
-			cpu->ins_completed = (stage->pc - 4000) /4;
-		}
-
-		if(strcmp(stage->opcode,"HALT")==0)
-		{
-			cpu->halt++;
-		}
-
-		if (strcmp(stage->opcode, "STORE") == 0) {
-
-			cpu->ins_completed = (stage->pc - 4000) /4;
-		}
-		if (strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "MUL") == 0) {
-			cpu->regs[stage->rd]=stage->buffer;
-			cpu->regs_valid[stage->rd]=1;
-			cpu->wb_forward[stage->rd]=1;
-			cpu->mem_forward[stage->rd] = 0;
-			if((cpu->regs[stage->rd]) == 0)
-			{
-				cpu->zflag=1;
-				cpu->nzflag=0;
+		dispatch_writeback(cpu, stage);
+		if (APEX_counts_as_instruction(stage->opcode)) {
+			cause = stage->opcode == OP_HALT ? CPI_HALT : CPI_BASE;
+			cpu->retired++;
+			if (cpu->seq_profile) {
+				APEX_profile_commit(cpu, stage->pc);
 			}
-			else {
-				cpu->zflag=0;
-				cpu->nzflag=1;
+			if (cpu->lanes) {
+				APEX_lanes_commit(cpu, stage->pc);
 			}
-			cpu->ins_completed = (stage->pc - 4000) /4;
-		}
-		if (strcmp(stage->opcode, "XOR") == 0) {
-			cpu->regs[stage->rd]=stage->buffer;
-			cpu->regs_valid[stage->rd]=1;
-			cpu->wb_forward[stage->rd]=1;
-			cpu->mem_forward[stage->rd] = 0;
-			cpu->ins_completed = (stage->pc - 4000) /4;
-		}
-		if(strcmp(stage->opcode, "SUB")== 0) {
-			cpu->regs[stage->rd]=stage->buffer;
-			cpu->regs_valid[stage->rd]=1;
-			cpu->wb_forward[stage->rd]=1;
-			cpu->mem_forward[stage->rd] = 0;
-			if((cpu->regs[stage->rd]) == 0)
-			{
-				cpu->zflag=1;
-				cpu->nzflag=0;
-			}
-			else {
-				cpu->zflag=0;
-				cpu->nzflag=1;
-			}
-			cpu->ins_completed = (stage->pc - 4000) /4;
-		}
-
-		if(strcmp(stage->opcode, "AND")== 0) {
-			cpu->regs[stage->rd]=stage->buffer;
-			cpu->regs_valid[stage->rd]=1;
-			cpu->wb_forward[stage->rd]=1;
-			cpu->mem_forward[stage->rd] = 0;
-			cpu->ins_completed = (stage->pc - 4000) /4;
-		}
-
-		if(strcmp(stage->opcode, "MUL")== 0) {
-			cpu->regs[stage->rd]=stage->buffer;
-			cpu->mem_forward[stage->rd] = 0;
-			cpu->ins_completed = (stage->pc - 4000) /4;
 		}
 
-		if(strcmp(stage->opcode, "OR")== 0) {
-			cpu->regs[stage->rd]=stage->buffer;
-			cpu->regs_valid[stage->rd]=1;
-			cpu->wb_forward[stage->rd]=1;
-			cpu->mem_forward[stage->rd] = 0;
-			cpu->ins_completed = (stage->pc - 4000) /4;
-		}
-        
-		if (strcmp((cpu->f),"display")==0) {
-			print_stage_content("Writeback", stage);
+		if (cpu->display) {
+			show_stage(cpu, stage);
 		}
-		struct CPU_Stage Apex;
+		struct CPU_Stage Apex = {0};
 		cpu ->stage[WB]=Apex;
 	}
 
+  /* Every cycle is charged to one cause of the CPI stack */
+	cpu->cpi[cause]++;
+	cpu->cycle_cause = cause;
 	return 0;
 
 }
 
-
 /*
  *  APEX CPU simulation loop
  *
@@ -1228,45 +1381,257 @@ int writeback(APEX_CPU* cpu)
 int
 APEX_cpu_run(APEX_CPU* cpu)
 {
-   /* for (int i = 0; i < 16; ++i)
-    {
-    	cpu->regs_valid[i] = 1;
-    }*/
+	int checkpointed = 0;
 	while (1) {
-  //printf("INS completed %d  - %d  %d  %d %d\n",cpu->ins_completed ,cpu->code_memory_size ,cpu->clock, cpu->cycle , cpu->halt );
     /* All the instructions committed, so exit */
-		if (cpu->ins_completed == cpu->code_memory_size || cpu->clock==cpu->cycle || cpu->halt >=4) {
-			printf("%d",cpu->code_memory_size);
-			printf("(apex) >> Simulation Complete");
+		if (APEX_cpu_finished(cpu) || cpu->clock==cpu->cycle) {
+			fprintf(cpu->out, "%d",cpu->code_memory_size);
+			fprintf(cpu->out, "(apex) >> Simulation Complete");
 			break;
 		}
 
-		if (strcmp((cpu->f),"display")==0) {
-			printf("--------------------------------\n");
-			printf("Clock Cycle #: %d\n", cpu->clock);
-			printf("--------------------------------\n");
+		if (cpu->checkpoint_path && cpu->clock == cpu->checkpoint_at) {
+			if (APEX_cpu_checkpoint(cpu, cpu->checkpoint_path) != 0) {
+				fprintf(cpu->log, "APEX_Error : Unable to write checkpoint %s\n", cpu->checkpoint_path);
+			}
+			checkpointed = 1;
+		}
+
+		int limit = cpu->cycle;
+		if (cpu->checkpoint_path && cpu->checkpoint_at > cpu->clock &&
+			(limit <= cpu->clock || cpu->checkpoint_at < limit)) {
+			limit = cpu->checkpoint_at;
 		}
+		APEX_cpu_advance(cpu, limit);
+	}
+	APEX_cpu_print_state(cpu);
+	APEX_cpu_print_cpi_stack(cpu);
+	return APEX_checkpoint_missed(cpu, checkpointed);
+
+}
+
+/*
+ * Returns 1 once the program has committed its last instruction or
+ * HALT has drained through the pipeline
+ */
+int
+APEX_cpu_finished(APEX_CPU* cpu)
+{
+	return cpu->last_completed == cpu->code_memory_size || cpu->halt >= 4;
+}
+
+/*
+ * Simulates one clock cycle of the pipeline
+ */
+void
+APEX_cpu_cycle(APEX_CPU* cpu)
+{
+	if (cpu->display & APEX_DISPLAY_TEXT) {
+		fprintf(cpu->out, "--------------------------------\n");
+		fprintf(cpu->out, "Clock Cycle #: %d\n", cpu->clock);
+		fprintf(cpu->out, "--------------------------------\n");
+	}
+	if (cpu->display & APEX_DISPLAY_TRACE) {
+		APEX_trace_begin(cpu);
+	}
+	if (cpu->display & APEX_DISPLAY_TIMELINE) {
+		APEX_timeline_cycle(cpu);
+	}
+
+	APEX_ZONE(ZONE_WRITEBACK, writeback(cpu));
+	APEX_ZONE(ZONE_MEMORY, memory(cpu));
+	APEX_ZONE(ZONE_EXECUTE, execute(cpu));
+	APEX_ZONE(ZONE_DECODE, decode(cpu));
+	APEX_ZONE(ZONE_FETCH, fetch(cpu));
+	if (cpu->stage_check[1][1]) {
+		cpu->decode_stalls++;
+	}
+	if (cpu->stage_check[2][0] || cpu->stage_check[2][1]) {
+		cpu->execute_busy++;
+	}
+	if (cpu->display & APEX_DISPLAY_TRACE) {
+		APEX_trace_end(cpu);
+	}
+	cpu->clock++;
+}
+
+/* Pipeline state that a cycle repeating the one before leaves unchanged */
+typedef struct APEX_Cycle_State
+{
+	CPU_Stage stage[NUM_STAGES];
+	int stage_set[5][2];
+	int stage_check[5][2];
+	unsigned int ready[NUM_PATHS];
+	int pc;
+	int halt;
+	int zflag;
+	int nzflag;
+	int last_completed;
+	unsigned char bubble[NUM_STAGES];
+} APEX_Cycle_State;
 
-		writeback(cpu);
-		memory(cpu);
-		execute(cpu);
-		decode(cpu);
-		fetch(cpu);
-		cpu->clock++;
+static void
+save_cycle_state(APEX_CPU* cpu, APEX_Cycle_State* state)
+{
+	/* Compared whole, padding included */
+	memset(state, 0, sizeof(*state));
+	memcpy(state->stage, cpu->stage, sizeof(state->stage));
+	memcpy(state->stage_set, cpu->stage_set, sizeof(state->stage_set));
+	memcpy(state->stage_check, cpu->stage_check, sizeof(state->stage_check));
+	memcpy(state->ready, cpu->score.ready, sizeof(state->ready));
+	state->pc = cpu->pc;
+	state->halt = cpu->halt;
+	state->zflag = cpu->zflag;
+	state->nzflag = cpu->nzflag;
+	state->last_completed = cpu->last_completed;
+	memcpy(state->bubble, cpu->bubble, sizeof(state->bubble));
+}
+
+static int
+same_cycle_state(APEX_CPU* cpu, const APEX_Cycle_State* state)
+{
+	APEX_Cycle_State now;
+	save_cycle_state(cpu, &now);
+	return memcmp(&now, state, sizeof(now)) == 0;
+}
+
+/*
+ * Simulates a cycle that starts with bubbles in MEM and WB, and so reads
+ * and writes no register or memory values. If it leaves every latch,
+ * hazard bit and flag as it found them, the following cycles repeat it
+ * exactly: while EX holds for configured latency, until ex_wait runs
+ * out, and for good when EX is not holding, e.g. decode stalled for a
+ * source no one will produce. Those only advance the clock, the stall
+ * counters and the CPI cause of the cycle, so up to room of them are
+ * accounted for without simulating.
+ */
+static void
+cycle_and_skip(APEX_CPU* cpu, long room)
+{
+	APEX_Cycle_State before;
+	save_cycle_state(cpu, &before);
+	int ex_wait = cpu->ex_wait;
+	long decode_stalls = cpu->decode_stalls;
+	long execute_busy = cpu->execute_busy;
+	APEX_cpu_cycle(cpu);
+
+	if (!same_cycle_state(cpu, &before)) {
+		return;
+	}
+	long repeats;
+	if (ex_wait > 0 && cpu->ex_wait == ex_wait - 1) {
+		repeats = cpu->ex_wait;
 	}
-	printf(" =============== STATE OF ARCHITECTURAL REGISTER FILE ==========");
+	else if (ex_wait == 0 && cpu->ex_wait == 0) {
+		repeats = INT_MAX;
+	}
+	else {
+		return;
+	}
+	if (repeats > room) {
+		repeats = room;
+	}
+	if (repeats > INT_MAX - cpu->clock) {
+		repeats = INT_MAX - cpu->clock;
+	}
+	if (ex_wait > 0) {
+		cpu->ex_wait -= repeats;
+	}
+	if (repeats > 0 && (cpu->display & APEX_DISPLAY_TRACE)) {
+		APEX_trace_repeat(cpu, repeats);
+	}
+	cpu->clock += repeats;
+	cpu->cpi[cpu->cycle_cause] += repeats;
+	cpu->decode_stalls += repeats * (cpu->decode_stalls - decode_stalls);
+	cpu->execute_busy += repeats * (cpu->execute_busy - execute_busy);
+}
+
+/*
+ * Simulates one clock cycle, then skips the cycles that would repeat it
+ * up to clock limit (none if limit is not ahead of the clock). Display
+ * runs are never skipped, since they print every cycle; a trace records
+ * the skipped cycles as repeats.
+ */
+void
+APEX_cpu_advance(APEX_CPU* cpu, int limit)
+{
+	/* Only a held EX or a stalled decode can keep every latch as it is */
+	if (cpu->config.may_hold && !(cpu->display & APEX_DISPLAY_TEXT) &&
+		(cpu->ex_wait || cpu->stage_check[1][1]) &&
+		inert_latch(&cpu->stage[MEM]) && inert_latch(&cpu->stage[WB])) {
+		cycle_and_skip(cpu, limit > cpu->clock ? (long)limit - cpu->clock - 1 : INT_MAX);
+	}
+	else {
+		APEX_cpu_cycle(cpu);
+	}
+}
+
+/*
+ * Simulates cycles until retired reaches target or the program finishes.
+ * Returns 1 if the program finished.
+ */
+int
+APEX_cpu_simulate(APEX_CPU* cpu, long target)
+{
+	while (cpu->retired < target) {
+		if (APEX_cpu_finished(cpu)) {
+			return 1;
+		}
+		APEX_cpu_advance(cpu, 0);
+	}
+	return APEX_cpu_finished(cpu);
+}
+
+/*
+ * Prints the architectural register file and the start of data memory
+ */
+void
+APEX_cpu_print_state(APEX_CPU* cpu)
+{
+	fprintf(cpu->out, " =============== STATE OF ARCHITECTURAL REGISTER FILE ==========");
 	for(int i=0;i<16;i++)
 	{
-		printf("\n  REGS[%d]     |      %d     |      Status=%s ",i,cpu->regs[i],(cpu->regs_valid[i]) ? "VALID" : "INVALID");
+		fprintf(cpu->out, "\n  REGS[%d]     |      %d     |      Status=%s ",i,cpu->regs[i],(cpu->score.ready[PATH_RF] & reg_bit(i)) ? "VALID" : "INVALID");
 	}
 
-	printf("\n============== STATE OF DATA MEMORY =============");
+	fprintf(cpu->out, "\n============== STATE OF DATA MEMORY =============");
 	for(int j=0;j<99;j++)
 	{
-		printf("\n MEM[%d]       |   %d        | ",j,cpu->data_memory[j]);
+		fprintf(cpu->out, "\n MEM[%d]       |   %d        | ",j,APEX_memory_read(cpu, j));
 
 	}
+}
 
-	return 0;
+static const char* cpi_cause_names[NUM_CPI_CAUSES] = {
+	[CPI_BASE] = "Base",
+	[CPI_LOAD_RAW] = "RAW on LOAD",
+	[CPI_RAW] = "RAW, other",
+	[CPI_MUL] = "MUL in EX",
+	[CPI_EX_LATENCY] = "EX/memory latency",
+	[CPI_BRANCH_FLAGS] = "BZ/BNZ flags",
+	[CPI_FLUSH] = "Control flush",
+	[CPI_HALT] = "HALT drain",
+	[CPI_FETCH] = "Fill/no fetch",
+	[CPI_NOP] = "NOP",
+};
 
+/*
+ * Prints the CPI stack: the cycles charged to each cause, and their
+ * share of the CPI over the instructions retired
+ */
+void
+APEX_cpu_print_cpi_stack(APEX_CPU* cpu)
+{
+	long retired = cpu->retired > 0 ? cpu->retired : 1;
+	long cycles = cpu->clock > 0 ? cpu->clock : 1;
+
+	fprintf(cpu->out, "\n =============== CPI STACK ===============");
+	fprintf(cpu->out, "\n  Cycles               |  %d", cpu->clock);
+	fprintf(cpu->out, "\n  Retired              |  %ld", cpu->retired);
+	fprintf(cpu->out, "\n  CPI                  |  %.4f", (double)cpu->clock / retired);
+	for (int i = 0; i < NUM_CPI_CAUSES; ++i) {
+		fprintf(cpu->out, "\n  %-20s |  %10ld cycles  |  %.4f CPI  |  %5.1f%%", cpi_cause_names[i],
+			cpu->cpi[i], (double)cpu->cpi[i] / retired, 100.0 * cpu->cpi[i] / cycles);
+	}
+	fprintf(cpu->out, "\n");
 }
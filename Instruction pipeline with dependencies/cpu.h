@@ -8,6 +8,7 @@
  *  Gaurav Kothari (gkothar1@binghamton.edu)
  *  State University of New York, Binghamton
  */
+#include <stdio.h>
 
 enum
 {
@@ -19,35 +20,298 @@ enum
   NUM_STAGES
 };
 
-/* Format of an APEX instruction  */
+/* APEX opcodes, resolved once by the file parser */
+#define APEX_OPCODES(X) \
+  X(NONE)		/* Empty latch */ \
+  X(MOVC) \
+  X(ADD) \
+  X(SUB) \
+  X(MUL) \
+  X(AND) \
+  X(OR) \
+  X(XOR) \
+  X(LOAD) \
+  X(LDR) \
+  X(STORE) \
+  X(BZ) \
+  X(BNZ) \
+  X(JUMP) \
+  X(HALT) \
+  X(NOP)
+
+#define APEX_OPCODE_ENUM(op) OP_##op,
+typedef enum APEX_Opcode
+{
+  APEX_OPCODES(APEX_OPCODE_ENUM)
+  NUM_OPCODES
+} APEX_Opcode;
+
+/*
+ * Stage handler dispatch, selected at build time with
+ * make DISPATCH=switch|table|threaded
+ */
+#define APEX_DISPATCH_SWITCH   0
+#define APEX_DISPATCH_TABLE    1
+#define APEX_DISPATCH_THREADED 2
+
+#ifndef APEX_DISPATCH
+#define APEX_DISPATCH APEX_DISPATCH_SWITCH
+#endif
+
+/* Computed goto is a GNU extension */
+#if APEX_DISPATCH == APEX_DISPATCH_THREADED && !defined(__GNUC__)
+#undef APEX_DISPATCH
+#define APEX_DISPATCH APEX_DISPATCH_SWITCH
+#endif
+
+/*
+ * Host-side self-profiling, built in with make HOST_PROFILE=1. APEX_ZONE
+ * times a statement into a ring of events of the calling thread, written
+ * out as Chrome trace events (see hostprof.c); otherwise it is just the
+ * statement.
+ */
+typedef enum APEX_Zone
+{
+  ZONE_WRITEBACK,
+  ZONE_MEMORY,
+  ZONE_EXECUTE,
+  ZONE_DECODE,
+  ZONE_FETCH,
+  ZONE_LOAD,		// Program or checkpoint, as main loads it
+  ZONE_IMAGE,
+  ZONE_ASSEMBLE,
+  ZONE_PARSE,		// create_code_memory
+  ZONE_PARSE_CHUNK,	// One chunk of a parallel parse
+  ZONE_DATA_IMAGE,
+  NUM_ZONES
+} APEX_Zone;
+
+#ifdef APEX_HOST_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline unsigned long
+APEX_hostprof_clock(void)
+{
+  return __rdtsc();
+}
+#else
+#include <time.h>
+static inline unsigned long
+APEX_hostprof_clock(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ul + now.tv_nsec;
+}
+#endif
+
+void
+APEX_hostprof_event(APEX_Zone zone, unsigned long start);
+
+#define APEX_ZONE(zone, statement) \
+  do { \
+    unsigned long apex_zone_start = APEX_hostprof_clock(); \
+    statement; \
+    APEX_hostprof_event(zone, apex_zone_start); \
+  } while (0)
+#else
+#define APEX_ZONE(zone, statement) \
+  do { \
+    statement; \
+  } while (0)
+#endif
+
+/* Instruction classes, precomputed per opcode */
+typedef enum APEX_Class
+{
+  CLASS_NONE,		// NOP, HALT and empty latches
+  CLASS_ALU,
+  CLASS_MUL,
+  CLASS_LOAD,
+  CLASS_STORE,
+  CLASS_BRANCH,
+  NUM_CLASSES
+} APEX_Class;
+
+/* Static properties of an opcode */
+typedef struct APEX_Opcode_Info
+{
+  const char* name;	// Mnemonic as written in the input file
+  int ins_class;	// APEX_Class of the opcode
+  int sets_flags;	// Updates zflag/nzflag in writeback
+  const char* operands;	// Operands in order: d rd, 1 rs1, 2 rs2, # literal
+} APEX_Opcode_Info;
+
+extern const APEX_Opcode_Info opcode_info[NUM_OPCODES];
+
+/*
+ * Returns 1 if opcode counts as an instruction: NOPs and empty code
+ * memory slots do not. Pipeline retirement and the functional path both
+ * count by it, so instruction positions of the two paths agree.
+ */
+static inline int
+APEX_counts_as_instruction(int opcode)
+{
+  return opcode != OP_NONE && opcode != OP_NOP;
+}
+
+/* Format of a predecoded APEX instruction */
 typedef struct APEX_Instruction
 {
-  char opcode[128];	// Operation Code
-  int rd;		    // Destination Register Address
-  int rs1;		    // Source-1 Register Address
-  int rs2;		    // Source-2 Register Address
+  unsigned char opcode;	// Operation Code (APEX_Opcode)
+  unsigned char ins_class;	// Instruction class (APEX_Class)
+  unsigned char rd;	    // Destination Register Address
+  unsigned char rs1;	    // Source-1 Register Address
+  unsigned char rs2;	    // Source-2 Register Address
   int imm;		    // Literal Value
 } APEX_Instruction;
 
-/* Model of CPU stage latch */
+struct APEX_CPU;
+struct APEX_Lanes;
+
+/*
+ * Handler of a superinstruction covering consecutive code memory entries
+ * starting at ins. Returns the next pc, or -1 once execution stops.
+ */
+typedef int (*APEX_Fused_Handler)(struct APEX_CPU* cpu,
+                                  const APEX_Instruction* ins, int pc);
+
+/* Superinstruction installed at a code memory index */
+typedef struct APEX_Fused
+{
+  APEX_Fused_Handler handler;
+  int len;		    // Instructions covered, 0 if not fused
+} APEX_Fused;
+
+/* Counts of committed opcode sequences, indexed by first code index */
+typedef struct APEX_Seq_Profile
+{
+  unsigned long* pairs;
+  unsigned long* triples;
+  unsigned long committed;
+  int last[2];		    // Code indices of the last two commits
+} APEX_Seq_Profile;
+
+#define APEX_PROFILE_VERSION 1
+#define APEX_CHECKPOINT_VERSION 10
+#define APEX_IMAGE_VERSION 2
+#define APEX_DUMP_VERSION 1
+#define APEX_TRACE_VERSION 1
+
+/* Microarchitecture parameters of a run, read by config.c */
+typedef struct APEX_Config
+{
+  int latency[NUM_OPCODES];	// EX cycles per opcode
+  int mem_latency;		// Cycles per data memory access
+  int forwarding;		// Results bypass to decode before writeback
+  unsigned int mem_words;	// Size of the data address space, addresses wrap
+  int may_hold;		// Some cycle can repeat unchanged, see config_may_hold
+} APEX_Config;
+
+/*
+ * Data memory, see paging.c. Pages of APEX_PAGE_WORDS words are found
+ * through a two-level table and allocated by the first store into them.
+ * The page accessed last is cached for LOAD and STORE.
+ */
+#define APEX_PAGE_SHIFT 10
+#define APEX_PAGE_WORDS (1 << APEX_PAGE_SHIFT)
+#define APEX_TABLE_SHIFT 10
+#define APEX_MEMORY_PAGES (1u << (2 * APEX_TABLE_SHIFT))
+#define APEX_MEMORY_MAX_WORDS (APEX_MEMORY_PAGES * APEX_PAGE_WORDS)	// 4 GB
+
+typedef struct APEX_Memory
+{
+  int** table[APEX_MEMORY_PAGES >> APEX_TABLE_SHIFT];	// NULL until used
+  int* last;			// Page accessed last, or NULL
+  unsigned int last_page;	// Its page number
+  int pages;			// Pages allocated
+} APEX_Memory;
+
+/* Places decode reads a source register from, in no particular order */
+enum
+{
+  PATH_EX,		// Result EX computed this cycle
+  PATH_MEM,		// Result that left EX last cycle, or was loaded this one
+  PATH_LAST,		// Last result EX computed for the register
+  PATH_RF,		// Register file
+  NUM_PATHS
+};
+
+/*
+ * Hazard scoreboard, bit n of ready[path] is set while path holds a value
+ * for register n. EX results move to MEM the next cycle, so the path a
+ * register is on also tells the cycle its value became available.
+ */
+typedef struct APEX_Scoreboard
+{
+  unsigned int ready[NUM_PATHS];
+  int value[PATH_RF][32];	// Register file values are in regs
+} APEX_Scoreboard;
+
+/*
+ * Model of CPU stage latch. Register numbers and flags are bytes so a
+ * latch is 32 bytes and the five of them span three cache lines.
+ */
 typedef struct CPU_Stage
 {
   int pc;		    // Program Counter
-  char opcode[128];	// Operation Code
-  int rs1;		    // Source-1 Register Address
-  int rs2;		    // Source-2 Register Address
-  int rd;		    // Destination Register Address
   int imm;		    // Literal Value
   int rs1_value;	// Source-1 Register Value
   int rs2_value;	// Source-2 Register Value
   int buffer;		// Latch to hold some value
   int mem_address;	// Computed Memory Address
-  int busy;		    // Flag to indicate, stage is performing some action
-  int stalled;		// Flag to indicate, stage is stalled
-   
+  unsigned char opcode;	// Operation Code (APEX_Opcode)
+  unsigned char rs1;	    // Source-1 Register Address
+  unsigned char rs2;	    // Source-2 Register Address
+  unsigned char rd;	    // Destination Register Address
+  unsigned char busy;	    // Flag to indicate, stage is performing some action
+  unsigned char stalled;	// Flag to indicate, stage is stalled
+  unsigned short id;	    // Timeline tag, wrapping; 0 if not followed
 } CPU_Stage;
 
-/* Model of APEX CPU */
+/*
+ * Causes of the CPI stack. Writeback charges every cycle to exactly one:
+ * to what it retired, otherwise to the cause of the bubble in its latch,
+ * which is set where the bubble entered the pipeline.
+ */
+typedef enum APEX_Cpi_Cause
+{
+  CPI_BASE,		// An instruction other than HALT retired
+  CPI_LOAD_RAW,		// Decode waited on a LOAD or LDR
+  CPI_RAW,		// Decode waited on another producer
+  CPI_MUL,		// MUL held EX
+  CPI_EX_LATENCY,	// Configured latency held EX
+  CPI_BRANCH_FLAGS,	// BZ/BNZ waited on the flags of ADD, SUB or MUL
+  CPI_FLUSH,		// Squashed behind a taken JUMP, BZ or BNZ
+  CPI_HALT,		// HALT writing back, or bubbles behind it
+  CPI_FETCH,		// Pipeline fill, or fetch past the end of code
+  CPI_NOP,		// NOPs of the program
+  NUM_CPI_CAUSES
+} APEX_Cpi_Cause;
+
+/* What the stages show of every cycle, bits of APEX_CPU.display */
+#define APEX_DISPLAY_TEXT 1	// Printed to out, as in display mode
+#define APEX_DISPLAY_TRACE 2	// Recorded in the binary trace, see trace.c
+#define APEX_DISPLAY_TIMELINE 4	// Followed per instruction, see timeline.c
+
+struct APEX_Trace;
+struct APEX_Timeline;
+
+/* One cycle of the binary trace as the pipeline records it */
+typedef struct APEX_Trace_Record
+{
+  int clock;
+  unsigned char shown;		// Bit per latch shown this cycle
+  unsigned char flags;		// Stall and flush bits, see trace.c
+  unsigned char opcode[NUM_STAGES];
+  int pc[NUM_STAGES];
+} APEX_Trace_Record;
+
+/*
+ * Model of APEX CPU. Everything a cycle touches comes first, so it
+ * shares as few cache lines as possible; set-up, I/O handles and the
+ * data memory, which only LOAD and STORE reach, follow it.
+ */
 typedef struct APEX_CPU
 {
   /* Clock cycles elasped */
@@ -55,52 +319,337 @@ typedef struct APEX_CPU
 
   /* Current program counter */
   int pc;
-  
-  /* Integer register file */
-  int regs[32];
-  int regs_valid[32];
+
+  int halt;
+  int drain;		// Fetch supplies NOPs without advancing pc
+  int ex_wait;		// Cycles EX still holds for configured latency
+  int zflag;
+  int nzflag;
+  int last_completed;	// Code index of the last result or store written back
+  int display;		// APEX_DISPLAY_* bits, what stages show of a cycle
+  int cycle;
+
+  /* Some stats */
+  long retired;		// Instructions committed by writeback
+  long decode_stalls;	// Cycles decode held its instruction
+  long execute_busy;	// Cycles EX held a MUL or waiting branch
+  long flushes;		// Taken control transfers squashing fetch
+  long cpi[NUM_CPI_CAUSES];	// Cycles charged to each APEX_Cpi_Cause
+
+  /* Code Memory where instructions are stored */
+  APEX_Instruction* code_memory;
+  int code_memory_size;
+
+  /* Latencies and forwarding policy of the pipeline */
+  APEX_Config config;
+
+  /* Committed opcode sequence profile, NULL when not profiling */
+  APEX_Seq_Profile* seq_profile;
+
+  /* Lockstep lanes following the committed instructions, or NULL */
+  struct APEX_Lanes* lanes;
 
   /* Array of 5 CPU_stage */
   CPU_Stage stage[5];
   int stage_set[5][2];
   int stage_check[5][2];
-  int regs_forward[32];
-  int regs_data[32];
-  int ex_forward[32];
-  int wb_forward[32];
-  int mem_forward[32];
-  int ex_data[32];
-  int wb_data[32];
-  int mem_data[32];
+  unsigned char bubble[NUM_STAGES];	// APEX_Cpi_Cause of a bubble in each latch
+  unsigned char cycle_cause;	// Cause writeback charged the last cycle to
+
+  /* Integer register file */
+  int regs[32];
+
+  /* Where decode finds every register, see APEX_Scoreboard */
+  APEX_Scoreboard score;
+
+  /* Cold from here on */
   const char* f;
-  int cycle;
-  
-  /* Code Memory where instructions are stored */
-  APEX_Instruction* code_memory;
-  int code_memory_size;
+  FILE* out;		// Simulation output, stdout unless batched
+  FILE* log;		// Diagnostics, stderr unless batched
+  struct APEX_Trace* trace;	// Binary pipeline trace, or NULL
+  APEX_Trace_Record* trace_record;	// Record of the cycle simulated
+  struct APEX_Timeline* timeline;	// Pipeline timeline export, or NULL
 
-  /* Data Memory */
-  int data_memory[4096];
+  /* Checkpoint written at the start of cycle checkpoint_at, if path set */
+  const char* checkpoint_path;
+  int checkpoint_at;
 
-  /* Some stats */
-  int ins_completed;
-  int halt;
-  int zflag;
-  int nzflag;
+  /* Mapped program image holding code memory, NULL if it was parsed */
+  void* image;
+  size_t image_size;
+
+  /* Superinstructions for the functional path, indexed like code memory */
+  APEX_Fused* fused;
+
+  /* Data Memory */
+  APEX_Memory memory;
 } APEX_CPU;
 
+int*
+APEX_memory_page(APEX_Memory* memory, unsigned int page, int allocate);
+
+/* Reduces a LOAD or STORE address into an address space of words words */
+static inline unsigned int
+APEX_memory_wrap(unsigned int words, int address)
+{
+  unsigned int a = (unsigned int)address;
+  return (words & (words - 1)) ? a % words : a & (words - 1);
+}
+
+/* Returns the word at address, or NULL if its page was never allocated */
+static inline int*
+APEX_memory_word(APEX_Memory* memory, unsigned int address, int allocate)
+{
+  int* words = memory->last;
+  if (!words || address >> APEX_PAGE_SHIFT != memory->last_page) {
+    words = APEX_memory_page(memory, address >> APEX_PAGE_SHIFT, allocate);
+    if (!words) {
+      return NULL;
+    }
+  }
+  return &words[address & (APEX_PAGE_WORDS - 1)];
+}
+
+static inline int
+APEX_memory_read(APEX_CPU* cpu, int address)
+{
+  int* word = APEX_memory_word(&cpu->memory,
+    APEX_memory_wrap(cpu->config.mem_words, address), 0);
+  return word ? *word : 0;
+}
+
+static inline void
+APEX_memory_write(APEX_CPU* cpu, int address, int value)
+{
+  *APEX_memory_word(&cpu->memory,
+    APEX_memory_wrap(cpu->config.mem_words, address), 1) = value;
+}
+
+int*
+APEX_memory_next(const APEX_Memory* memory, unsigned int* page);
+
+int
+APEX_memory_copy(APEX_Memory* dst, const APEX_Memory* src);
+
+void
+APEX_memory_free(APEX_Memory* memory);
+
+void
+APEX_memory_load(APEX_Memory* memory, const int* words, unsigned int count);
+
 APEX_Instruction*
 create_code_memory(const char* filename, int* size);
 
+int
+APEX_parse_instruction(APEX_Instruction* ins, const char* text, int len,
+                       const char* filename, int line);
+
 APEX_CPU*
 APEX_cpu_init(const char* filename);
 
+int
+APEX_image_load(APEX_CPU* cpu, const char* path);
+
+void
+APEX_image_release(APEX_CPU* cpu);
+
+int
+APEX_asm_load(APEX_CPU* cpu, const char* path);
+
+int
+APEX_image_write(const char* path, const APEX_Instruction* code, int size,
+                 const APEX_Memory* data);
+
+int
+APEX_check_code(const APEX_Instruction* code, int size);
+
+int
+APEX_image_convert(const char* input, const char* output,
+                   const char* data_path);
+
+int
+APEX_data_image_load(APEX_CPU* cpu, const char* path);
+
+int
+APEX_dump_write(APEX_CPU* cpu, const char* path, APEX_Memory* baseline);
+
 int
 APEX_cpu_run(APEX_CPU* cpu);
 
 void
 APEX_cpu_stop(APEX_CPU* cpu);
 
+void
+APEX_cpu_print_code_memory(APEX_CPU* cpu);
+
+APEX_CPU*
+APEX_cpu_clone(APEX_CPU* cpu);
+
+void
+APEX_cpu_free_clone(APEX_CPU* copy);
+
+void
+APEX_cpu_reset_pipeline(APEX_CPU* cpu);
+
+void
+APEX_cpu_cycle(APEX_CPU* cpu);
+
+void
+APEX_cpu_advance(APEX_CPU* cpu, int limit);
+
+int
+APEX_cpu_simulate(APEX_CPU* cpu, long target);
+
+int
+APEX_cpu_finished(APEX_CPU* cpu);
+
+long
+APEX_cpu_fast_forward(APEX_CPU* cpu, long n, long warmup);
+
+void
+APEX_cpu_print_state(APEX_CPU* cpu);
+
+void
+APEX_cpu_print_cpi_stack(APEX_CPU* cpu);
+
+void
+APEX_print_stage(FILE* out, int index, CPU_Stage* stage);
+
+void
+APEX_print_instruction(FILE* out, CPU_Stage* stage);
+
+int
+APEX_trace_open(APEX_CPU* cpu, const char* path);
+
+void
+APEX_trace_begin(APEX_CPU* cpu);
+
+void
+APEX_trace_end(APEX_CPU* cpu);
+
+void
+APEX_trace_repeat(APEX_CPU* cpu, long count);
+
+int
+APEX_trace_close(APEX_CPU* cpu);
+
+long
+APEX_trace_decode(const char* path, FILE* out);
+
+int
+APEX_hostprof_write(const char* path, FILE* log);
+
+int
+APEX_timeline_open(APEX_CPU* cpu, const char* path);
+
+unsigned short
+APEX_timeline_fetch(struct APEX_Timeline* timeline);
+
+void
+APEX_timeline_cycle(APEX_CPU* cpu);
+
+void
+APEX_timeline_stage(struct APEX_Timeline* timeline, int index, CPU_Stage* stage);
+
+void
+APEX_timeline_flush(APEX_CPU* cpu);
+
+int
+APEX_timeline_close(APEX_CPU* cpu);
+
+int
+get_code_index(int pc);
+
+int
+APEX_cpu_checkpoint(APEX_CPU* cpu, const char* path);
+
+int
+APEX_checkpoint_missed(APEX_CPU* cpu, int taken);
+
+int
+APEX_cpu_checkpoint_wait(void);
+
+APEX_CPU*
+APEX_cpu_restore(const char* path);
+
+long
+APEX_cpu_step(APEX_CPU* cpu, long max_ins);
+
+int
+APEX_cpu_at_halt(APEX_CPU* cpu);
+
+int
+APEX_cpu_run_functional(APEX_CPU* cpu);
+
+int
+APEX_cpu_run_sampled(APEX_CPU* cpu, long period, long window, long warmup);
+
+int
+APEX_cpu_run_intervals(APEX_CPU* cpu, int intervals, int threads, long warmup);
+
+int
+APEX_cpu_run_simpoints(APEX_CPU* cpu, long interval_size, int clusters,
+                       long warmup);
+
+int
+APEX_cpu_run_lanes(APEX_CPU* cpu, const char* lane_file);
+
+void
+APEX_lanes_commit(APEX_CPU* cpu, int pc);
+
+int
+APEX_batch_run(const char* manifest, const char* summary, int cycles,
+               int threads);
+
+char*
+APEX_trim(char* text);
+
+/* Starting value of APEX_hash_bytes, the FNV-1a offset basis */
+#define APEX_HASH_INIT 1469598103934665603ULL
+
+unsigned long long
+APEX_hash_bytes(unsigned long long hash, const void* data, size_t size);
+
+unsigned int
+APEX_random_next(unsigned int* state);
+
+double
+APEX_now_seconds(void);
+
+/* Task of APEX_run_tasks, called once per index */
+typedef void (*APEX_Task)(void* context, long index);
+
+int
+APEX_run_tasks(APEX_Task task, void* context, long count, int threads);
+
+void
+APEX_config_default(APEX_Config* config);
+
+int
+APEX_config_set(APEX_Config* config, const char* key, const char* value);
+
+int
+APEX_config_load(APEX_Config* config, const char* path);
+
+int
+APEX_sweep_run(APEX_CPU* cpu, const char* sweep_file, const char* summary,
+               long samples, unsigned seed, int threads);
+
+int
+APEX_profile_start(APEX_CPU* cpu);
+
+void
+APEX_profile_commit(APEX_CPU* cpu, int pc);
+
+int
+APEX_profile_save(APEX_CPU* cpu, const char* path);
+
+void
+APEX_profile_free(APEX_CPU* cpu);
+
+int
+APEX_fuse_load(APEX_CPU* cpu, const char* path);
+
 int
 fetch(APEX_CPU* cpu);
 
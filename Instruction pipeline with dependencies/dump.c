@@ -0,0 +1,208 @@
+/*
+ *  dump.c
+ *  Contains initial data memory images and the end-of-run state dump.
+ *
+ *  A dump holds the final registers and the pages of data memory, in
+ *  full or as a delta of the pages that differ from the data memory the
+ *  run started with. File layout (host byte order):
+ *    APEX_Dump_Header
+ *    page numbers  (num_pages unsigned ints, ascending)
+ *    pages         (num_pages pages of APEX_PAGE_WORDS words, starting at
+ *                   data_offset, a multiple of 4096, so a reader mapping
+ *                   the file can use every page in place)
+ *  Dumps are written and read through mmap.
+ *
+ *  An initial data image is either a dump, whose pages are stored over
+ *  data memory, or a raw file of words from MEM[0] up.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+#define DUMP_MAGIC "APEXMEM"
+#define DUMP_ALIGN 4096
+
+typedef struct APEX_Dump_Header
+{
+  char magic[8];
+  int version;
+  int page_words;	// APEX_PAGE_WORDS
+  int num_pages;
+  int delta;		// Only pages that changed during the run are present
+  unsigned int mem_words;	// Data address space of the run
+  int clock;
+  int pc;
+  int zflag;
+  long retired;
+  long data_offset;	// File offset of the first page
+  int regs[32];
+} APEX_Dump_Header;
+
+static const int zero_page[APEX_PAGE_WORDS];
+
+/* Returns 1 if page number page of memory differs from baseline */
+static int
+page_changed(const int* words, APEX_Memory* baseline, unsigned int page)
+{
+  const int* initial = APEX_memory_page(baseline, page, 0);
+  return memcmp(words, initial ? initial : zero_page,
+                sizeof(int) * APEX_PAGE_WORDS) != 0;
+}
+
+static long
+data_offset(int num_pages)
+{
+  long end = sizeof(APEX_Dump_Header) + sizeof(unsigned int) * (long)num_pages;
+  return (end + DUMP_ALIGN - 1) / DUMP_ALIGN * DUMP_ALIGN;
+}
+
+/*
+ * Writes the registers and data memory of cpu to path. With a baseline
+ * only the pages differing from it are written, otherwise every page
+ * allocated. Returns the number of pages written, or -1 on error.
+ */
+int
+APEX_dump_write(APEX_CPU* cpu, const char* path, APEX_Memory* baseline)
+{
+  int num_pages = 0;
+  unsigned int page = 0;
+  for (int* words; (words = APEX_memory_next(&cpu->memory, &page)); ++page) {
+    num_pages += !baseline || page_changed(words, baseline, page);
+  }
+  long offset = data_offset(num_pages);
+  size_t size = offset + sizeof(int) * APEX_PAGE_WORDS * (size_t)num_pages;
+
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    return -1;
+  }
+  void* base = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (base == MAP_FAILED) {
+    close(fd);
+    remove(tmp_path);
+    return -1;
+  }
+
+  APEX_Dump_Header* header = base;
+  memcpy(header->magic, DUMP_MAGIC, sizeof(DUMP_MAGIC));
+  header->version = APEX_DUMP_VERSION;
+  header->page_words = APEX_PAGE_WORDS;
+  header->num_pages = num_pages;
+  header->delta = baseline != NULL;
+  header->mem_words = cpu->config.mem_words;
+  header->clock = cpu->clock;
+  header->pc = cpu->pc;
+  header->zflag = cpu->zflag;
+  header->retired = cpu->retired;
+  header->data_offset = offset;
+  memcpy(header->regs, cpu->regs, sizeof(header->regs));
+
+  unsigned int* numbers = (unsigned int*)(header + 1);
+  int* data = (int*)((char*)base + offset);
+  int written = 0;
+  page = 0;
+  for (int* words; (words = APEX_memory_next(&cpu->memory, &page)); ++page) {
+    if (!baseline || page_changed(words, baseline, page)) {
+      numbers[written] = page;
+      memcpy(&data[(size_t)written * APEX_PAGE_WORDS], words,
+             sizeof(int) * APEX_PAGE_WORDS);
+      written++;
+    }
+  }
+
+  /* mkstemp creates the file private to its owner */
+  fchmod(fd, 0644);
+  int status = munmap(base, size);
+  if (close(fd) != 0) {
+    status = -1;
+  }
+  if (!status && rename(tmp_path, path) != 0) {
+    status = -1;
+  }
+  if (status) {
+    remove(tmp_path);
+    return -1;
+  }
+  return num_pages;
+}
+
+/* Stores the pages of a mapped dump, returns -1 if it is malformed */
+static int
+load_dump(APEX_CPU* cpu, const char* base, size_t size)
+{
+  const APEX_Dump_Header* header = (const APEX_Dump_Header*)base;
+  if (size < sizeof(*header) || header->version != APEX_DUMP_VERSION ||
+      header->page_words != APEX_PAGE_WORDS || header->num_pages < 0 ||
+      header->data_offset != data_offset(header->num_pages) ||
+      size < header->data_offset +
+               sizeof(int) * APEX_PAGE_WORDS * (size_t)header->num_pages) {
+    return -1;
+  }
+  const unsigned int* numbers = (const unsigned int*)(header + 1);
+  const int* data = (const int*)(base + header->data_offset);
+  for (int i = 0; i < header->num_pages; ++i) {
+    if (numbers[i] >= APEX_MEMORY_PAGES) {
+      return -1;
+    }
+    memcpy(APEX_memory_page(&cpu->memory, numbers[i], 1),
+           &data[(size_t)i * APEX_PAGE_WORDS], sizeof(int) * APEX_PAGE_WORDS);
+  }
+  return 0;
+}
+
+/*
+ * Maps the data image at path and stores it over the data memory of cpu:
+ * the pages of a dump, or the words of a raw image from MEM[0] up.
+ * Returns -1 on error.
+ */
+int
+APEX_data_image_load(APEX_CPU* cpu, const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to open data image %s\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return 0;
+  }
+  void* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "APEX_Error : Unable to map data image %s\n", path);
+    return -1;
+  }
+
+  int status = 0;
+  if (size >= sizeof(DUMP_MAGIC) &&
+      memcmp(base, DUMP_MAGIC, sizeof(DUMP_MAGIC)) == 0) {
+    status = load_dump(cpu, base, size);
+  } else if (size % sizeof(int) ||
+             size / sizeof(int) > APEX_MEMORY_MAX_WORDS) {
+    status = -1;
+  } else {
+    APEX_memory_load(&cpu->memory, base, size / sizeof(int));
+  }
+  if (status) {
+    fprintf(stderr, "APEX_Error : %s is not a compatible data image\n", path);
+  }
+  munmap(base, size);
+  return status;
+}
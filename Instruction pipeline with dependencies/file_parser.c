@@ -3,145 +3,489 @@
  *  Contains functions to parse input file and create
  *  code memory, you can edit this file to add new instructions
  *
+ *  Every line is one instruction, "<OPCODE>,<operand>,..." with operands
+ *  "R<n>" for registers and "#<n>" for literals, and a blank line is an
+ *  empty code memory slot. The input is parsed in one pass, in place,
+ *  from a mapped file or from blocks of a stream such as standard input.
+ *  Large files are split at line boundaries into chunks that are parsed
+ *  on one thread each and concatenated in order.
+ *
  *  Author :
  *  Gaurav Kothari (gkothar1@binghamton.edu)
  *  State University of New York, Binghamton
  */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "cpu.h"
 
-/*
- * This function is related to parsing input file
- *
- * Note : You are not supposed to edit this function
- */
+/* Bytes read from a stream at a time, and errors reported per input */
+#define PARSE_BLOCK (1 << 16)
+#define PARSE_MAX_ERRORS 20
+
+/* Smallest chunk of a file worth a thread of its own, and most chunks */
+#define PARSE_CHUNK_MIN (1 << 22)
+#define PARSE_MAX_CHUNKS 64
+
+/* Mnemonic, class, flag behaviour and operands of every opcode */
+const APEX_Opcode_Info opcode_info[NUM_OPCODES] = {
+  [OP_NONE]  = { "",      CLASS_NONE,   0, ""    },
+  [OP_MOVC]  = { "MOVC",  CLASS_ALU,    0, "d#"  },
+  [OP_ADD]   = { "ADD",   CLASS_ALU,    1, "d12" },
+  [OP_SUB]   = { "SUB",   CLASS_ALU,    1, "d12" },
+  [OP_MUL]   = { "MUL",   CLASS_MUL,    1, "d12" },
+  [OP_AND]   = { "AND",   CLASS_ALU,    0, "d12" },
+  [OP_OR]    = { "OR",    CLASS_ALU,    0, "d12" },
+  [OP_XOR]   = { "XOR",   CLASS_ALU,    0, "d12" },
+  [OP_LOAD]  = { "LOAD",  CLASS_LOAD,   0, "d1#" },
+  [OP_LDR]   = { "LDR",   CLASS_LOAD,   0, "d12" },
+  [OP_STORE] = { "STORE", CLASS_STORE,  0, "12#" },
+  [OP_BZ]    = { "BZ",    CLASS_BRANCH, 0, "#"   },
+  [OP_BNZ]   = { "BNZ",   CLASS_BRANCH, 0, "#"   },
+  [OP_JUMP]  = { "JUMP",  CLASS_BRANCH, 0, "1#"  },
+  [OP_HALT]  = { "HALT",  CLASS_NONE,   0, ""    },
+  [OP_NOP]   = { "NOP",   CLASS_NONE,   0, ""    },
+};
+
+/* Code memory built by one parse */
+typedef struct APEX_Parser
+{
+  const char* filename;
+  APEX_Instruction* code;
+  int size;
+  int capacity;
+  int line;		// Number of the line being parsed
+  int errors;
+  int quiet;		// Count errors without reporting them
+} APEX_Parser;
+
+/* Lines from text to end parsed by one thread */
+typedef struct APEX_Parse_Chunk
+{
+  APEX_Parser parser;
+  const char* text;
+  const char* end;
+} APEX_Parse_Chunk;
+
+/* Maps a mnemonic to its opcode, OP_NONE if there is no such opcode */
 static int
-get_num_from_string(char* buffer)
+lookup_opcode(const char* token, size_t len)
 {
-  char str[16];
-  int j = 0;
-  for (int i = 1; buffer[i] != '\0'; ++i) {
-    str[j] = buffer[i];
-    j++;
+  for (int op = OP_NONE + 1; op < NUM_OPCODES; ++op) {
+    const char* name = opcode_info[op].name;
+    if (name[0] == token[0] && strncmp(name, token, len) == 0 &&
+        name[len] == '\0') {
+      return op;
+    }
   }
-  str[j] = '\0';
-  return atoi(str);
+  return OP_NONE;
 }
 
-/*
- * This function is related to parsing input file
- *
- * Note : you can edit this function to add new instructions
- */
-static void
-create_APEX_instruction(APEX_Instruction* ins, char* buffer)
+static int
+is_blank(char c)
 {
-  char* token = strtok(buffer, ",");
-  int token_num = 0;
-  char tokens[6][128];
-  while (token != NULL) {
-    strcpy(tokens[token_num], token);
-    token_num++;
-    token = strtok(NULL, ",");
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char*
+skip_blanks(const char* text, const char* end)
+{
+  while (text < end && is_blank(*text)) {
+    text++;
   }
+  return text;
+}
 
-  strcpy(ins->opcode, tokens[0]);
+/* End of the token at text, which runs up to a comma or a blank */
+static const char*
+token_end(const char* text, const char* end)
+{
+  while (text < end && *text != ',' && !is_blank(*text)) {
+    text++;
+  }
+  return text;
+}
 
-  if (strcmp(ins->opcode, "MOVC") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->imm = get_num_from_string(tokens[2]);
+static int
+parse_error(APEX_Parser* parser, const char* message, const char* token,
+            const char* end)
+{
+  if (!parser->quiet && parser->errors < PARSE_MAX_ERRORS) {
+    int len = token_end(token, end) - token;
+    fprintf(stderr, "APEX_Error : %s:%d: %s%s%.*s%s\n", parser->filename,
+            parser->line, message, len ? " '" : "", len, token,
+            len ? "'" : "");
   }
+  parser->errors++;
+  return -1;
+}
 
-  if (strcmp(ins->opcode, "STORE") == 0) {
-    ins->rs1 = get_num_from_string(tokens[1]);
-    ins->rs2 = get_num_from_string(tokens[2]);
-    ins->imm = get_num_from_string(tokens[3]);
+/*
+ * Parses the decimal number at *text, with an optional sign, into value
+ * and moves *text past it. Returns -1 if there is none or it overflows.
+ */
+static int
+parse_number(const char** text, const char* end, int* value)
+{
+  const char* s = *text;
+  int negative = s < end && *s == '-';
+  if (s < end && (*s == '-' || *s == '+')) {
+    s++;
+  }
+  if (s == end || *s < '0' || *s > '9') {
+    return -1;
+  }
+  long long n = 0;
+  for (; s < end && *s >= '0' && *s <= '9'; ++s) {
+    n = n * 10 + (*s - '0');
+    if (n > (long long)INT_MAX + 1) {
+      return -1;
+    }
+  }
+  n = negative ? -n : n;
+  if (n > INT_MAX) {
+    return -1;
   }
+  *value = n;
+  *text = s;
+  return 0;
+}
 
-  if (strcmp(ins->opcode, "LOAD") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->imm = get_num_from_string(tokens[3]);
+/* Parses one operand of kind ('d', '1', '2' or '#') into ins */
+static int
+parse_operand(APEX_Parser* parser, APEX_Instruction* ins, char kind,
+              const char** text, const char* end)
+{
+  const char* s = *text;
+  int value;
+  if (kind == '#') {
+    if (s == end || *s != '#') {
+      return parse_error(parser, "expected literal", s, end);
+    }
+    s++;
+    if (parse_number(&s, end, &value) != 0) {
+      return parse_error(parser, "bad literal", *text, end);
+    }
+    ins->imm = value;
+  } else {
+    if (s == end || (*s != 'R' && *s != 'r')) {
+      return parse_error(parser, "expected register", s, end);
+    }
+    s++;
+    if (s == end || *s < '0' || *s > '9' ||
+        parse_number(&s, end, &value) != 0 || value >= 32) {
+      return parse_error(parser, "bad register", *text, end);
+    }
+    if (kind == 'd') {
+      ins->rd = value;
+    } else if (kind == '1') {
+      ins->rs1 = value;
+    } else {
+      ins->rs2 = value;
+    }
   }
+  *text = s;
+  return 0;
+}
 
- if (strcmp(ins->opcode, "LDR") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+/* Returns the next free code memory slot, growing code memory as needed */
+static APEX_Instruction*
+next_slot(APEX_Parser* parser)
+{
+  if (parser->size == parser->capacity) {
+    if (parser->capacity > INT_MAX / 2) {
+      return NULL;
+    }
+    int capacity = parser->capacity ? parser->capacity * 2 : 1024;
+    APEX_Instruction* grown =
+      realloc(parser->code, sizeof(*grown) * capacity);
+    if (!grown) {
+      return NULL;
+    }
+    parser->code = grown;
+    parser->capacity = capacity;
   }
- 
-  if(strcmp(ins->opcode, "HALT") == 0) {
-    
+  APEX_Instruction* ins = &parser->code[parser->size++];
+  memset(ins, 0, sizeof(*ins));
+  return ins;
+}
+
+/*
+ * Parses the line from text to end, which excludes the newline, into
+ * the next code memory slot.
+ */
+static int
+parse_line(APEX_Parser* parser, const char* text, const char* end)
+{
+  APEX_Instruction* ins = next_slot(parser);
+  parser->line++;
+  if (!ins) {
+    return parse_error(parser, "out of memory", end, end);
   }
 
-  if(strcmp(ins->opcode, "JUMP") == 0) {
-  ins->rs1 = get_num_from_string(tokens[1]);
-  ins->imm = get_num_from_string(tokens[2]);
+  const char* s = skip_blanks(text, end);
+  if (s == end) {
+    return 0;
   }
-  
-  if (strcmp(ins->opcode, "ADD") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+  const char* mnemonic = s;
+  s = token_end(s, end);
+  ins->opcode = lookup_opcode(mnemonic, s - mnemonic);
+  if (ins->opcode == OP_NONE) {
+    return parse_error(parser, "unknown opcode", mnemonic, end);
   }
-   if (strcmp(ins->opcode, "MUL") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+  ins->ins_class = opcode_info[ins->opcode].ins_class;
+
+  for (const char* kind = opcode_info[ins->opcode].operands; *kind; ++kind) {
+    s = skip_blanks(s, end);
+    if (s == end || *s != ',') {
+      return parse_error(parser, "missing operand", s, end);
+    }
+    s = skip_blanks(s + 1, end);
+    if (parse_operand(parser, ins, *kind, &s, end) != 0) {
+      return -1;
+    }
   }
 
-  if(strcmp(ins->opcode, "SUB") == 0) {
-   
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+  /* A trailing comma is allowed, as in "HALT," */
+  s = skip_blanks(s, end);
+  if (s < end && *s == ',') {
+    s = skip_blanks(s + 1, end);
+  }
+  if (s != end) {
+    return parse_error(parser, "unexpected", s, end);
+  }
+  return 0;
+}
 
- }
+/*
+ * Parses one instruction of len characters into ins, reporting errors
+ * as filename:line. Used by the assembler for its expanded lines.
+ */
+int
+APEX_parse_instruction(APEX_Instruction* ins, const char* text, int len,
+                       const char* filename, int line)
+{
+  APEX_Parser parser = { filename, ins, 0, 1, line - 1 };
+  return parse_line(&parser, text, text + len);
+}
 
-if(strcmp(ins->opcode, "AND") == 0) {
-   
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+/*
+ * Parses every complete line between text and end and returns the start
+ * of the incomplete line that follows them.
+ */
+static const char*
+parse_lines(APEX_Parser* parser, const char* text, const char* end)
+{
+  const char* newline;
+  while ((newline = memchr(text, '\n', end - text))) {
+    parse_line(parser, text, newline);
+    text = newline + 1;
+  }
+  return text;
+}
 
- }
+/* Parses all lines from text to end, the last one may lack its newline */
+static void
+parse_text(APEX_Parser* parser, const char* text, const char* end)
+{
+  const char* rest = parse_lines(parser, text, end);
+  if (rest < end) {
+    parse_line(parser, rest, end);
+  }
+}
 
-if(strcmp(ins->opcode, "OR") == 0) {
-   
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+/* Parses a stream block by block, carrying incomplete lines over */
+static int
+parse_stream(APEX_Parser* parser, int fd)
+{
+  size_t capacity = PARSE_BLOCK;
+  size_t used = 0;
+  char* buffer = malloc(capacity);
+  if (!buffer) {
+    return -1;
+  }
 
- }
+  while (1) {
+    /* A line longer than the buffer grows it */
+    if (used == capacity) {
+      char* grown = realloc(buffer, capacity * 2);
+      if (!grown) {
+        free(buffer);
+        return -1;
+      }
+      buffer = grown;
+      capacity *= 2;
+    }
+    ssize_t n = read(fd, buffer + used, capacity - used);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      fprintf(stderr, "APEX_Error : Unable to read %s\n", parser->filename);
+      free(buffer);
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    used += n;
+    const char* rest = parse_lines(parser, buffer, buffer + used);
+    used -= rest - buffer;
+    memmove(buffer, rest, used);
+  }
+  parse_text(parser, buffer, buffer + used);
+  free(buffer);
+  return 0;
+}
 
-if(strcmp(ins->opcode, "XOR") == 0) {
-   
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+static void*
+parse_chunk(void* arg)
+{
+  APEX_Parse_Chunk* chunk = arg;
+  APEX_ZONE(ZONE_PARSE_CHUNK,
+            parse_text(&chunk->parser, chunk->text, chunk->end));
+  return NULL;
+}
 
- }
+/*
+ * Joins the code memory of all chunks, in order, into parser. Returns
+ * -1 if a chunk failed, with no code memory kept.
+ */
+static int
+join_chunks(APEX_Parser* parser, APEX_Parse_Chunk* chunk, int chunks)
+{
+  long total = 0;
+  int errors = 0;
+  for (int i = 0; i < chunks; ++i) {
+    total += chunk[i].parser.size;
+    errors += chunk[i].parser.errors;
+  }
+  APEX_Instruction* code = NULL;
+  if (!errors && total <= INT_MAX) {
+    code = realloc(chunk[0].parser.code, sizeof(*code) * total);
+  }
+  if (code) {
+    chunk[0].parser.code = NULL;
+    long size = chunk[0].parser.size;
+    for (int i = 1; i < chunks; ++i) {
+      if (chunk[i].parser.size) {
+        memcpy(&code[size], chunk[i].parser.code,
+               sizeof(*code) * chunk[i].parser.size);
+        size += chunk[i].parser.size;
+      }
+    }
+    parser->code = code;
+    parser->size = parser->capacity = parser->line = total;
+  }
+  for (int i = 0; i < chunks; ++i) {
+    free(chunk[i].parser.code);
+  }
+  return code ? 0 : -1;
+}
 
-if(strcmp(ins->opcode,"BZ") == 0) {
+/*
+ * Parses size bytes at data as chunks on separate threads. Since every
+ * line is one instruction, the chunks concatenate to exactly the code
+ * memory of a serial parse. Returns -1 if any chunk failed.
+ */
+static int
+parse_parallel(APEX_Parser* parser, const char* data, size_t size, int chunks)
+{
+  APEX_Parse_Chunk* chunk = calloc(chunks, sizeof(*chunk));
+  pthread_t* workers = calloc(chunks, sizeof(*workers));
+  char* started = calloc(chunks, 1);
+  if (!chunk || !workers || !started) {
+    free(chunk);
+    free(workers);
+    free(started);
+    return -1;
+  }
 
-   ins->imm = get_num_from_string(tokens[1]);
-}  
+  /* Chunks end just after the first newline past an even split */
+  const char* text = data;
+  const char* stop = data + size;
+  for (int i = 0; i < chunks; ++i) {
+    const char* split = data + size * (i + 1) / chunks;
+    if (split < text) {
+      split = text;
+    }
+    const char* newline =
+      i < chunks - 1 ? memchr(split, '\n', stop - split) : NULL;
+    const char* end = newline ? newline + 1 : stop;
+    chunk[i].parser.filename = parser->filename;
+    chunk[i].parser.quiet = 1;
+    chunk[i].text = text;
+    chunk[i].end = end;
+    text = end;
+  }
 
-if(strcmp(ins->opcode,"BNZ") == 0) {
+  /* A chunk without a thread is parsed here */
+  for (int i = 1; i < chunks; ++i) {
+    started[i] = pthread_create(&workers[i], NULL, parse_chunk, &chunk[i]) == 0;
+  }
+  for (int i = 0; i < chunks; ++i) {
+    if (!started[i]) {
+      parse_chunk(&chunk[i]);
+    }
+  }
+  for (int i = 1; i < chunks; ++i) {
+    if (started[i]) {
+      pthread_join(workers[i], NULL);
+    }
+  }
 
-   ins->imm = get_num_from_string(tokens[1]);
+  int status = join_chunks(parser, chunk, chunks);
+  free(chunk);
+  free(workers);
+  free(started);
+  return status;
 }
 
-  
+/*
+ * Parses a regular file through a read-only mapping of it, in parallel
+ * when it is large enough.
+ */
+static int
+parse_mapped(APEX_Parser* parser, int fd, size_t size)
+{
+  char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return parse_stream(parser, fd);
+  }
+
+  long chunks = sysconf(_SC_NPROCESSORS_ONLN);
+  if (chunks > (long)(size / PARSE_CHUNK_MIN)) {
+    chunks = size / PARSE_CHUNK_MIN;
+  }
+  /* Tests set the chunk count to reach the parallel path on any host */
+  const char* forced = getenv("APEX_PARSE_CHUNKS");
+  if (forced) {
+    chunks = atol(forced);
+  }
+  if (chunks > PARSE_MAX_CHUNKS) {
+    chunks = PARSE_MAX_CHUNKS;
+  }
+  /* Errors are reported by a serial parse, with their line numbers */
+  if (chunks < 2 || parse_parallel(parser, data, size, chunks) != 0) {
+    madvise(data, size, MADV_SEQUENTIAL);
+    parse_text(parser, data, data + size);
+  }
+  munmap(data, size);
+  return 0;
 }
 
 /*
- * This function is related to parsing input file
- *
- * Note : You are not supposed to edit this function
+ * Creates code memory from the program in filename, or from standard
+ * input if filename is "-". Every malformed line is reported with its
+ * line number, and then no code memory is returned.
  */
 APEX_Instruction*
 create_code_memory(const char* filename, int* size)
@@ -150,40 +494,40 @@ create_code_memory(const char* filename, int* size)
     return NULL;
   }
 
-  FILE* fp = fopen(filename, "r");
-  if (!fp) {
+  int from_stdin = strcmp(filename, "-") == 0;
+  APEX_Parser parser = { from_stdin ? "<stdin>" : filename };
+  int fd = from_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+  if (fd < 0) {
     return NULL;
   }
 
-  char* line = NULL;
-  size_t len = 0;
-  ssize_t nread;
-  int code_memory_size = 0;
-
-  while ((nread = getline(&line, &len, fp)) != -1) {
-    code_memory_size++;
+  struct stat st;
+  int status;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    status = parse_mapped(&parser, fd, st.st_size);
+  } else {
+    status = parse_stream(&parser, fd);
   }
-  *size = code_memory_size;
-  if (!code_memory_size) {
-    fclose(fp);
-    return NULL;
+  if (!from_stdin) {
+    close(fd);
   }
 
-  APEX_Instruction* code_memory =
-    malloc(sizeof(*code_memory) * code_memory_size);
-  if (!code_memory) {
-    fclose(fp);
-    return NULL;
+  if (status == 0 && parser.errors == 0 && parser.size == 0) {
+    fprintf(stderr, "APEX_Error : %s: no instructions\n", parser.filename);
+    status = -1;
+  } else if (parser.errors > PARSE_MAX_ERRORS) {
+    fprintf(stderr, "APEX_Error : %s: %d more errors\n", parser.filename,
+            parser.errors - PARSE_MAX_ERRORS);
   }
-
-  rewind(fp);
-  int current_instruction = 0;
-  while ((nread = getline(&line, &len, fp)) != -1) {
-    create_APEX_instruction(&code_memory[current_instruction], line);
-    current_instruction++;
+  if (status != 0 || parser.errors) {
+    free(parser.code);
+    *size = 0;
+    return NULL;
   }
 
-  free(line);
-  fclose(fp);
-  return code_memory;
+  /* Give back what geometric growth over-allocated */
+  APEX_Instruction* code =
+    realloc(parser.code, sizeof(*code) * parser.size);
+  *size = parser.size;
+  return code ? code : parser.code;
 }
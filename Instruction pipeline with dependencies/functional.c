@@ -0,0 +1,510 @@
+/*
+ *  functional.c
+ *  Contains the ISA level (functional) APEX interpreter, the committed
+ *  opcode sequence profiler and the superinstructions built from it
+ *
+ *  The functional path executes one instruction per step with no latches
+ *  or hazard tracking. cpu->clock advances by one per instruction, so a
+ *  fused handler covering n instructions advances it by n.
+ *
+ *  Instructions see the architectural values of their sources. The
+ *  pipeline does not always: a LOAD or LDR in EX forwards its stale
+ *  buffer as the register numbered like its address (see
+ *  forward_load_address in cpu.c), so programs with LOAD or LDR may end
+ *  in a different state here (tests/load_forward.asm).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* A committed sequence must cover this share of the profile to be fused */
+#define FUSE_MIN_PERMILLE 5
+#define FUSE_MIN_COUNT 2
+
+/*
+ * Architectural semantics of each opcode. Every function returns the pc
+ * of the next instruction, or -1 when execution stops.
+ */
+static inline void
+set_flags(APEX_CPU* cpu, int value)
+{
+  cpu->zflag = value == 0;
+  cpu->nzflag = value != 0;
+}
+
+static inline int
+sem_MOVC(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  cpu->regs[ins->rd] = ins->imm;
+  return pc + 4;
+}
+
+static inline int
+sem_ADD(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  cpu->regs[ins->rd] = cpu->regs[ins->rs1] + cpu->regs[ins->rs2];
+  set_flags(cpu, cpu->regs[ins->rd]);
+  return pc + 4;
+}
+
+static inline int
+sem_SUB(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  cpu->regs[ins->rd] = cpu->regs[ins->rs1] - cpu->regs[ins->rs2];
+  set_flags(cpu, cpu->regs[ins->rd]);
+  return pc + 4;
+}
+
+static inline int
+sem_MUL(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  cpu->regs[ins->rd] = cpu->regs[ins->rs1] * cpu->regs[ins->rs2];
+  set_flags(cpu, cpu->regs[ins->rd]);
+  return pc + 4;
+}
+
+static inline int
+sem_AND(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  cpu->regs[ins->rd] = cpu->regs[ins->rs1] & cpu->regs[ins->rs2];
+  return pc + 4;
+}
+
+static inline int
+sem_OR(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  cpu->regs[ins->rd] = cpu->regs[ins->rs1] | cpu->regs[ins->rs2];
+  return pc + 4;
+}
+
+static inline int
+sem_XOR(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  cpu->regs[ins->rd] = cpu->regs[ins->rs1] ^ cpu->regs[ins->rs2];
+  return pc + 4;
+}
+
+static inline int
+sem_LOAD(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  cpu->regs[ins->rd] = APEX_memory_read(cpu, cpu->regs[ins->rs1] + ins->imm);
+  return pc + 4;
+}
+
+static inline int
+sem_LDR(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  cpu->regs[ins->rd] =
+    APEX_memory_read(cpu, cpu->regs[ins->rs1] + cpu->regs[ins->rs2]);
+  return pc + 4;
+}
+
+static inline int
+sem_STORE(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  APEX_memory_write(cpu, cpu->regs[ins->rs2] + ins->imm, cpu->regs[ins->rs1]);
+  return pc + 4;
+}
+
+static inline int
+sem_BZ(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  return cpu->zflag == 1 ? pc + ins->imm : pc + 4;
+}
+
+static inline int
+sem_BNZ(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  return cpu->zflag == 0 ? pc + ins->imm : pc + 4;
+}
+
+static inline int
+sem_JUMP(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  return cpu->regs[ins->rs1] + ins->imm;
+}
+
+/*
+ * Opcodes a superinstruction may contain. Only the last instruction of a
+ * sequence may transfer control; HALT never takes part.
+ */
+#define FUSE_HEAD(X) \
+  X(MOVC) X(ADD) X(SUB) X(MUL) X(AND) X(OR) X(XOR) X(LOAD) X(LDR) X(STORE)
+#define FUSE_MID(X, a) \
+  X(a, MOVC) X(a, ADD) X(a, SUB) X(a, MUL) X(a, AND) X(a, OR) X(a, XOR) \
+  X(a, LOAD) X(a, LDR) X(a, STORE)
+#define FUSE_TAIL(X, ...) \
+  X(__VA_ARGS__, MOVC) X(__VA_ARGS__, ADD) X(__VA_ARGS__, SUB) \
+  X(__VA_ARGS__, MUL) X(__VA_ARGS__, AND) X(__VA_ARGS__, OR) \
+  X(__VA_ARGS__, XOR) X(__VA_ARGS__, LOAD) X(__VA_ARGS__, LDR) \
+  X(__VA_ARGS__, STORE) X(__VA_ARGS__, BZ) X(__VA_ARGS__, BNZ) \
+  X(__VA_ARGS__, JUMP)
+
+/* Fused pair and triple handlers, one per opcode combination */
+#define DEFINE_PAIR(a, b) \
+  static int fused_##a##_##b(APEX_CPU* cpu, const APEX_Instruction* ins, int pc) \
+  { \
+    pc = sem_##a(cpu, ins, pc); \
+    return sem_##b(cpu, ins + 1, pc); \
+  }
+#define DEFINE_PAIRS(a) FUSE_TAIL(DEFINE_PAIR, a)
+FUSE_HEAD(DEFINE_PAIRS)
+
+#define DEFINE_TRIPLE(a, b, c) \
+  static int fused_##a##_##b##_##c(APEX_CPU* cpu, const APEX_Instruction* ins, int pc) \
+  { \
+    pc = sem_##a(cpu, ins, pc); \
+    pc = sem_##b(cpu, ins + 1, pc); \
+    return sem_##c(cpu, ins + 2, pc); \
+  }
+#define DEFINE_TRIPLES_AB(a, b) FUSE_TAIL(DEFINE_TRIPLE, a, b)
+#define DEFINE_TRIPLES(a) FUSE_MID(DEFINE_TRIPLES_AB, a)
+FUSE_HEAD(DEFINE_TRIPLES)
+
+#define PAIR_ENTRY(a, b) [OP_##a][OP_##b] = fused_##a##_##b,
+#define PAIR_ENTRIES(a) FUSE_TAIL(PAIR_ENTRY, a)
+static const APEX_Fused_Handler fused_pairs[NUM_OPCODES][NUM_OPCODES] = {
+  FUSE_HEAD(PAIR_ENTRIES)
+};
+
+#define TRIPLE_ENTRY(a, b, c) [OP_##a][OP_##b][OP_##c] = fused_##a##_##b##_##c,
+#define TRIPLE_ENTRIES_AB(a, b) FUSE_TAIL(TRIPLE_ENTRY, a, b)
+#define TRIPLE_ENTRIES(a) FUSE_MID(TRIPLE_ENTRIES_AB, a)
+static const APEX_Fused_Handler
+  fused_triples[NUM_OPCODES][NUM_OPCODES][NUM_OPCODES] = {
+    FUSE_HEAD(TRIPLE_ENTRIES)
+  };
+
+/* Executes the instruction at pc. Returns the next pc or -1 to stop */
+static int
+step_instruction(APEX_CPU* cpu, const APEX_Instruction* ins, int pc)
+{
+  switch (ins->opcode) {
+    case OP_MOVC:
+      return sem_MOVC(cpu, ins, pc);
+    case OP_ADD:
+      return sem_ADD(cpu, ins, pc);
+    case OP_SUB:
+      return sem_SUB(cpu, ins, pc);
+    case OP_MUL:
+      return sem_MUL(cpu, ins, pc);
+    case OP_AND:
+      return sem_AND(cpu, ins, pc);
+    case OP_OR:
+      return sem_OR(cpu, ins, pc);
+    case OP_XOR:
+      return sem_XOR(cpu, ins, pc);
+    case OP_LOAD:
+      return sem_LOAD(cpu, ins, pc);
+    case OP_LDR:
+      return sem_LDR(cpu, ins, pc);
+    case OP_STORE:
+      return sem_STORE(cpu, ins, pc);
+    case OP_BZ:
+      return sem_BZ(cpu, ins, pc);
+    case OP_BNZ:
+      return sem_BNZ(cpu, ins, pc);
+    case OP_JUMP:
+      return sem_JUMP(cpu, ins, pc);
+    case OP_HALT:
+      return -1;
+    default:
+      return pc + 4;
+  }
+}
+
+/*
+ * Executes up to max_ins instructions starting at cpu->pc, using fused
+ * handlers where installed. NOPs are executed but not counted, as the
+ * pipeline does not retire them, so it stops right after the last counted
+ * instruction. Returns the number executed; cpu->halt is set once HALT is
+ * reached or pc leaves code memory.
+ */
+long
+APEX_cpu_step(APEX_CPU* cpu, long max_ins)
+{
+  long done = 0;
+
+  while (done < max_ins && !cpu->halt) {
+    int index = get_code_index(cpu->pc);
+    if (index < 0 || index >= cpu->code_memory_size) {
+      cpu->halt = 1;
+      break;
+    }
+
+    const APEX_Instruction* ins = &cpu->code_memory[index];
+    int len = cpu->fused ? cpu->fused[index].len : 0;
+    if (len && done + len <= max_ins) {
+      cpu->pc = cpu->fused[index].handler(cpu, ins, cpu->pc);
+      cpu->last_completed = index + len - 1;
+      done += len;
+      continue;
+    }
+
+    int next = step_instruction(cpu, ins, cpu->pc);
+    if (next < 0) {
+      cpu->halt = 1;
+      break;
+    }
+    cpu->last_completed = index;
+    if (APEX_counts_as_instruction(ins->opcode)) {
+      if (cpu->seq_profile) {
+        APEX_profile_commit(cpu, cpu->pc);
+      }
+      done++;
+    }
+    cpu->pc = next;
+  }
+  return done;
+}
+
+/*
+ * Returns 1 if pc is at a HALT. APEX_cpu_step stops there without
+ * counting it, while the pipeline retires HALT; callers counting
+ * instructions add it so the modes agree.
+ */
+int
+APEX_cpu_at_halt(APEX_CPU* cpu)
+{
+  int index = get_code_index(cpu->pc);
+  return index >= 0 && index < cpu->code_memory_size &&
+         cpu->code_memory[index].opcode == OP_HALT;
+}
+
+/*
+ * Skips to the region of interest starting at instruction n: the first
+ * n - warmup instructions run on the functional path, after which the
+ * architectural state is handed to an empty pipeline. The remaining
+ * warmup instructions are simulated in detail to fill the pipeline, and
+ * clock, retired and the CPI stack restart from zero at the region of
+ * interest.
+ * Returns the number of instructions skipped functionally.
+ */
+long
+APEX_cpu_fast_forward(APEX_CPU* cpu, long n, long warmup)
+{
+  if (warmup > n) {
+    warmup = n;
+  }
+
+  long skipped = APEX_cpu_step(cpu, n - warmup);
+
+  /* A HALT reached functionally is left at pc for the pipeline to drain */
+  APEX_cpu_reset_pipeline(cpu);
+  cpu->retired = 0;
+  if (warmup) {
+    APEX_cpu_simulate(cpu, warmup);
+  }
+  cpu->clock = 0;
+  cpu->retired = 0;
+  memset(cpu->cpi, 0, sizeof(cpu->cpi));
+  return skipped;
+}
+
+/*
+ *  Functional simulation loop, counterpart of APEX_cpu_run
+ */
+int
+APEX_cpu_run_functional(APEX_CPU* cpu)
+{
+  int checkpointed = 0;
+  while (!cpu->halt && cpu->clock != cpu->cycle) {
+    if (cpu->checkpoint_path && cpu->clock == cpu->checkpoint_at) {
+      if (APEX_cpu_checkpoint(cpu, cpu->checkpoint_path) != 0) {
+        fprintf(cpu->log, "APEX_Error : Unable to write checkpoint %s\n",
+                cpu->checkpoint_path);
+      }
+      checkpointed = 1;
+    }
+    long budget = cpu->cycle > cpu->clock ? cpu->cycle - cpu->clock : 1L << 30;
+    if (cpu->checkpoint_path && cpu->checkpoint_at > cpu->clock &&
+        cpu->checkpoint_at - cpu->clock < budget) {
+      budget = cpu->checkpoint_at - cpu->clock;
+    }
+    cpu->clock += APEX_cpu_step(cpu, budget);
+  }
+  fprintf(cpu->out, "%d", cpu->code_memory_size);
+  fprintf(cpu->out, "(apex) >> Simulation Complete");
+  APEX_cpu_print_state(cpu);
+  return APEX_checkpoint_missed(cpu, checkpointed);
+}
+
+/*
+ * Records a committed instruction for the opcode sequence profile.
+ * Only sequences of consecutive code memory entries are counted since
+ * those are the only ones a superinstruction can cover.
+ */
+void
+APEX_profile_commit(APEX_CPU* cpu, int pc)
+{
+  APEX_Seq_Profile* prof = cpu->seq_profile;
+  int index = get_code_index(pc);
+
+  if (index < 0 || index >= cpu->code_memory_size) {
+    return;
+  }
+  if (prof->last[0] == index - 1) {
+    prof->pairs[index - 1]++;
+    if (prof->last[1] == index - 2) {
+      prof->triples[index - 2]++;
+    }
+  }
+  prof->last[1] = prof->last[0];
+  prof->last[0] = index;
+  prof->committed++;
+}
+
+/* Starts collecting the committed opcode sequence profile */
+int
+APEX_profile_start(APEX_CPU* cpu)
+{
+  APEX_Seq_Profile* prof = calloc(1, sizeof(*prof));
+  if (!prof) {
+    return -1;
+  }
+  prof->pairs = calloc(cpu->code_memory_size, sizeof(*prof->pairs));
+  prof->triples = calloc(cpu->code_memory_size, sizeof(*prof->triples));
+  if (!prof->pairs || !prof->triples) {
+    free(prof->pairs);
+    free(prof->triples);
+    free(prof);
+    return -1;
+  }
+  prof->last[0] = prof->last[1] = -2;
+  cpu->seq_profile = prof;
+  return 0;
+}
+
+static APEX_Fused_Handler
+lookup_fused(const APEX_Instruction* ins, int len)
+{
+  if (len == 3) {
+    return fused_triples[ins[0].opcode][ins[1].opcode][ins[2].opcode];
+  }
+  return fused_pairs[ins[0].opcode][ins[1].opcode];
+}
+
+/*
+ * Writes the hot sequences of the profile to path, one per line:
+ *   <code index> <length> <count> <mnemonics>
+ * Returns the number of sequences written or -1 on error.
+ */
+int
+APEX_profile_save(APEX_CPU* cpu, const char* path)
+{
+  APEX_Seq_Profile* prof = cpu->seq_profile;
+  unsigned long min_count = prof->committed * FUSE_MIN_PERMILLE / 1000;
+  int written = 0;
+
+  if (min_count < FUSE_MIN_COUNT) {
+    min_count = FUSE_MIN_COUNT;
+  }
+
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    return -1;
+  }
+  fprintf(fp, "APEXPROF %d %d\n", APEX_PROFILE_VERSION, cpu->code_memory_size);
+  for (int i = 0; i < cpu->code_memory_size; ++i) {
+    int len = 0;
+    unsigned long count = 0;
+    if (i + 2 < cpu->code_memory_size && prof->triples[i] >= min_count &&
+        lookup_fused(&cpu->code_memory[i], 3)) {
+      len = 3;
+      count = prof->triples[i];
+    } else if (i + 1 < cpu->code_memory_size && prof->pairs[i] >= min_count &&
+               lookup_fused(&cpu->code_memory[i], 2)) {
+      len = 2;
+      count = prof->pairs[i];
+    }
+    if (!len) {
+      continue;
+    }
+    fprintf(fp, "%d %d %lu ", i, len, count);
+    for (int k = 0; k < len; ++k) {
+      fprintf(fp, "%s%s", k ? "," : "",
+              opcode_info[cpu->code_memory[i + k].opcode].name);
+    }
+    fprintf(fp, "\n");
+    written++;
+  }
+  fclose(fp);
+  return written;
+}
+
+void
+APEX_profile_free(APEX_CPU* cpu)
+{
+  if (cpu->seq_profile) {
+    free(cpu->seq_profile->pairs);
+    free(cpu->seq_profile->triples);
+    free(cpu->seq_profile);
+    cpu->seq_profile = NULL;
+  }
+}
+
+/*
+ * Installs the superinstructions listed in a profile written by
+ * APEX_profile_save for the same program. Sequences whose opcodes no
+ * longer match code memory are skipped. Returns the number installed,
+ * or -1 if the profile is missing or belongs to a different program.
+ */
+int
+APEX_fuse_load(APEX_CPU* cpu, const char* path)
+{
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    return -1;
+  }
+
+  int version = 0;
+  int size = 0;
+  if (fscanf(fp, "APEXPROF %d %d", &version, &size) != 2 ||
+      version != APEX_PROFILE_VERSION || size != cpu->code_memory_size) {
+    fclose(fp);
+    return -1;
+  }
+
+  APEX_Fused* fused = cpu->fused;
+  if (!fused) {
+    fused = calloc(cpu->code_memory_size, sizeof(*fused));
+    if (!fused) {
+      fclose(fp);
+      return -1;
+    }
+  }
+
+  int installed = 0;
+  int index;
+  int len;
+  unsigned long count;
+  char names[64];
+  while (fscanf(fp, "%d %d %lu %63s", &index, &len, &count, names) == 4) {
+    if (index < 0 || len < 2 || len > 3 ||
+        index + len > cpu->code_memory_size) {
+      continue;
+    }
+
+    /* The recorded mnemonics must still match code memory */
+    char expected[64] = "";
+    for (int k = 0; k < len; ++k) {
+      if (k) {
+        strcat(expected, ",");
+      }
+      strcat(expected, opcode_info[cpu->code_memory[index + k].opcode].name);
+    }
+    APEX_Fused_Handler handler = lookup_fused(&cpu->code_memory[index], len);
+    if (strcmp(expected, names) != 0 || !handler) {
+      continue;
+    }
+    fused[index].handler = handler;
+    fused[index].len = len;
+    installed++;
+  }
+  fclose(fp);
+
+  cpu->fused = fused;
+  return installed;
+}
@@ -0,0 +1,210 @@
+/*
+ *  hostprof.c
+ *  Contains the host-side self-profiler: where the simulator's own time
+ *  goes, per pipeline stage and per loader, on every thread.
+ *
+ *  Built in with make HOST_PROFILE=1; otherwise APEX_ZONE compiles to
+ *  the bare statement and nothing here is used. Each thread records the
+ *  zones it times into a ring of its own, keeping the last
+ *  HOSTPROF_EVENTS of them, plus totals per zone over the whole run.
+ *  Time is read with rdtsc on x86 and clock_gettime elsewhere, and
+ *  converted at the end against CLOCK_MONOTONIC.
+ *
+ *  APEX_hostprof_write writes the rings as Chrome trace events, one
+ *  complete ("X") event per zone, for chrome://tracing or Perfetto, and
+ *  prints the totals.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+#ifdef APEX_HOST_PROFILE
+
+/* Events each thread keeps, a power of two */
+#define HOSTPROF_EVENTS (1 << 19)
+
+static const struct
+{
+  const char* name;
+  const char* category;
+} zone_info[NUM_ZONES] = {
+  [ZONE_WRITEBACK] = { "writeback", "stage" },
+  [ZONE_MEMORY] = { "memory", "stage" },
+  [ZONE_EXECUTE] = { "execute", "stage" },
+  [ZONE_DECODE] = { "decode", "stage" },
+  [ZONE_FETCH] = { "fetch", "stage" },
+  [ZONE_LOAD] = { "load", "loader" },
+  [ZONE_IMAGE] = { "APEX_image_load", "loader" },
+  [ZONE_ASSEMBLE] = { "APEX_asm_load", "loader" },
+  [ZONE_PARSE] = { "create_code_memory", "loader" },
+  [ZONE_PARSE_CHUNK] = { "parse_chunk", "loader" },
+  [ZONE_DATA_IMAGE] = { "APEX_data_image_load", "loader" },
+};
+
+typedef struct APEX_Host_Event
+{
+  unsigned long start;
+  unsigned long ticks;
+  int zone;
+} APEX_Host_Event;
+
+typedef struct APEX_Host_Ring
+{
+  struct APEX_Host_Ring* next;
+  int thread;		// Order of the thread's first event
+  unsigned long count;	// Events recorded, the ring keeps the last ones
+  unsigned long calls[NUM_ZONES];
+  unsigned long ticks[NUM_ZONES];
+  APEX_Host_Event events[HOSTPROF_EVENTS];
+} APEX_Host_Ring;
+
+static __thread APEX_Host_Ring* thread_ring;
+
+/* Every thread's ring, and the clocks when the first was made */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static APEX_Host_Ring* rings;
+static int num_rings;
+static unsigned long start_ticks;
+static struct timespec start_time;
+
+static APEX_Host_Ring*
+new_ring(void)
+{
+  APEX_Host_Ring* ring = calloc(1, sizeof(*ring));
+  if (!ring) {
+    fprintf(stderr, "APEX_Error : Out of memory for the host profile\n");
+    exit(1);
+  }
+  pthread_mutex_lock(&rings_lock);
+  if (!rings) {
+    start_ticks = APEX_hostprof_clock();
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+  }
+  ring->thread = num_rings++;
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+  return ring;
+}
+
+/* Records that zone ran on this thread from start until now */
+void
+APEX_hostprof_event(APEX_Zone zone, unsigned long start)
+{
+  unsigned long end = APEX_hostprof_clock();
+  APEX_Host_Ring* ring = thread_ring;
+  if (!ring) {
+    ring = thread_ring = new_ring();
+  }
+  APEX_Host_Event* event = &ring->events[ring->count++ & (HOSTPROF_EVENTS - 1)];
+  event->start = start;
+  event->ticks = end - start;
+  event->zone = zone;
+  ring->calls[zone]++;
+  ring->ticks[zone] += end - start;
+}
+
+/*
+ * Writes every thread's recorded zones to path as Chrome trace events and
+ * prints the totals per zone to log. Returns -1 if path cannot be
+ * written.
+ */
+int
+APEX_hostprof_write(const char* path, FILE* log)
+{
+  pthread_mutex_lock(&rings_lock);
+  if (!rings) {
+    pthread_mutex_unlock(&rings_lock);
+    fprintf(log, "APEX_CPU : Host profile is empty\n");
+    return 0;
+  }
+
+  /* Ticks per microsecond since the first ring */
+  struct timespec now;
+  unsigned long ticks = APEX_hostprof_clock() - start_ticks;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double us = (now.tv_sec - start_time.tv_sec) * 1e6 +
+              (now.tv_nsec - start_time.tv_nsec) / 1e3;
+  double rate = us > 0 ? ticks / us : 1;
+
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    pthread_mutex_unlock(&rings_lock);
+    return -1;
+  }
+  int pid = getpid();
+  fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  const char* separator = "";
+  unsigned long calls[NUM_ZONES] = { 0 };
+  unsigned long zone_ticks[NUM_ZONES] = { 0 };
+  long dropped = 0;
+  for (APEX_Host_Ring* ring = rings; ring; ring = ring->next) {
+    fprintf(fp,
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"thread %d\"}}",
+            separator, pid, ring->thread, ring->thread);
+    separator = ",\n";
+    unsigned long first = ring->count > HOSTPROF_EVENTS
+                            ? ring->count - HOSTPROF_EVENTS
+                            : 0;
+    dropped += first;
+    for (unsigned long i = first; i < ring->count; ++i) {
+      const APEX_Host_Event* event = &ring->events[i & (HOSTPROF_EVENTS - 1)];
+      fprintf(fp,
+              ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+              "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+              zone_info[event->zone].name, zone_info[event->zone].category,
+              (event->start - start_ticks) / rate, event->ticks / rate, pid,
+              ring->thread);
+    }
+    for (int zone = 0; zone < NUM_ZONES; ++zone) {
+      calls[zone] += ring->calls[zone];
+      zone_ticks[zone] += ring->ticks[zone];
+    }
+  }
+  fprintf(fp, "\n]}\n");
+  pthread_mutex_unlock(&rings_lock);
+  int status = fclose(fp) == 0 ? 0 : -1;
+
+  fprintf(log, "APEX_CPU : Host profile of %d threads in %s", num_rings, path);
+  if (dropped) {
+    fprintf(log, ", oldest %ld events overwritten", dropped);
+  }
+  fprintf(log, "\n");
+
+  /* Reading the clock twice is in every call, and bounds what it can show */
+  unsigned long overhead = ~0ul;
+  for (int i = 0; i < 1000; ++i) {
+    unsigned long first = APEX_hostprof_clock();
+    unsigned long second = APEX_hostprof_clock();
+    if (second - first < overhead) {
+      overhead = second - first;
+    }
+  }
+  fprintf(log, "APEX_CPU :   timer overhead %.1f ns per call\n",
+          overhead / rate * 1e3);
+  for (int zone = 0; zone < NUM_ZONES; ++zone) {
+    if (calls[zone]) {
+      fprintf(log, "APEX_CPU :   %-20s %10.3f ms %12lu calls %8.1f ns/call\n",
+              zone_info[zone].name, zone_ticks[zone] / rate / 1e3,
+              calls[zone], zone_ticks[zone] / rate * 1e3 / calls[zone]);
+    }
+  }
+  return status;
+}
+
+#else
+
+int
+APEX_hostprof_write(const char* path, FILE* log)
+{
+  fprintf(log, "APEX_Error : Built without host profiling, "
+               "rebuild with make HOST_PROFILE=1\n");
+  return -1;
+}
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ *  image.c
+ *  Contains the binary program image: a program converted once from its
+ *  .asm text and later mapped straight into code memory, without parsing.
+ *
+ *  File layout (host byte order):
+ *    APEX_Image_Header
+ *    code memory   (code_memory_size predecoded APEX_Instruction records)
+ *    page numbers  (num_pages unsigned ints, ascending)
+ *    pages         (num_pages pages of APEX_PAGE_WORDS words)
+ *  Only the allocated pages of initial data memory are stored, as in a
+ *  dump (see dump.c), so an image grows with the data a program sets and
+ *  not with its highest address.
+ *  As for checkpoints, the header records the instruction size so an
+ *  image is only loaded by a build with the same APEX_Instruction layout.
+ *
+ *  Data files for the converter hold "<address>=<value>" words, any
+ *  number per line; words not given are zero. '#' starts a comment.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+#define IMAGE_MAGIC "APEXBIN"
+
+typedef struct APEX_Image_Header
+{
+  char magic[8];
+  int version;
+  int instruction_size;	// sizeof(APEX_Instruction)
+  int code_memory_size;	// Instructions
+  int num_pages;	// Pages of initial data memory, 0 if none
+} APEX_Image_Header;
+
+static void
+fill_header(APEX_Image_Header* header, int code_memory_size, int num_pages)
+{
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  header->version = APEX_IMAGE_VERSION;
+  header->instruction_size = sizeof(APEX_Instruction);
+  header->code_memory_size = code_memory_size;
+  header->num_pages = num_pages;
+}
+
+/*
+ * Code memory is used as found in the file, so every field the pipeline
+ * indexes with is checked once here. Returns the index of the first bad
+ * instruction, or -1 if all of them are valid.
+ */
+int
+APEX_check_code(const APEX_Instruction* code, int size)
+{
+  for (int i = 0; i < size; ++i) {
+    const APEX_Instruction* ins = &code[i];
+    if (ins->opcode >= NUM_OPCODES ||
+        ins->ins_class != opcode_info[ins->opcode].ins_class ||
+        ins->rd >= 32 || ins->rs1 >= 32 || ins->rs2 >= 32) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Maps the image at path as the code memory of cpu and copies its data
+ * pages into data memory. Returns 1 if path is not an image at all, so
+ * the caller can parse it as text, and -1 if it is a bad one. Standard
+ * input ("-") is always parsed.
+ */
+int
+APEX_image_load(APEX_CPU* cpu, const char* path)
+{
+  if (strcmp(path, "-") == 0) {
+    return 1;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  APEX_Image_Header header;
+  struct stat st;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0) {
+    close(fd);
+    return 1;
+  }
+
+  APEX_Image_Header expected;
+  fill_header(&expected, header.code_memory_size, header.num_pages);
+  size_t code_bytes = sizeof(APEX_Instruction) * (size_t)header.code_memory_size;
+  size_t numbers_bytes = sizeof(unsigned int) * (size_t)header.num_pages;
+  size_t size = sizeof(header) + code_bytes + numbers_bytes +
+                sizeof(int) * APEX_PAGE_WORDS * (size_t)header.num_pages;
+  if (memcmp(&header, &expected, sizeof(header)) != 0 ||
+      header.code_memory_size <= 0 || header.num_pages < 0 ||
+      (unsigned int)header.num_pages > APEX_MEMORY_PAGES ||
+      fstat(fd, &st) != 0 || (size_t)st.st_size < size) {
+    fprintf(stderr, "APEX_Error : %s is not a compatible image\n", path);
+    close(fd);
+    return -1;
+  }
+
+  void* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "APEX_Error : Unable to map image %s\n", path);
+    return -1;
+  }
+
+  const APEX_Instruction* code =
+    (const APEX_Instruction*)((char*)base + sizeof(header));
+  int bad = APEX_check_code(code, header.code_memory_size);
+  if (bad >= 0) {
+    fprintf(stderr, "APEX_Error : %s: bad instruction %d\n", path, bad);
+    munmap(base, size);
+    return -1;
+  }
+  const unsigned int* numbers =
+    (const unsigned int*)((const char*)code + code_bytes);
+  const int* pages = (const int*)((const char*)numbers + numbers_bytes);
+  for (int i = 0; i < header.num_pages; ++i) {
+    if (numbers[i] >= APEX_MEMORY_PAGES) {
+      fprintf(stderr, "APEX_Error : %s: bad data page %u\n", path,
+              numbers[i]);
+      munmap(base, size);
+      return -1;
+    }
+  }
+
+  cpu->image = base;
+  cpu->image_size = size;
+  cpu->code_memory = (APEX_Instruction*)code;
+  cpu->code_memory_size = header.code_memory_size;
+  for (int i = 0; i < header.num_pages; ++i) {
+    memcpy(APEX_memory_page(&cpu->memory, numbers[i], 1),
+           &pages[(size_t)i * APEX_PAGE_WORDS], sizeof(int) * APEX_PAGE_WORDS);
+  }
+  return 0;
+}
+
+/* Releases code memory, whether it was parsed or mapped from an image */
+void
+APEX_image_release(APEX_CPU* cpu)
+{
+  if (cpu->image) {
+    munmap(cpu->image, cpu->image_size);
+  } else {
+    free(cpu->code_memory);
+  }
+  cpu->image = NULL;
+  cpu->code_memory = NULL;
+}
+
+/* Reads the data file into memory, returns -1 on error */
+static int
+read_data(const char* path, APEX_Memory* memory)
+{
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open data file %s\n", path);
+    return -1;
+  }
+
+  char* line = NULL;
+  size_t len = 0;
+  int line_number = 0;
+  int error = 0;
+  while (!error && getline(&line, &len, fp) != -1) {
+    line_number++;
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    char* cursor = line;
+    int address;
+    int value;
+    int used;
+    while (sscanf(cursor, " %d=%d%n", &address, &value, &used) == 2) {
+      if (address < 0 || (unsigned int)address >= APEX_MEMORY_MAX_WORDS) {
+        error = 1;
+        break;
+      }
+      *APEX_memory_word(memory, address, 1) = value;
+      cursor += used;
+    }
+    char rest[2];
+    if (sscanf(cursor, " %1s", rest) == 1) {
+      error = 1;
+    }
+  }
+  free(line);
+  fclose(fp);
+  if (error) {
+    fprintf(stderr, "APEX_Error : %s:%d: bad data word\n", path, line_number);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Writes code memory and the allocated pages of data as an image at
+ * path. The image goes to a temporary file first and is renamed into
+ * place, so concurrent writers of the same path never mix their files.
+ */
+int
+APEX_image_write(const char* path, const APEX_Instruction* code, int size,
+                 const APEX_Memory* data)
+{
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp_path);
+  FILE* fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!fp) {
+    if (fd >= 0) {
+      close(fd);
+      remove(tmp_path);
+    }
+    return -1;
+  }
+
+  APEX_Image_Header header;
+  fill_header(&header, size, data->pages);
+  int status = 0;
+  if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+      fwrite(code, sizeof(*code), size, fp) != (size_t)size) {
+    status = -1;
+  }
+  unsigned int page = 0;
+  for (int* words; (words = APEX_memory_next(data, &page)); ++page) {
+    if (fwrite(&page, sizeof(page), 1, fp) != 1) {
+      status = -1;
+    }
+  }
+  page = 0;
+  for (int* words; (words = APEX_memory_next(data, &page)); ++page) {
+    if (fwrite(words, sizeof(int), APEX_PAGE_WORDS, fp) != APEX_PAGE_WORDS) {
+      status = -1;
+    }
+  }
+  /* mkstemp creates the file private to its owner */
+  fchmod(fd, 0644);
+  if (fclose(fp) != 0) {
+    status = -1;
+  }
+  if (!status && rename(tmp_path, path) != 0) {
+    status = -1;
+  }
+  if (status) {
+    remove(tmp_path);
+  }
+  return status;
+}
+
+/*
+ * Converts the program at input, and the optional data file, into an
+ * image at output. Without a data file the image keeps the initial data
+ * memory of the program.
+ */
+int
+APEX_image_convert(const char* input, const char* output,
+                   const char* data_path)
+{
+  APEX_CPU* cpu = APEX_cpu_init(input);
+  if (!cpu) {
+    fprintf(stderr, "APEX_Error : Unable to load %s\n", input);
+    return -1;
+  }
+
+  if (data_path) {
+    APEX_memory_free(&cpu->memory);
+    if (read_data(data_path, &cpu->memory) != 0) {
+      APEX_cpu_stop(cpu);
+      return -1;
+    }
+  }
+
+  int status = APEX_image_write(output, cpu->code_memory,
+                                cpu->code_memory_size, &cpu->memory);
+  if (status) {
+    fprintf(stderr, "APEX_Error : Unable to write image %s\n", output);
+  } else {
+    fprintf(stderr, "APEX_CPU : Wrote %d instructions and %d data pages to "
+                    "%s\n", cpu->code_memory_size, cpu->memory.pages, output);
+  }
+  APEX_cpu_stop(cpu);
+  return status;
+}
@@ -0,0 +1,203 @@
+/*
+ *  interval.c
+ *  Contains parallel interval simulation: a functional pre-pass splits the
+ *  run into instruction intervals and captures the architectural state at
+ *  every boundary, then each interval is simulated in the pipeline on a
+ *  worker thread and the per-interval results are combined in one report.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+typedef struct APEX_Interval
+{
+  APEX_CPU* cpu;	// State skip instructions before the warmup
+  long skip;		// Instructions executed functionally before warmup
+  long warmup;		// Instructions simulated before measuring
+  long length;		// Instructions measured
+  long instructions;
+  long cycles;
+  long decode_stalls;
+  long execute_busy;
+  long flushes;
+} APEX_Interval;
+
+static void
+simulate_interval(void* context, long index)
+{
+  APEX_Interval* iv = (APEX_Interval*)context + index;
+  APEX_CPU* cpu = iv->cpu;
+
+  APEX_cpu_step(cpu, iv->skip);
+  APEX_cpu_reset_pipeline(cpu);
+  cpu->clock = 0;
+  cpu->retired = 0;
+  cpu->decode_stalls = 0;
+  cpu->execute_busy = 0;
+  cpu->flushes = 0;
+  APEX_cpu_simulate(cpu, iv->warmup);
+
+  iv->instructions = -cpu->retired;
+  iv->cycles = -(long)cpu->clock;
+  iv->decode_stalls = -cpu->decode_stalls;
+  iv->execute_busy = -cpu->execute_busy;
+  iv->flushes = -cpu->flushes;
+
+  APEX_cpu_simulate(cpu, iv->length == LONG_MAX ? LONG_MAX
+                                                : iv->warmup + iv->length);
+  iv->instructions += cpu->retired;
+  iv->cycles += cpu->clock;
+  iv->decode_stalls += cpu->decode_stalls;
+  iv->execute_busy += cpu->execute_busy;
+  iv->flushes += cpu->flushes;
+}
+
+/*
+ * Functional pre-pass: a single run to the end that snapshots the state
+ * every stride instructions, keeping at most 4 snapshots per interval by
+ * dropping every other one and doubling the stride when they run out.
+ * Once the run's length is known, every interval starts from the last
+ * snapshot before its warmup and steps the rest of the way on its
+ * worker. Returns the number of intervals or -1 on error.
+ */
+static int
+split_intervals(APEX_CPU* cpu, APEX_Interval* intervals, int count,
+                long warmup)
+{
+  long limit = cpu->cycle > 0 ? cpu->cycle : LONG_MAX;
+  int capacity = 4 * count;
+  APEX_CPU** snapshots = calloc(capacity, sizeof(*snapshots));
+  APEX_CPU* walker = APEX_cpu_clone(cpu);
+  int used = 0;
+  int status = -1;
+  if (!snapshots || !walker) {
+    goto done;
+  }
+
+  long stride = 1;
+  long total = 0;
+  while (1) {
+    if (used == capacity) {
+      for (int i = 1; i < capacity; i += 2) {
+        APEX_cpu_free_clone(snapshots[i]);
+      }
+      for (int i = 1; i < capacity / 2; ++i) {
+        snapshots[i] = snapshots[2 * i];
+      }
+      used = capacity / 2;
+      stride *= 2;
+    }
+    snapshots[used] = APEX_cpu_clone(walker);
+    if (!snapshots[used++]) {
+      goto done;
+    }
+    long chunk = limit - total < stride ? limit - total : stride;
+    long executed = APEX_cpu_step(walker, chunk);
+    total += executed;
+    if (executed < chunk || total == limit) {
+      break;
+    }
+  }
+
+  if (count > total) {
+    count = total > 0 ? total : 1;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    long start = total * i / count;
+    long end = total * (i + 1) / count;
+    long snapshot = start > warmup ? start - warmup : 0;
+    long nearest = snapshot / stride < used ? snapshot / stride : used - 1;
+
+    APEX_Interval* iv = &intervals[i];
+    iv->cpu = APEX_cpu_clone(snapshots[nearest]);
+    if (!iv->cpu) {
+      goto done;
+    }
+    iv->skip = snapshot - nearest * stride;
+    iv->warmup = start - snapshot;
+    iv->length = end - start;
+  }
+
+  /* The last interval runs until the program finishes */
+  if (walker->halt) {
+    intervals[count - 1].length = LONG_MAX;
+  }
+  status = count;
+
+done:
+  for (int i = 0; i < used; ++i) {
+    APEX_cpu_free_clone(snapshots[i]);
+  }
+  free(snapshots);
+  APEX_cpu_free_clone(walker);
+  return status;
+}
+
+static void
+print_intervals(FILE* out, APEX_Interval* intervals, int count)
+{
+  APEX_Interval total = { 0 };
+
+  fprintf(out, "\n =============== INTERVAL SIMULATION ===============");
+  fprintf(out, "\n  Interval | Instructions |     Cycles |    CPI | Decode stalls "
+               "|    EX busy |  Flushes");
+  for (int i = 0; i < count; ++i) {
+    APEX_Interval* iv = &intervals[i];
+    fprintf(out, "\n  %8d | %12ld | %10ld | %6.3f | %13ld | %10ld | %8ld", i,
+            iv->instructions, iv->cycles,
+            iv->instructions ? (double)iv->cycles / iv->instructions : 0.0,
+            iv->decode_stalls, iv->execute_busy, iv->flushes);
+    total.instructions += iv->instructions;
+    total.cycles += iv->cycles;
+    total.decode_stalls += iv->decode_stalls;
+    total.execute_busy += iv->execute_busy;
+    total.flushes += iv->flushes;
+  }
+  fprintf(out, "\n     Total | %12ld | %10ld | %6.3f | %13ld | %10ld | %8ld\n",
+          total.instructions, total.cycles,
+          total.instructions ? (double)total.cycles / total.instructions : 0.0,
+          total.decode_stalls, total.execute_busy, total.flushes);
+}
+
+/*
+ *  Parallel simulation loop, counterpart of APEX_cpu_run. The run is split
+ *  into intervals of equal instruction count that are simulated in the
+ *  pipeline on threads workers, each starting warmup instructions early
+ *  to fill the pipeline. cpu->cycle bounds the instructions executed.
+ *  Boundaries and measured counts both leave NOPs out (see
+ *  APEX_counts_as_instruction), so intervals meet without overlapping.
+ */
+int
+APEX_cpu_run_intervals(APEX_CPU* cpu, int intervals, int threads, long warmup)
+{
+  APEX_Interval* pool = calloc(intervals, sizeof(*pool));
+  if (!pool) {
+    return -1;
+  }
+  int count = split_intervals(cpu, pool, intervals, warmup);
+  if (count < 0) {
+    fprintf(stderr, "APEX_Error : Unable to capture interval states\n");
+    for (int i = 0; i < intervals; ++i) {
+      APEX_cpu_free_clone(pool[i].cpu);
+    }
+    free(pool);
+    return -1;
+  }
+
+  APEX_run_tasks(simulate_interval, pool, count, threads);
+
+  fprintf(cpu->out, "%d", cpu->code_memory_size);
+  fprintf(cpu->out, "(apex) >> Simulation Complete");
+  APEX_cpu_print_state(pool[count - 1].cpu);
+  print_intervals(cpu->out, pool, count);
+
+  for (int i = 0; i < count; ++i) {
+    APEX_cpu_free_clone(pool[i].cpu);
+  }
+  free(pool);
+  return 0;
+}
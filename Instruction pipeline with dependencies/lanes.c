@@ -0,0 +1,427 @@
+/*
+ *  lanes.c
+ *  Contains lockstep simulation of one program over many initial data
+ *  memories. Lane 0 runs in the pipeline and provides the timing; every
+ *  instruction it commits is applied to all lanes at once from
+ *  structure-of-arrays register, flag and memory state, so the ALU
+ *  operations become vector loops. A lane whose branch, jump or memory
+ *  address departs from lane 0 diverges and is re-simulated on its own.
+ *
+ *  Lane files hold one lane per line as "<address>=<value>" words written
+ *  over a zeroed data memory. Blank lines and '#' comments are skipped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#define LANE_REGISTERS 32
+#define LANE_MEMORY 4096
+
+typedef struct APEX_Lanes
+{
+  int count;
+  int* regs[LANE_REGISTERS];	// regs[r][lane]
+  int* zflag;			// zflag[lane]
+  int* memory;			// memory[address * count + lane]
+  int* initial_memory;		// Same layout, for scalar re-simulation
+  unsigned int words;		// Data address space, at most LANE_MEMORY
+  char* diverged;
+  int num_diverged;
+} APEX_Lanes;
+
+/* Per-lane results */
+typedef struct APEX_Lane_Result
+{
+  int clock;
+  long retired;
+  int zflag;
+  int regs[16];
+} APEX_Lane_Result;
+
+static void
+diverge(APEX_Lanes* lanes, int lane)
+{
+  if (!lanes->diverged[lane]) {
+    lanes->diverged[lane] = 1;
+    lanes->num_diverged++;
+  }
+}
+
+/*
+ * Lane-wide operations. Every lane is computed, diverged ones included,
+ * so the loops have no per-lane control flow and vectorize.
+ */
+#define DEFINE_LANE_OP(name, op) \
+  static void \
+  name(int* d, const int* a, const int* b, int* z, int n) \
+  { \
+    for (int l = 0; l < n; ++l) { \
+      d[l] = a[l] op b[l]; \
+    } \
+    if (z) { \
+      for (int l = 0; l < n; ++l) { \
+        z[l] = d[l] == 0; \
+      } \
+    } \
+  }
+
+DEFINE_LANE_OP(lane_add, +)
+DEFINE_LANE_OP(lane_sub, -)
+DEFINE_LANE_OP(lane_mul, *)
+DEFINE_LANE_OP(lane_and, &)
+DEFINE_LANE_OP(lane_or, |)
+DEFINE_LANE_OP(lane_xor, ^)
+
+/*
+ * LOAD, LDR and STORE diverge the lanes whose address departs from lane
+ * 0's: the pipeline's forwarding quirks around LOAD depend on the address
+ * as well as the data, so only lanes at lane 0's address share its values.
+ */
+static void
+lane_load(APEX_Lanes* lanes, int* d, const int* base, const int* offset,
+          int imm)
+{
+  int n = lanes->count;
+  unsigned int lane0 =
+    APEX_memory_wrap(lanes->words, base[0] + (offset ? offset[0] : imm));
+  for (int l = 0; l < n; ++l) {
+    unsigned int address =
+      APEX_memory_wrap(lanes->words, base[l] + (offset ? offset[l] : imm));
+    if (address != lane0) {
+      diverge(lanes, l);
+    }
+    if (!lanes->diverged[l]) {
+      d[l] = lanes->memory[address * n + l];
+    }
+  }
+}
+
+static void
+lane_store(APEX_Lanes* lanes, const int* value, const int* base, int imm)
+{
+  int n = lanes->count;
+  unsigned int lane0 = APEX_memory_wrap(lanes->words, base[0] + imm);
+  for (int l = 0; l < n; ++l) {
+    unsigned int address = APEX_memory_wrap(lanes->words, base[l] + imm);
+    if (address != lane0) {
+      diverge(lanes, l);
+    }
+    if (!lanes->diverged[l]) {
+      lanes->memory[address * n + l] = value[l];
+    }
+  }
+}
+
+/*
+ * Applies the instruction lane 0 committed at pc to every lane. Branch
+ * outcomes and jump targets are compared with the architectural state
+ * of the pipeline, which is lane 0.
+ */
+void
+APEX_lanes_commit(APEX_CPU* cpu, int pc)
+{
+  APEX_Lanes* lanes = cpu->lanes;
+  int index = get_code_index(pc);
+
+  if (index < 0 || index >= cpu->code_memory_size) {
+    return;
+  }
+  const APEX_Instruction* ins = &cpu->code_memory[index];
+  int n = lanes->count;
+  int* d = lanes->regs[ins->rd];
+  int* a = lanes->regs[ins->rs1];
+  int* b = lanes->regs[ins->rs2];
+
+  switch (ins->opcode) {
+    case OP_MOVC:
+      for (int l = 0; l < n; ++l) {
+        d[l] = ins->imm;
+      }
+      break;
+    case OP_ADD:
+      lane_add(d, a, b, lanes->zflag, n);
+      break;
+    case OP_SUB:
+      lane_sub(d, a, b, lanes->zflag, n);
+      break;
+    case OP_MUL:
+      lane_mul(d, a, b, lanes->zflag, n);
+      break;
+    case OP_AND:
+      lane_and(d, a, b, NULL, n);
+      break;
+    case OP_OR:
+      lane_or(d, a, b, NULL, n);
+      break;
+    case OP_XOR:
+      lane_xor(d, a, b, NULL, n);
+      break;
+    case OP_LOAD:
+      lane_load(lanes, d, a, NULL, ins->imm);
+      break;
+    case OP_LDR:
+      lane_load(lanes, d, a, b, 0);
+      break;
+    case OP_STORE:
+      lane_store(lanes, lanes->regs[ins->rs1], b, ins->imm);
+      break;
+    case OP_BZ:
+    case OP_BNZ:
+      for (int l = 0; l < n; ++l) {
+        if (lanes->zflag[l] != cpu->zflag) {
+          diverge(lanes, l);
+        }
+      }
+      break;
+    case OP_JUMP:
+      for (int l = 0; l < n; ++l) {
+        if (a[l] != cpu->regs[ins->rs1]) {
+          diverge(lanes, l);
+        }
+      }
+      break;
+    default:
+      break;
+  }
+
+  /*
+   * Lanes follow the instruction semantics. Where the pipeline's own
+   * result departs from them (forwarding quirks), lane 0 takes the
+   * committed values and the other lanes can no longer be trusted.
+   */
+  const APEX_Opcode_Info* info = &opcode_info[ins->opcode];
+  int writes = info->ins_class == CLASS_ALU || info->ins_class == CLASS_MUL ||
+               info->ins_class == CLASS_LOAD;
+  if ((writes && d[0] != cpu->regs[ins->rd]) ||
+      (info->sets_flags && lanes->zflag[0] != cpu->zflag)) {
+    for (int l = 1; l < n; ++l) {
+      diverge(lanes, l);
+    }
+    if (writes) {
+      d[0] = cpu->regs[ins->rd];
+    }
+    lanes->zflag[0] = cpu->zflag;
+  }
+}
+
+static void
+free_lanes(APEX_Lanes* lanes)
+{
+  if (!lanes) {
+    return;
+  }
+  for (int r = 0; r < LANE_REGISTERS; ++r) {
+    free(lanes->regs[r]);
+  }
+  free(lanes->zflag);
+  free(lanes->memory);
+  free(lanes->initial_memory);
+  free(lanes->diverged);
+  free(lanes);
+}
+
+static APEX_Lanes*
+alloc_lanes(int count)
+{
+  APEX_Lanes* lanes = calloc(1, sizeof(*lanes));
+  if (!lanes) {
+    return NULL;
+  }
+  lanes->count = count;
+  int ok = 1;
+  for (int r = 0; r < LANE_REGISTERS; ++r) {
+    lanes->regs[r] = calloc(count, sizeof(int));
+    ok = ok && lanes->regs[r];
+  }
+  lanes->zflag = calloc(count, sizeof(int));
+  lanes->memory = calloc((size_t)LANE_MEMORY * count, sizeof(int));
+  lanes->initial_memory = malloc(sizeof(int) * LANE_MEMORY * count);
+  lanes->diverged = calloc(count, 1);
+  if (!ok || !lanes->zflag || !lanes->memory || !lanes->initial_memory ||
+      !lanes->diverged) {
+    free_lanes(lanes);
+    return NULL;
+  }
+  return lanes;
+}
+
+/* Reads the lane file, returns NULL on error */
+static APEX_Lanes*
+read_lanes(const char* path)
+{
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open lane file %s\n", path);
+    return NULL;
+  }
+
+  /* First pass counts the lanes, second fills their memories */
+  char* line = NULL;
+  size_t len = 0;
+  int count = 0;
+  while (getline(&line, &len, fp) != -1) {
+    char first[2];
+    if (sscanf(line, " %1s", first) == 1 && first[0] != '#') {
+      count++;
+    }
+  }
+
+  APEX_Lanes* lanes = count > 0 ? alloc_lanes(count) : NULL;
+  if (!lanes) {
+    fprintf(stderr, "APEX_Error : No lanes in %s\n", path);
+    free(line);
+    fclose(fp);
+    return NULL;
+  }
+
+  rewind(fp);
+  int lane = 0;
+  int line_number = 0;
+  while (getline(&line, &len, fp) != -1) {
+    char first[2];
+    line_number++;
+    if (sscanf(line, " %1s", first) != 1 || first[0] == '#') {
+      continue;
+    }
+    char* cursor = line;
+    int address;
+    int value;
+    int used;
+    while (sscanf(cursor, " %d=%d%n", &address, &value, &used) == 2) {
+      if (address < 0 || address >= LANE_MEMORY) {
+        fprintf(stderr, "APEX_Error : %s:%d: address %d out of range\n", path,
+                line_number, address);
+        free_lanes(lanes);
+        lanes = NULL;
+        break;
+      }
+      lanes->memory[address * count + lane] = value;
+      cursor += used;
+    }
+    if (!lanes) {
+      break;
+    }
+    lane++;
+  }
+  free(line);
+  fclose(fp);
+  if (lanes) {
+    memcpy(lanes->initial_memory, lanes->memory,
+           sizeof(int) * LANE_MEMORY * count);
+  }
+  return lanes;
+}
+
+static void
+load_lane_memory(APEX_CPU* cpu, APEX_Lanes* lanes, int lane)
+{
+  for (unsigned int address = 0; address < lanes->words; ++address) {
+    APEX_memory_write(cpu, address,
+                      lanes->initial_memory[address * lanes->count + lane]);
+  }
+}
+
+static void
+run_pipeline(APEX_CPU* cpu)
+{
+  while (!APEX_cpu_finished(cpu) && cpu->clock != cpu->cycle) {
+    APEX_cpu_advance(cpu, cpu->cycle);
+  }
+}
+
+static void
+record_result(APEX_Lane_Result* result, APEX_CPU* cpu)
+{
+  result->clock = cpu->clock;
+  result->retired = cpu->retired;
+  result->zflag = cpu->zflag;
+  memcpy(result->regs, cpu->regs, sizeof(result->regs));
+}
+
+/*
+ *  Lockstep simulation loop, counterpart of APEX_cpu_run. cpu must be
+ *  freshly initialized; lane 0 of lane_file runs in it. Converged lanes
+ *  share the cycle count of lane 0, which holds as long as the pipeline
+ *  timing depends on the data only through control flow.
+ */
+int
+APEX_cpu_run_lanes(APEX_CPU* cpu, const char* lane_file)
+{
+  if (cpu->config.mem_words > LANE_MEMORY) {
+    fprintf(stderr, "APEX_Error : Lanes need a mem_size of at most %d "
+                    "bytes\n", (int)sizeof(int) * LANE_MEMORY);
+    return -1;
+  }
+  APEX_Lanes* lanes = read_lanes(lane_file);
+  if (!lanes) {
+    return -1;
+  }
+  lanes->words = cpu->config.mem_words;
+  int n = lanes->count;
+  APEX_Lane_Result* results = calloc(n, sizeof(*results));
+  APEX_CPU* initial = APEX_cpu_clone(cpu);
+  if (!results || !initial) {
+    free(results);
+    APEX_cpu_free_clone(initial);
+    free_lanes(lanes);
+    return -1;
+  }
+
+  load_lane_memory(cpu, lanes, 0);
+  cpu->lanes = lanes;
+  run_pipeline(cpu);
+  cpu->lanes = NULL;
+
+  for (int l = 0; l < n; ++l) {
+    APEX_Lane_Result* result = &results[l];
+    if (l == 0) {
+      record_result(result, cpu);
+      continue;
+    }
+    if (!lanes->diverged[l]) {
+      result->clock = cpu->clock;
+      result->retired = cpu->retired;
+      result->zflag = lanes->zflag[l];
+      for (int r = 0; r < 16; ++r) {
+        result->regs[r] = lanes->regs[r][l];
+      }
+      continue;
+    }
+
+    /* Scalar fallback from the initial state */
+    APEX_CPU* scalar = APEX_cpu_clone(initial);
+    if (!scalar) {
+      result->clock = -1;
+      continue;
+    }
+    load_lane_memory(scalar, lanes, l);
+    run_pipeline(scalar);
+    record_result(result, scalar);
+    APEX_cpu_free_clone(scalar);
+  }
+
+  fprintf(cpu->out, "%d", cpu->code_memory_size);
+  fprintf(cpu->out, "(apex) >> Simulation Complete");
+  fprintf(cpu->out, "\n =============== LOCKSTEP LANES ===============");
+  fprintf(cpu->out, "\n  Lanes %d, lockstep %d, scalar %d", n,
+          n - lanes->num_diverged, lanes->num_diverged);
+  fprintf(cpu->out, "\n  Lane | Mode     |     Cycles |    Retired | Z | "
+                    "REGS[0..15]");
+  for (int l = 0; l < n; ++l) {
+    APEX_Lane_Result* result = &results[l];
+    fprintf(cpu->out, "\n  %4d | %-8s | %10d | %10ld | %d |", l,
+            lanes->diverged[l] ? "scalar" : "lockstep", result->clock,
+            result->retired, result->zflag);
+    for (int r = 0; r < 16; ++r) {
+      fprintf(cpu->out, " %d", result->regs[r]);
+    }
+  }
+  fprintf(cpu->out, "\n");
+
+  free(results);
+  APEX_cpu_free_clone(initial);
+  free_lanes(lanes);
+  return 0;
+}
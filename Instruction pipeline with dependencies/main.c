@@ -7,27 +7,350 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "cpu.h"
 
 int
 main(int argc, char const* argv[])
 {
-  if (argc != 4) {
-    fprintf(stderr, "APEX_Help : Usage %s <input_file>\n", argv[0]);
+  if (argc < 4) {
+    fprintf(stderr,
+            "APEX_Help : Usage %s <input_file> "
+            "<display|simulate|functional|sample|parallel|simpoint|lanes|"
+            "sweep> "
+            "<cycles> "
+            "[--profile] [--no-fuse] [--checkpoint=<cycle>:<file>] "
+            "[--restore=<file>] "
+            "[--fast-forward=<instructions>] [--warmup=<instructions>] "
+            "[--period=<instructions>] [--window=<instructions>] "
+            "[--intervals=<n>] [--threads=<n>] "
+            "[--interval-size=<instructions>] [--clusters=<n>] "
+            "[--lanes=<file>] [--config=<file>] [--sweep=<file>] "
+            "[--samples=<n>] [--seed=<n>] [--summary=<file>] "
+            "[--data-image=<file>] [--dump=<file>] [--dump-delta=<file>] "
+            "[--trace=<file>] [--timeline=<file>] [--host-profile=<file>]\n"
+            "APEX_Help : Usage %s <manifest> batch <cycles> [--threads=<n>] "
+            "[--summary=<file>] [--host-profile=<file>]\n"
+            "APEX_Help : Usage %s <input_file> convert <image_file> "
+            "[--data=<file>]\n",
+            argv[0], argv[0], argv[0]);
     exit(1);
   }
 
-  APEX_CPU* cpu = APEX_cpu_init(argv[1]);
+  int profile = 0;
+  int fuse = 1;
+  const char* checkpoint_path = NULL;
+  int checkpoint_at = 0;
+  const char* restore_path = NULL;
+  long fast_forward = 0;
+  long warmup = -1;
+  long period = 100000;
+  long window = 1000;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int intervals = 0;
+  long interval_size = 100000;
+  int clusters = 10;
+  const char* summary_path = NULL;
+  const char* lane_path = NULL;
+  const char* config_path = NULL;
+  const char* sweep_path = NULL;
+  const char* data_path = NULL;
+  const char** data_images = calloc(argc, sizeof(char*));
+  int num_data_images = 0;
+  const char* dump_path = NULL;
+  const char* delta_path = NULL;
+  const char* trace_path = NULL;
+  const char* timeline_path = NULL;
+  const char* host_profile_path = NULL;
+  long samples = 0;
+  unsigned seed = 1;
+  for (int i = 4; i < argc; ++i) {
+    if (strcmp(argv[i], "--profile") == 0) {
+      profile = 1;
+    } else if (strcmp(argv[i], "--no-fuse") == 0) {
+      fuse = 0;
+    } else if (strncmp(argv[i], "--checkpoint=", 13) == 0) {
+      checkpoint_at = atoi(argv[i] + 13);
+      checkpoint_path = strchr(argv[i] + 13, ':');
+      if (!checkpoint_path || !checkpoint_path[1]) {
+        fprintf(stderr, "APEX_Error : Expected --checkpoint=<cycle>:<file>\n");
+        exit(1);
+      }
+      checkpoint_path++;
+    } else if (strncmp(argv[i], "--restore=", 10) == 0) {
+      restore_path = argv[i] + 10;
+    } else if (strncmp(argv[i], "--fast-forward=", 15) == 0) {
+      fast_forward = atol(argv[i] + 15);
+    } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+      warmup = atol(argv[i] + 9);
+    } else if (strncmp(argv[i], "--period=", 9) == 0) {
+      period = atol(argv[i] + 9);
+    } else if (strncmp(argv[i], "--window=", 9) == 0) {
+      window = atol(argv[i] + 9);
+    } else if (strncmp(argv[i], "--intervals=", 12) == 0) {
+      intervals = atoi(argv[i] + 12);
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      threads = atoi(argv[i] + 10);
+    } else if (strncmp(argv[i], "--interval-size=", 16) == 0) {
+      interval_size = atol(argv[i] + 16);
+    } else if (strncmp(argv[i], "--clusters=", 11) == 0) {
+      clusters = atoi(argv[i] + 11);
+    } else if (strncmp(argv[i], "--summary=", 10) == 0) {
+      summary_path = argv[i] + 10;
+    } else if (strncmp(argv[i], "--lanes=", 8) == 0) {
+      lane_path = argv[i] + 8;
+    } else if (strncmp(argv[i], "--config=", 9) == 0) {
+      config_path = argv[i] + 9;
+    } else if (strncmp(argv[i], "--sweep=", 8) == 0) {
+      sweep_path = argv[i] + 8;
+    } else if (strncmp(argv[i], "--data=", 7) == 0) {
+      data_path = argv[i] + 7;
+    } else if (strncmp(argv[i], "--data-image=", 13) == 0) {
+      data_images[num_data_images++] = argv[i] + 13;
+    } else if (strncmp(argv[i], "--dump=", 7) == 0) {
+      dump_path = argv[i] + 7;
+    } else if (strncmp(argv[i], "--dump-delta=", 13) == 0) {
+      delta_path = argv[i] + 13;
+    } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+      trace_path = argv[i] + 8;
+    } else if (strncmp(argv[i], "--timeline=", 11) == 0) {
+      timeline_path = argv[i] + 11;
+    } else if (strncmp(argv[i], "--host-profile=", 15) == 0) {
+      host_profile_path = argv[i] + 15;
+    } else if (strncmp(argv[i], "--samples=", 10) == 0) {
+      samples = atol(argv[i] + 10);
+    } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+      seed = strtoul(argv[i] + 7, NULL, 10);
+    } else {
+      fprintf(stderr, "APEX_Error : Unknown option %s\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  if (threads < 1) {
+    threads = 1;
+  }
+#ifndef APEX_HOST_PROFILE
+  if (host_profile_path) {
+    fprintf(stderr, "APEX_Error : Built without host profiling, rebuild "
+                    "with make HOST_PROFILE=1\n");
+    exit(1);
+  }
+#endif
+
+  /* A batch run takes a manifest of programs instead of one program */
+  if (strcmp(argv[2], "batch") == 0) {
+    char default_summary[4096];
+    snprintf(default_summary, sizeof(default_summary), "%s.summary", argv[1]);
+    int status = APEX_batch_run(argv[1],
+                                summary_path ? summary_path : default_summary,
+                                atoi(argv[3]), threads) == 0 ? 0 : 1;
+    if (host_profile_path &&
+        APEX_hostprof_write(host_profile_path, stderr) != 0) {
+      fprintf(stderr, "APEX_Error : Unable to write %s\n", host_profile_path);
+      status = 1;
+    }
+    return status;
+  }
+
+  /* Conversion writes the program as a binary image instead of running it */
+  if (strcmp(argv[2], "convert") == 0) {
+    return APEX_image_convert(argv[1], argv[3], data_path) == 0 ? 0 : 1;
+  }
+
+  /* A restored run resumes from the saved cycle instead of loading argv[1] */
+  APEX_CPU* cpu;
+  APEX_ZONE(ZONE_LOAD, cpu = restore_path ? APEX_cpu_restore(restore_path)
+                                          : APEX_cpu_init(argv[1]));
   if (!cpu) {
     fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
     exit(1);
   }
+  if (!restore_path) {
+    APEX_cpu_print_code_memory(cpu);
+  }
+  if (config_path && APEX_config_load(&cpu->config, config_path) != 0) {
+    exit(1);
+  }
+  for (int i = 0; i < num_data_images; ++i) {
+    int status;
+    APEX_ZONE(ZONE_DATA_IMAGE,
+              status = APEX_data_image_load(cpu, data_images[i]));
+    if (status != 0) {
+      exit(1);
+    }
+  }
+  free(data_images);
 
  cpu->f = argv[2];
+ cpu->display = strcmp(cpu->f, "display") == 0;
  cpu->cycle=atoi(argv[3]);
+ cpu->checkpoint_path = checkpoint_path;
+ cpu->checkpoint_at = checkpoint_at;
+
+  /* Opcode sequence profile of a program lives next to it */
+  char profile_path[4096];
+  snprintf(profile_path, sizeof(profile_path), "%s.prof", argv[1]);
+  int functional = strcmp(cpu->f, "functional") == 0;
+  int sample = strcmp(cpu->f, "sample") == 0;
+  int parallel = strcmp(cpu->f, "parallel") == 0;
+  int simpoint = strcmp(cpu->f, "simpoint") == 0;
+  int lanes = strcmp(cpu->f, "lanes") == 0;
+  int sweep = strcmp(cpu->f, "sweep") == 0;
+  if (lanes && !lane_path) {
+    fprintf(stderr, "APEX_Error : lanes mode needs --lanes=<file>\n");
+    exit(1);
+  }
+  if (sweep && !sweep_path) {
+    fprintf(stderr, "APEX_Error : sweep mode needs --sweep=<file>\n");
+    exit(1);
+  }
+  if (simpoint && (interval_size <= 0 || clusters <= 0)) {
+    fprintf(stderr,
+            "APEX_Error : Expected positive interval size and clusters\n");
+    exit(1);
+  }
+  if (intervals < 1) {
+    intervals = threads;
+  }
+  if (sample && (window <= 0 || period < window)) {
+    fprintf(stderr, "APEX_Error : Expected 0 < window <= period\n");
+    exit(1);
+  }
+  if ((dump_path || delta_path) && (parallel || simpoint || lanes || sweep)) {
+    fprintf(stderr, "APEX_Error : %s mode does not support dumps\n", cpu->f);
+    exit(1);
+  }
+
+  if (checkpoint_path && (sample || parallel || simpoint || lanes || sweep)) {
+    fprintf(stderr, "APEX_Error : %s mode does not support checkpoints\n",
+            cpu->f);
+    exit(1);
+  }
+
+  if ((trace_path || timeline_path) &&
+      (functional || sample || parallel || simpoint || lanes || sweep)) {
+    fprintf(stderr, "APEX_Error : %s mode does not support traces\n", cpu->f);
+    exit(1);
+  }
+
+  /* A delta dump keeps the pages that differ from the memory at start */
+  APEX_Memory baseline;
+  if (delta_path && APEX_memory_copy(&baseline, &cpu->memory) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to keep the initial data memory\n");
+    exit(1);
+  }
+
+  if (profile) {
+    if (APEX_profile_start(cpu) != 0) {
+      fprintf(stderr, "APEX_Error : Unable to start profiling\n");
+      exit(1);
+    }
+  } else if (fuse &&
+             (functional || sample || parallel || simpoint || fast_forward > 0)) {
+    int fused = APEX_fuse_load(cpu, profile_path);
+    if (fused > 0) {
+      fprintf(stderr, "APEX_CPU : Installed %d superinstructions from %s\n",
+              fused, profile_path);
+    }
+  }
 
-  APEX_cpu_run(cpu);
+  if (fast_forward > 0 && !functional) {
+    long skipped = APEX_cpu_fast_forward(cpu, fast_forward,
+                                         warmup < 0 ? 0 : warmup);
+    fprintf(stderr, "APEX_CPU : Fast-forwarded %ld instructions\n", skipped);
+  }
+  if (trace_path && APEX_trace_open(cpu, trace_path) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write trace %s\n", trace_path);
+    exit(1);
+  }
+  if (timeline_path && APEX_timeline_open(cpu, timeline_path) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write timeline %s\n",
+            timeline_path);
+    exit(1);
+  }
+
+  /* Any result that was asked for and not written fails the run */
+  int status = 0;
+  if (functional) {
+    status = APEX_cpu_run_functional(cpu);
+  } else if (sample) {
+    status = APEX_cpu_run_sampled(cpu, period, window,
+                                  warmup < 0 ? 100 : warmup);
+  } else if (parallel) {
+    status = APEX_cpu_run_intervals(cpu, intervals, threads,
+                                    warmup < 0 ? 100 : warmup);
+  } else if (lanes) {
+    status = APEX_cpu_run_lanes(cpu, lane_path);
+    if (status != 0) {
+      fprintf(stderr, "APEX_Error : Unable to run lanes from %s\n", lane_path);
+    }
+  } else if (sweep) {
+    char default_summary[4096];
+    snprintf(default_summary, sizeof(default_summary), "%s.sweep", argv[1]);
+    status = APEX_sweep_run(cpu, sweep_path,
+                            summary_path ? summary_path : default_summary,
+                            samples, seed, threads);
+    if (status != 0) {
+      fprintf(stderr, "APEX_Error : Sweep %s failed\n", sweep_path);
+    }
+  } else if (simpoint) {
+    status = APEX_cpu_run_simpoints(cpu, interval_size, clusters,
+                                    warmup < 0 ? 100 : warmup);
+  } else {
+    status = APEX_cpu_run(cpu);
+  }
+
+  if (APEX_trace_close(cpu) != 0) {
+    fprintf(stderr, "APEX_Error : Writing trace %s failed\n", trace_path);
+    status = -1;
+  }
+  if (APEX_timeline_close(cpu) != 0) {
+    fprintf(stderr, "APEX_Error : Writing timeline %s failed\n",
+            timeline_path);
+    status = -1;
+  }
+
+  const char* dumps[] = { dump_path, delta_path };
+  for (int i = 0; i < 2; ++i) {
+    if (!dumps[i]) {
+      continue;
+    }
+    int pages = APEX_dump_write(cpu, dumps[i], i ? &baseline : NULL);
+    if (pages < 0) {
+      fprintf(stderr, "APEX_Error : Unable to write %s\n", dumps[i]);
+      status = -1;
+    } else {
+      fprintf(stderr, "APEX_CPU : Wrote registers and %d data pages to %s\n",
+              pages, dumps[i]);
+    }
+  }
+  if (delta_path) {
+    APEX_memory_free(&baseline);
+  }
+
+  if (profile) {
+    int hot = APEX_profile_save(cpu, profile_path);
+    if (hot < 0) {
+      fprintf(stderr, "APEX_Error : Unable to write %s\n", profile_path);
+      status = -1;
+    } else {
+      fprintf(stderr, "APEX_CPU : Wrote %d hot sequences to %s\n", hot,
+              profile_path);
+    }
+  }
+  if (APEX_cpu_checkpoint_wait() != 0) {
+    fprintf(stderr, "APEX_Error : Writing checkpoint %s failed\n",
+            checkpoint_path);
+    status = -1;
+  }
+  if (host_profile_path &&
+      APEX_hostprof_write(host_profile_path, stderr) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", host_profile_path);
+    status = -1;
+  }
   APEX_cpu_stop(cpu);
-  return 0;
-}
\ No newline at end of file
+  return status == 0 ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+/*
+ *  paging.c
+ *  Contains the data memory of the CPU: 4 KB pages behind a two-level
+ *  page table. A page is allocated by the first store into it, so a
+ *  program touching a few words costs a page or two whatever the size of
+ *  its address space; words of pages never stored to read as zero.
+ *
+ *  Word addresses split into table index, page index and offset:
+ *    bits 29..20  first level, one second-level table per 4 MB
+ *    bits 19..10  second level, one page per 4 KB
+ *    bits  9..0   word within the page
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#define TABLE_PAGES (1 << APEX_TABLE_SHIFT)
+
+/*
+ * Returns page number page of memory, allocating it when allocate is
+ * set, or NULL if it was never allocated. The page becomes the cached
+ * last page. Running out of memory for a page ends the simulation, as
+ * there is no way to complete the store that needed it.
+ */
+int*
+APEX_memory_page(APEX_Memory* memory, unsigned int page, int allocate)
+{
+  if (page >= APEX_MEMORY_PAGES) {
+    return NULL;
+  }
+  int** table = memory->table[page >> APEX_TABLE_SHIFT];
+  int* words = table ? table[page & (TABLE_PAGES - 1)] : NULL;
+  if (!words && allocate) {
+    if (!table) {
+      table = calloc(TABLE_PAGES, sizeof(int*));
+      memory->table[page >> APEX_TABLE_SHIFT] = table;
+    }
+    words = table ? calloc(APEX_PAGE_WORDS, sizeof(int)) : NULL;
+    if (!words) {
+      fprintf(stderr, "APEX_Error : Out of memory for data page %u\n", page);
+      exit(1);
+    }
+    table[page & (TABLE_PAGES - 1)] = words;
+    memory->pages++;
+  }
+  if (words) {
+    memory->last_page = page;
+    memory->last = words;
+  }
+  return words;
+}
+
+/*
+ * Returns the first allocated page numbered *page or higher and sets
+ * *page to its number, or returns NULL if there is none. Leaves the
+ * cached last page alone, so it may walk memory another thread uses.
+ */
+int*
+APEX_memory_next(const APEX_Memory* memory, unsigned int* page)
+{
+  for (unsigned int p = *page; p < APEX_MEMORY_PAGES; ++p) {
+    int** table = memory->table[p >> APEX_TABLE_SHIFT];
+    if (!table) {
+      p |= TABLE_PAGES - 1;
+      continue;
+    }
+    if (table[p & (TABLE_PAGES - 1)]) {
+      *page = p;
+      return table[p & (TABLE_PAGES - 1)];
+    }
+  }
+  return NULL;
+}
+
+/* Makes dst a private copy of src, returns -1 if out of memory */
+int
+APEX_memory_copy(APEX_Memory* dst, const APEX_Memory* src)
+{
+  memset(dst, 0, sizeof(*dst));
+  unsigned int page = 0;
+  for (int* words; (words = APEX_memory_next(src, &page)); ++page) {
+    int** table = dst->table[page >> APEX_TABLE_SHIFT];
+    if (!table) {
+      table = calloc(TABLE_PAGES, sizeof(int*));
+      dst->table[page >> APEX_TABLE_SHIFT] = table;
+    }
+    int* copy = table ? malloc(sizeof(int) * APEX_PAGE_WORDS) : NULL;
+    if (!copy) {
+      APEX_memory_free(dst);
+      return -1;
+    }
+    memcpy(copy, words, sizeof(int) * APEX_PAGE_WORDS);
+    table[page & (TABLE_PAGES - 1)] = copy;
+    dst->pages++;
+  }
+  return 0;
+}
+
+void
+APEX_memory_free(APEX_Memory* memory)
+{
+  for (int t = 0; t < APEX_MEMORY_PAGES / TABLE_PAGES; ++t) {
+    if (memory->table[t]) {
+      for (int p = 0; p < TABLE_PAGES; ++p) {
+        free(memory->table[t][p]);
+      }
+      free(memory->table[t]);
+    }
+  }
+  memset(memory, 0, sizeof(*memory));
+}
+
+/*
+ * Stores words[0..count) from address 0 up. A page that is not yet
+ * allocated is only allocated if its words are not all zero, so loading
+ * a mostly empty data image costs just the pages it uses.
+ */
+void
+APEX_memory_load(APEX_Memory* memory, const int* words, unsigned int count)
+{
+  for (unsigned int start = 0; start < count; start += APEX_PAGE_WORDS) {
+    unsigned int n = count - start < APEX_PAGE_WORDS ? count - start
+                                                     : APEX_PAGE_WORDS;
+    int* page = APEX_memory_page(memory, start >> APEX_PAGE_SHIFT, 0);
+    for (unsigned int w = 0; !page && w < n; ++w) {
+      if (words[start + w]) {
+        page = APEX_memory_page(memory, start >> APEX_PAGE_SHIFT, 1);
+      }
+    }
+    if (page) {
+      memcpy(page, &words[start], sizeof(int) * n);
+    }
+  }
+}
@@ -0,0 +1,164 @@
+/*
+ *  sampling.c
+ *  Contains SMARTS-style sampled simulation: the program runs on the
+ *  functional path and every period instructions a short window is
+ *  measured in the detailed pipeline. CPI and total cycles are estimated
+ *  from the windows together with a 95% confidence interval.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+
+/* Two-sided 95% confidence, and the error the window count is sized for */
+#define SAMPLE_Z 1.96
+#define SAMPLE_TARGET_ERROR 0.03
+
+typedef struct APEX_Sample_Stats
+{
+  int windows;
+  double cpi_sum;
+  double cpi_sq_sum;
+  long functional;	// Instructions executed on the functional path
+  long detailed;	// Instructions committed by the pipeline
+  long cycles;	// Pipeline cycles, warm-up and drain included
+} APEX_Sample_Stats;
+
+static int
+pipeline_empty(APEX_CPU* cpu)
+{
+  for (int i = 0; i < NUM_STAGES; ++i) {
+    if (APEX_counts_as_instruction(cpu->stage[i].opcode)) {
+      return 0;
+    }
+  }
+  return !cpu->stage_check[2][0];
+}
+
+/*
+ * Stops fetching program instructions and cycles until everything in
+ * flight has committed, so that pc and the register file describe the
+ * next instruction for the functional path.
+ */
+static void
+drain_pipeline(APEX_CPU* cpu)
+{
+  cpu->drain = 1;
+  while (!APEX_cpu_finished(cpu) && !pipeline_empty(cpu)) {
+    APEX_cpu_cycle(cpu);
+  }
+  cpu->drain = 0;
+}
+
+/*
+ * Runs one warm-up plus measurement window in the pipeline and returns
+ * to functional state. The window only counts if the program is still
+ * running at its end, since the final drain would skew its CPI.
+ */
+static void
+sample_window(APEX_CPU* cpu, long window, long warmup, APEX_Sample_Stats* stats)
+{
+  int start_clock = cpu->clock;
+
+  APEX_cpu_reset_pipeline(cpu);
+  cpu->retired = 0;
+  if (!APEX_cpu_simulate(cpu, warmup)) {
+    int window_clock = cpu->clock;
+    if (!APEX_cpu_simulate(cpu, warmup + window)) {
+      double cpi = (double)(cpu->clock - window_clock) / window;
+      stats->windows++;
+      stats->cpi_sum += cpi;
+      stats->cpi_sq_sum += cpi * cpi;
+    }
+  }
+  drain_pipeline(cpu);
+  stats->detailed += cpu->retired;
+  stats->cycles += cpu->clock - start_clock;
+}
+
+static void
+print_estimate(FILE* out, APEX_Sample_Stats* stats, long window)
+{
+  long total = stats->functional + stats->detailed;
+
+  fprintf(out, "\n =============== SAMPLED PERFORMANCE ESTIMATE ===============");
+  fprintf(out, "\n  Instructions executed       |  %ld", total);
+  fprintf(out, "\n  Instructions in pipeline    |  %ld", stats->detailed);
+  fprintf(out, "\n  Pipeline cycles simulated   |  %ld", stats->cycles);
+  fprintf(out, "\n  Measurement windows         |  %d x %ld instructions",
+          stats->windows, window);
+  if (stats->windows == 0) {
+    fprintf(out,
+            "\n  No complete window, the program is shorter than one period\n");
+    return;
+  }
+
+  int n = stats->windows;
+  double mean = stats->cpi_sum / n;
+  double variance = 0;
+  if (n > 1) {
+    variance = (stats->cpi_sq_sum - n * mean * mean) / (n - 1);
+    if (variance < 0) {
+      variance = 0;
+    }
+  }
+  double cv = mean > 0 ? sqrt(variance) / mean : 0;
+  double half = SAMPLE_Z * sqrt(variance / n);
+  double needed = ceil(pow(SAMPLE_Z * cv / SAMPLE_TARGET_ERROR, 2));
+
+  fprintf(out,
+          "\n  CPI                         |  %.4f +/- %.4f (95%% confidence)",
+          mean, half);
+  fprintf(out, "\n  Estimated total cycles      |  %.0f +/- %.0f",
+          mean * total, half * total);
+  fprintf(out, "\n  CPI coeff. of variation     |  %.4f", cv);
+  fprintf(out, "\n  Windows for +/-%.0f%% error     |  %.0f%s\n",
+          SAMPLE_TARGET_ERROR * 100, needed,
+          n > 1 ? "" : " (needs at least 2 windows)");
+}
+
+/*
+ *  Sampled simulation loop, counterpart of APEX_cpu_run. Every period
+ *  instructions, warmup instructions refill the pipeline and the next
+ *  window instructions are measured; the rest of the period runs on the
+ *  functional path. cpu->cycle bounds the instructions executed.
+ */
+int
+APEX_cpu_run_sampled(APEX_CPU* cpu, long period, long window, long warmup)
+{
+  APEX_Sample_Stats stats = { 0 };
+  long skip = period - window - warmup;
+  if (skip < 0) {
+    skip = 0;
+  }
+
+  while (!cpu->halt && !APEX_cpu_finished(cpu)) {
+    long total = stats.functional + stats.detailed;
+    long budget = skip;
+    if (cpu->cycle > 0) {
+      if (total >= cpu->cycle) {
+        break;
+      }
+      if (cpu->cycle - total < budget) {
+        budget = cpu->cycle - total;
+      }
+    }
+    stats.functional += APEX_cpu_step(cpu, budget);
+    if (cpu->halt) {
+      /* HALT counts as executed, as it retires in the pipeline */
+      stats.functional += APEX_cpu_at_halt(cpu);
+    }
+    total = stats.functional + stats.detailed;
+    if (cpu->halt || (cpu->cycle > 0 && total >= cpu->cycle)) {
+      break;
+    }
+    sample_window(cpu, window, warmup, &stats);
+  }
+
+  fprintf(cpu->out, "%d", cpu->code_memory_size);
+  fprintf(cpu->out, "(apex) >> Simulation Complete");
+  APEX_cpu_print_state(cpu);
+  print_estimate(cpu->out, &stats, window);
+  return 0;
+}
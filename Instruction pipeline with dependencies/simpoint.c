@@ -0,0 +1,438 @@
+/*
+ *  simpoint.c
+ *  Contains basic block vector profiling and representative interval
+ *  selection. The functional path records how many instructions of each
+ *  basic block execute in every fixed-size interval, the vectors are
+ *  clustered with k-means on a random projection, and only the interval
+ *  closest to each cluster centre is simulated in the pipeline. Its CPI is
+ *  weighted by the cluster size to estimate the whole run.
+ */
+#include <float.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* Dimensions of the random projection and k-means iteration cap */
+#define BBV_DIMENSIONS 15
+#define KMEANS_MAX_ITERATIONS 100
+#define SIMPOINT_SEED 0x5eed5eedu
+
+typedef struct APEX_Simpoint
+{
+  int cluster;
+  long interval;	// Index of the representative interval
+  double weight;	// Share of intervals in the cluster
+  long instructions;
+  long cycles;
+} APEX_Simpoint;
+
+/* Seeded, so the same program picks the same points */
+static double
+random_unit(unsigned int* state)
+{
+  return (double)APEX_random_next(state) / UINT_MAX;
+}
+
+static int
+branch_target(const APEX_Instruction* ins, int index)
+{
+  switch (ins->opcode) {
+    case OP_BZ:
+    case OP_BNZ:
+      return get_code_index(4000 + 4 * index + ins->imm);
+    case OP_JUMP:
+      /* Register relative; the literal is the target in the usual R0 form */
+      return get_code_index(ins->imm);
+    default:
+      return -1;
+  }
+}
+
+/*
+ * Splits code memory into basic blocks. A block starts at the first
+ * instruction, at every branch target and after every control transfer.
+ * Fills block_of with the block of each code index, returns the count.
+ */
+static int
+find_basic_blocks(APEX_CPU* cpu, int* block_of)
+{
+  int size = cpu->code_memory_size;
+  char* leader = calloc(size + 1, 1);
+  if (!leader) {
+    return -1;
+  }
+
+  leader[0] = 1;
+  for (int i = 0; i < size; ++i) {
+    const APEX_Instruction* ins = &cpu->code_memory[i];
+    if (opcode_info[ins->opcode].ins_class == CLASS_BRANCH ||
+        ins->opcode == OP_HALT) {
+      leader[i + 1] = 1;
+      int target = branch_target(ins, i);
+      if (target >= 0 && target < size) {
+        leader[target] = 1;
+      }
+    }
+  }
+
+  int blocks = 0;
+  for (int i = 0; i < size; ++i) {
+    blocks += leader[i];
+    block_of[i] = blocks - 1;
+  }
+  free(leader);
+  return blocks;
+}
+
+/*
+ * Functional pass: executes the run and stores the projected basic block
+ * vector of every complete interval in *vectors. Returns the number of
+ * complete intervals, and the instructions executed in *total.
+ */
+static long
+profile_intervals(APEX_CPU* cpu, long interval_size, double** vectors,
+                  long* total)
+{
+  long limit = cpu->cycle > 0 ? cpu->cycle : LONG_MAX;
+  int* block_of = malloc(sizeof(int) * cpu->code_memory_size);
+  long count = 0;
+  long capacity = 0;
+  *vectors = NULL;
+  *total = 0;
+
+  int blocks = block_of ? find_basic_blocks(cpu, block_of) : -1;
+  double* projection =
+    blocks > 0 ? malloc(sizeof(double) * blocks * BBV_DIMENSIONS) : NULL;
+  long* bbv = blocks > 0 ? calloc(blocks, sizeof(long)) : NULL;
+  if (!projection || !bbv) {
+    count = -1;
+    goto done;
+  }
+
+  unsigned int seed = SIMPOINT_SEED;
+  for (int i = 0; i < blocks * BBV_DIMENSIONS; ++i) {
+    projection[i] = 2 * random_unit(&seed) - 1;
+  }
+
+  long filled = 0;
+  while (*total < limit) {
+    if (APEX_cpu_step(cpu, 1) == 0) {
+      /* HALT counts as executed, as it retires in the pipeline */
+      *total += APEX_cpu_at_halt(cpu);
+      break;
+    }
+    /* The step may have passed NOPs, its instruction is the last one */
+    bbv[block_of[cpu->last_completed]]++;
+    (*total)++;
+    if (++filled < interval_size) {
+      continue;
+    }
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      double* grown =
+        realloc(*vectors, sizeof(double) * capacity * BBV_DIMENSIONS);
+      if (!grown) {
+        count = -1;
+        goto done;
+      }
+      *vectors = grown;
+    }
+    double* vector = *vectors + count * BBV_DIMENSIONS;
+    for (int d = 0; d < BBV_DIMENSIONS; ++d) {
+      vector[d] = 0;
+    }
+    for (int b = 0; b < blocks; ++b) {
+      if (bbv[b]) {
+        double share = (double)bbv[b] / interval_size;
+        for (int d = 0; d < BBV_DIMENSIONS; ++d) {
+          vector[d] += share * projection[b * BBV_DIMENSIONS + d];
+        }
+      }
+    }
+    memset(bbv, 0, sizeof(long) * blocks);
+    filled = 0;
+    count++;
+  }
+
+done:
+  free(block_of);
+  free(projection);
+  free(bbv);
+  return count;
+}
+
+static double
+distance(const double* a, const double* b)
+{
+  double sum = 0;
+  for (int d = 0; d < BBV_DIMENSIONS; ++d) {
+    sum += (a[d] - b[d]) * (a[d] - b[d]);
+  }
+  return sum;
+}
+
+/*
+ * k-means with k-means++ seeding. Fills assignment with the cluster of
+ * every vector and centres with the k cluster centres.
+ */
+static int
+kmeans(const double* vectors, long count, int k, int* assignment,
+       double* centres)
+{
+  unsigned int seed = SIMPOINT_SEED;
+  double* nearest = malloc(sizeof(double) * count);
+  long* members = malloc(sizeof(long) * k);
+  if (!nearest || !members) {
+    free(nearest);
+    free(members);
+    return -1;
+  }
+
+  /* k-means++: each next centre is drawn weighted by squared distance */
+  memcpy(centres, vectors + (APEX_random_next(&seed) % count) * BBV_DIMENSIONS,
+         sizeof(double) * BBV_DIMENSIONS);
+  for (long i = 0; i < count; ++i) {
+    nearest[i] = distance(vectors + i * BBV_DIMENSIONS, centres);
+  }
+  for (int c = 1; c < k; ++c) {
+    double sum = 0;
+    for (long i = 0; i < count; ++i) {
+      sum += nearest[i];
+    }
+    double pick = random_unit(&seed) * sum;
+    long chosen = 0;
+    for (; chosen < count - 1 && pick > nearest[chosen]; ++chosen) {
+      pick -= nearest[chosen];
+    }
+    double* centre = centres + c * BBV_DIMENSIONS;
+    memcpy(centre, vectors + chosen * BBV_DIMENSIONS,
+           sizeof(double) * BBV_DIMENSIONS);
+    for (long i = 0; i < count; ++i) {
+      double d = distance(vectors + i * BBV_DIMENSIONS, centre);
+      if (d < nearest[i]) {
+        nearest[i] = d;
+      }
+    }
+  }
+
+  for (long i = 0; i < count; ++i) {
+    assignment[i] = -1;
+  }
+  for (int iteration = 0; iteration < KMEANS_MAX_ITERATIONS; ++iteration) {
+    int changed = 0;
+    for (long i = 0; i < count; ++i) {
+      int best = 0;
+      double best_distance = DBL_MAX;
+      for (int c = 0; c < k; ++c) {
+        double d = distance(vectors + i * BBV_DIMENSIONS,
+                            centres + c * BBV_DIMENSIONS);
+        if (d < best_distance) {
+          best_distance = d;
+          best = c;
+        }
+      }
+      if (assignment[i] != best) {
+        assignment[i] = best;
+        changed = 1;
+      }
+    }
+    if (!changed) {
+      break;
+    }
+
+    memset(centres, 0, sizeof(double) * k * BBV_DIMENSIONS);
+    memset(members, 0, sizeof(long) * k);
+    for (long i = 0; i < count; ++i) {
+      members[assignment[i]]++;
+      for (int d = 0; d < BBV_DIMENSIONS; ++d) {
+        centres[assignment[i] * BBV_DIMENSIONS + d] +=
+          vectors[i * BBV_DIMENSIONS + d];
+      }
+    }
+    for (int c = 0; c < k; ++c) {
+      for (int d = 0; d < BBV_DIMENSIONS && members[c]; ++d) {
+        centres[c * BBV_DIMENSIONS + d] /= members[c];
+      }
+    }
+  }
+  free(nearest);
+  free(members);
+  return 0;
+}
+
+/*
+ * Picks the interval closest to each cluster centre. Returns the number
+ * of simulation points, ordered by interval.
+ */
+static int
+choose_simpoints(const double* vectors, long count, int k,
+                 APEX_Simpoint* points)
+{
+  int* assignment = malloc(sizeof(int) * count);
+  double* centres = malloc(sizeof(double) * k * BBV_DIMENSIONS);
+  int chosen = 0;
+  if (!assignment || !centres ||
+      kmeans(vectors, count, k, assignment, centres) != 0) {
+    free(assignment);
+    free(centres);
+    return -1;
+  }
+
+  for (int c = 0; c < k; ++c) {
+    long best = -1;
+    long members = 0;
+    double best_distance = DBL_MAX;
+    for (long i = 0; i < count; ++i) {
+      if (assignment[i] != c) {
+        continue;
+      }
+      members++;
+      double d = distance(vectors + i * BBV_DIMENSIONS,
+                          centres + c * BBV_DIMENSIONS);
+      if (d < best_distance) {
+        best_distance = d;
+        best = i;
+      }
+    }
+    if (best >= 0) {
+      points[chosen].cluster = c;
+      points[chosen].interval = best;
+      points[chosen].weight = (double)members / count;
+      chosen++;
+    }
+  }
+
+  /* Insertion sort keeps the replay pass moving forward only */
+  for (int i = 1; i < chosen; ++i) {
+    APEX_Simpoint point = points[i];
+    int j = i - 1;
+    for (; j >= 0 && points[j].interval > point.interval; --j) {
+      points[j + 1] = points[j];
+    }
+    points[j + 1] = point;
+  }
+  free(assignment);
+  free(centres);
+  return chosen;
+}
+
+/*
+ * Replays the run functionally and simulates each simulation point in the
+ * pipeline, starting warmup instructions early to fill it
+ */
+static int
+simulate_simpoints(APEX_CPU* cpu, APEX_Simpoint* points, int count,
+                   long interval_size, long warmup)
+{
+  APEX_CPU* walker = APEX_cpu_clone(cpu);
+  long position = 0;
+  if (!walker) {
+    return -1;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    long start = points[i].interval * interval_size;
+    long snapshot = start > warmup ? start - warmup : 0;
+    position += APEX_cpu_step(walker, snapshot - position);
+
+    APEX_CPU* detailed = APEX_cpu_clone(walker);
+    if (!detailed) {
+      APEX_cpu_free_clone(walker);
+      return -1;
+    }
+    APEX_cpu_reset_pipeline(detailed);
+    detailed->clock = 0;
+    detailed->retired = 0;
+    APEX_cpu_simulate(detailed, start - snapshot);
+    long retired = detailed->retired;
+    int clock = detailed->clock;
+    APEX_cpu_simulate(detailed, start - snapshot + interval_size);
+    points[i].instructions = detailed->retired - retired;
+    points[i].cycles = detailed->clock - clock;
+    APEX_cpu_free_clone(detailed);
+  }
+  APEX_cpu_free_clone(walker);
+  return 0;
+}
+
+static void
+print_simpoints(FILE* out, APEX_Simpoint* points, int count,
+                long intervals, long interval_size, long total)
+{
+  double cpi = 0;
+
+  fprintf(out, "\n =============== SIMULATION POINTS ===============");
+  fprintf(out, "\n  Instructions executed       |  %ld", total);
+  fprintf(out, "\n  Intervals profiled          |  %ld x %ld instructions",
+          intervals, interval_size);
+  fprintf(out, "\n  Cluster | Interval |  Weight |    Cycles |    CPI");
+  for (int i = 0; i < count; ++i) {
+    APEX_Simpoint* point = &points[i];
+    double point_cpi = point->instructions
+                         ? (double)point->cycles / point->instructions : 0.0;
+    fprintf(out, "\n  %7d | %8ld | %7.4f | %9ld | %6.3f", point->cluster,
+            point->interval, point->weight, point->cycles, point_cpi);
+    cpi += point->weight * point_cpi;
+  }
+  fprintf(out, "\n  Estimated CPI               |  %.4f", cpi);
+  fprintf(out, "\n  Estimated total cycles      |  %.0f\n", cpi * total);
+}
+
+/*
+ *  Simulation point loop, counterpart of APEX_cpu_run. Profiles basic
+ *  block vectors over intervals of interval_size instructions, clusters
+ *  them into at most clusters groups and simulates one representative
+ *  interval per group in the pipeline. cpu->cycle bounds the
+ *  instructions executed. The final state printed is the functional one.
+ */
+int
+APEX_cpu_run_simpoints(APEX_CPU* cpu, long interval_size, int clusters,
+                       long warmup)
+{
+  APEX_CPU* profiled = APEX_cpu_clone(cpu);
+  double* vectors = NULL;
+  long total = 0;
+  if (!profiled) {
+    return -1;
+  }
+  long intervals =
+    profile_intervals(profiled, interval_size, &vectors, &total);
+
+  int count = 0;
+  APEX_Simpoint* points = NULL;
+  if (intervals > 0) {
+    if (clusters > intervals) {
+      clusters = intervals;
+    }
+    points = calloc(clusters, sizeof(*points));
+    count =
+      points ? choose_simpoints(vectors, intervals, clusters, points) : -1;
+    if (count > 0 &&
+        simulate_simpoints(cpu, points, count, interval_size, warmup) != 0) {
+      count = -1;
+    }
+  }
+  if (intervals < 0 || count < 0) {
+    fprintf(stderr, "APEX_Error : Unable to select simulation points\n");
+  }
+
+  fprintf(cpu->out, "%d", cpu->code_memory_size);
+  fprintf(cpu->out, "(apex) >> Simulation Complete");
+  APEX_cpu_print_state(profiled);
+  if (count > 0) {
+    print_simpoints(cpu->out, points, count, intervals, interval_size,
+                    total);
+  } else if (intervals == 0) {
+    fprintf(cpu->out, "\n  No complete interval, the program is shorter than one "
+           "interval\n");
+  }
+
+  free(points);
+  free(vectors);
+  APEX_cpu_free_clone(profiled);
+  return count < 0 ? -1 : 0;
+}
@@ -0,0 +1,304 @@
+/*
+ *  sweep.c
+ *  Contains the design-space sweep: one program is simulated under many
+ *  run configurations on a pool of threads, and one result row per
+ *  configuration is written to a summary.
+ *
+ *  Sweep files hold one parameter per line as "<key> = <values>", where
+ *  keys are those of a config file and values is a comma separated list
+ *  of values or integer ranges "<first>..<last>". All combinations are
+ *  simulated, or a seeded random sample of them. Blank lines and '#'
+ *  comments are skipped.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* Bounds the combinations of one sweep, larger spaces need sampling */
+#define SWEEP_MAX_RUNS 10000000L
+
+typedef struct APEX_Sweep_Param
+{
+  char key[64];
+  char** values;
+  int count;
+} APEX_Sweep_Param;
+
+typedef struct APEX_Sweep_Run
+{
+  int clock;
+  long retired;
+  long decode_stalls;
+  long execute_busy;
+  long flushes;
+  int halted;
+} APEX_Sweep_Run;
+
+/* Runs of one sweep, simulated as tasks of APEX_run_tasks */
+typedef struct APEX_Sweep_Pool
+{
+  APEX_CPU* cpu;		// Initial state shared by all runs
+  APEX_Sweep_Param* params;
+  int num_params;
+  int* choices;		// Value index per run and parameter
+  APEX_Sweep_Run* runs;
+  long count;
+} APEX_Sweep_Pool;
+
+static int
+add_value(APEX_Sweep_Param* param, const char* value)
+{
+  char** grown = realloc(param->values, sizeof(char*) * (param->count + 1));
+  if (!grown) {
+    return -1;
+  }
+  param->values = grown;
+  param->values[param->count] = strdup(value);
+  return param->values[param->count++] ? 0 : -1;
+}
+
+/* Expands one comma separated list of values and ranges into param */
+static int
+parse_values(APEX_Sweep_Param* param, char* list)
+{
+  for (char* item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+    item = APEX_trim(item);
+    int first;
+    int last;
+    int used;
+    if (sscanf(item, "%d..%d%n", &first, &last, &used) == 2 && !item[used]) {
+      if (first > last || last - first >= 1000) {
+        return -1;
+      }
+      for (int v = first; v <= last; ++v) {
+        char text[16];
+        snprintf(text, sizeof(text), "%d", v);
+        if (add_value(param, text) != 0) {
+          return -1;
+        }
+      }
+    } else if (!*item || add_value(param, item) != 0) {
+      return -1;
+    }
+  }
+  return param->count > 0 ? 0 : -1;
+}
+
+static void
+free_params(APEX_Sweep_Param* params, int count)
+{
+  for (int i = 0; i < count; ++i) {
+    for (int v = 0; v < params[i].count; ++v) {
+      free(params[i].values[v]);
+    }
+    free(params[i].values);
+  }
+  free(params);
+}
+
+/* Reads the sweep file, returns the number of parameters or -1 on error */
+static int
+read_sweep(const char* path, APEX_Sweep_Param** params)
+{
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open sweep %s\n", path);
+    return -1;
+  }
+
+  char line[4096];
+  int count = 0;
+  int line_number = 0;
+  int error = 0;
+  *params = NULL;
+  while (!error && fgets(line, sizeof(line), fp)) {
+    line_number++;
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    char* key = APEX_trim(line);
+    if (!*key) {
+      continue;
+    }
+    char* equals = strchr(key, '=');
+    APEX_Sweep_Param* grown =
+      realloc(*params, sizeof(APEX_Sweep_Param) * (count + 1));
+    if (!equals || !grown) {
+      error = 1;
+      break;
+    }
+    *params = grown;
+    APEX_Sweep_Param* param = &grown[count++];
+    memset(param, 0, sizeof(*param));
+    *equals = '\0';
+    snprintf(param->key, sizeof(param->key), "%s", APEX_trim(key));
+    error = parse_values(param, equals + 1) != 0;
+
+    /* Every value has to be valid for the key */
+    APEX_Config scratch;
+    APEX_config_default(&scratch);
+    for (int v = 0; !error && v < param->count; ++v) {
+      error = APEX_config_set(&scratch, param->key, param->values[v]) != 0;
+    }
+  }
+  fclose(fp);
+  if (error) {
+    fprintf(stderr, "APEX_Error : %s:%d: bad sweep parameter\n", path,
+            line_number);
+    free_params(*params, count);
+    *params = NULL;
+    return -1;
+  }
+  return count;
+}
+
+static void
+simulate_config(void* context, long run)
+{
+  APEX_Sweep_Pool* pool = context;
+  APEX_Sweep_Run* result = &pool->runs[run];
+  const int* choice = &pool->choices[run * pool->num_params];
+  APEX_CPU* cpu = APEX_cpu_clone(pool->cpu);
+
+  result->clock = -1;
+  if (!cpu) {
+    return;
+  }
+  for (int i = 0; i < pool->num_params; ++i) {
+    APEX_Sweep_Param* param = &pool->params[i];
+    APEX_config_set(&cpu->config, param->key, param->values[choice[i]]);
+  }
+  while (!APEX_cpu_finished(cpu) && cpu->clock != cpu->cycle) {
+    APEX_cpu_advance(cpu, cpu->cycle);
+  }
+  result->clock = cpu->clock;
+  result->retired = cpu->retired;
+  result->decode_stalls = cpu->decode_stalls;
+  result->execute_busy = cpu->execute_busy;
+  result->flushes = cpu->flushes;
+  result->halted = APEX_cpu_finished(cpu);
+  APEX_cpu_free_clone(cpu);
+}
+
+/*
+ * Picks the value of every parameter per run: all combinations in order,
+ * or samples random ones when that is fewer. Returns the run count.
+ */
+static long
+choose_configs(APEX_Sweep_Pool* pool, long samples, unsigned seed)
+{
+  long total = 1;
+  for (int i = 0; i < pool->num_params; ++i) {
+    if (total > SWEEP_MAX_RUNS / pool->params[i].count) {
+      total = LONG_MAX;
+      break;
+    }
+    total *= pool->params[i].count;
+  }
+  long count = samples > 0 && samples < total ? samples : total;
+  if (count > SWEEP_MAX_RUNS) {
+    fprintf(stderr, "APEX_Error : Sweep has more than %ld configurations, "
+                    "use --samples=<n>\n", SWEEP_MAX_RUNS);
+    return -1;
+  }
+
+  pool->choices = malloc(sizeof(int) * (count * pool->num_params + 1));
+  if (!pool->choices) {
+    return -1;
+  }
+  unsigned int state = seed ? seed : 1;
+  for (long run = 0; run < count; ++run) {
+    long rest = run;
+    for (int i = pool->num_params - 1; i >= 0; --i) {
+      int values = pool->params[i].count;
+      int* choice = &pool->choices[run * pool->num_params + i];
+      if (count < total) {
+        *choice = APEX_random_next(&state) % values;
+      } else {
+        *choice = rest % values;
+        rest /= values;
+      }
+    }
+  }
+  return count;
+}
+
+static int
+write_results(const char* summary, APEX_Sweep_Pool* pool, int threads,
+              double seconds)
+{
+  FILE* fp = fopen(summary, "w");
+  if (!fp) {
+    return -1;
+  }
+
+  fprintf(fp, "# config");
+  for (int i = 0; i < pool->num_params; ++i) {
+    fprintf(fp, " %s", pool->params[i].key);
+  }
+  fprintf(fp, " cycles retired cpi decode_stalls execute_busy flushes "
+              "halted\n");
+  for (long run = 0; run < pool->count; ++run) {
+    APEX_Sweep_Run* result = &pool->runs[run];
+    fprintf(fp, "%ld", run);
+    for (int i = 0; i < pool->num_params; ++i) {
+      int choice = pool->choices[run * pool->num_params + i];
+      fprintf(fp, " %s", pool->params[i].values[choice]);
+    }
+    fprintf(fp, " %d %ld %.4f %ld %ld %ld %d\n", result->clock,
+            result->retired,
+            result->retired ? (double)result->clock / result->retired : 0.0,
+            result->decode_stalls, result->execute_busy, result->flushes,
+            result->halted);
+  }
+  fprintf(fp, "# configs %ld threads %d seconds %.3f\n", pool->count, threads,
+          seconds);
+  return fclose(fp) == 0 ? 0 : -1;
+}
+
+/*
+ *  Sweep loop: simulates cpu, as loaded, under every configuration of
+ *  sweep_file on threads workers and writes one row per configuration to
+ *  summary. cpu->config is the base the swept parameters override, and
+ *  cpu->cycle bounds every run as in 'simulate'. With samples > 0, that
+ *  many random configurations are drawn, seeded by seed.
+ */
+int
+APEX_sweep_run(APEX_CPU* cpu, const char* sweep_file, const char* summary,
+               long samples, unsigned seed, int threads)
+{
+  APEX_Sweep_Pool pool = { 0 };
+  pool.cpu = cpu;
+  pool.num_params = read_sweep(sweep_file, &pool.params);
+  if (pool.num_params < 0) {
+    return -1;
+  }
+  pool.count = choose_configs(&pool, samples, seed);
+  pool.runs = pool.count > 0 ? calloc(pool.count, sizeof(*pool.runs)) : NULL;
+  if (!pool.runs) {
+    free(pool.choices);
+    free_params(pool.params, pool.num_params);
+    return -1;
+  }
+
+  double start = APEX_now_seconds();
+  int started = APEX_run_tasks(simulate_config, &pool, pool.count, threads);
+  double seconds = APEX_now_seconds() - start;
+
+  int status = write_results(summary, &pool, started, seconds);
+  if (status != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", summary);
+  }
+  fprintf(stderr, "APEX_CPU : Ran %ld configurations on %d threads in %.3f s, "
+                  "results in %s\n", pool.count, started,
+          seconds, summary);
+
+  free(pool.runs);
+  free(pool.choices);
+  free_params(pool.params, pool.num_params);
+  return status;
+}
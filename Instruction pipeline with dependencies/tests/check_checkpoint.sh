@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+#  check_checkpoint.sh <apex_sim> <program> <cycle>
+#  Checkpoints the program at the cycle and fails unless the restored run
+#  ends in the same state as an uninterrupted one, and unless copies with
+#  a bad opcode or a bad register field in code memory are rejected as
+#  incompatible. The program must not use data memory, so its code memory
+#  is the last thing before the trailing page count of the file.
+#
+sim=$1
+program=$2
+cycle=$3
+tmp=${TMPDIR:-/tmp}/check_checkpoint.$$
+trap 'rm -f "$tmp".*' EXIT
+
+# Final state lines, with runs of blanks squeezed
+state() {
+  grep -o '\(REGS\|MEM\)\[[0-9]*\] *| *-\{0,1\}[0-9]*' "$1" | tr -s ' '
+}
+
+# Header field at the byte offset, as a decimal int
+field() {
+  od -A n -t d4 -j "$2" -N 4 "$1" | tr -d ' '
+}
+
+# Copy of the checkpoint with one byte of the first instruction replaced
+corrupt() {
+  cp "$tmp.ckpt" "$1"
+  printf '\377' |
+    dd of="$1" bs=1 seek=$((code + $2)) conv=notrunc 2> /dev/null
+}
+
+"$sim" "$program" simulate 100000 > "$tmp.full" 2>&1 || exit 1
+"$sim" "$program" simulate 100000 --checkpoint="$cycle:$tmp.ckpt" \
+  > /dev/null 2>&1 || exit 1
+"$sim" "$program" simulate 100000 --restore="$tmp.ckpt" \
+  > "$tmp.restored" 2>&1 || exit 1
+state "$tmp.full" > "$tmp.f"
+state "$tmp.restored" > "$tmp.r"
+if [ ! -s "$tmp.f" ] || ! cmp -s "$tmp.f" "$tmp.r"; then
+  echo "$program: run restored at cycle $cycle ends in a different state"
+  diff "$tmp.f" "$tmp.r"
+  exit 1
+fi
+
+size=$(wc -c < "$tmp.ckpt")
+code=$((size - 4 - $(field "$tmp.ckpt" 16) * $(field "$tmp.ckpt" 24)))
+corrupt "$tmp.opcode" 0
+corrupt "$tmp.register" 2
+for bad in "$tmp.opcode" "$tmp.register"; do
+  "$sim" "$program" simulate 100000 --restore="$bad" > "$tmp.out" 2>&1
+  status=$?
+  if [ "$status" -ne 1 ] ||
+     ! grep -q 'is not a compatible checkpoint' "$tmp.out"; then
+    echo "$program: corrupted checkpoint ${bad##*.} not rejected" \
+      "(exit $status)"
+    exit 1
+  fi
+done
+echo "$program: checkpoint restores at cycle $cycle, corrupted copies rejected"
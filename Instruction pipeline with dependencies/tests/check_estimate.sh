@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+#  check_estimate.sh <apex_sim> <program> <parallel|sample|simpoint> [options]
+#  Runs the program in 'simulate' mode and in the given mode with the
+#  options, and fails unless the mode counts the same instructions and
+#  its total cycles lie within its confidence interval, if it reports one,
+#  plus 2% of the cycles of the full simulation.
+#
+sim=$1
+program=$2
+mode=$3
+shift 3
+tmp=${TMPDIR:-/tmp}/check_estimate.$$
+trap 'rm -f "$tmp".*' EXIT
+
+"$sim" "$program" simulate 100000000 > "$tmp.simulate" 2>&1 || exit 1
+"$sim" "$program" "$mode" 0 "$@" > "$tmp.mode" 2>&1 || exit 1
+
+# Value of the first "<label> | <value>" line, "+/-" margins split off
+field() {
+  sed -n "s/^ *$2 *| *//p" "$1" | head -1 | sed 's|+/-| |' | tr -d '|'
+}
+
+cycles=$(field "$tmp.simulate" Cycles)
+retired=$(field "$tmp.simulate" Retired)
+if [ "$mode" = parallel ]; then
+  set -- $(field "$tmp.mode" Total)
+  instructions=$1
+  estimate=$2
+  margin=0
+else
+  instructions=$(field "$tmp.mode" 'Instructions executed')
+  set -- $(field "$tmp.mode" 'Estimated total cycles') 0
+  estimate=$1
+  margin=$2
+fi
+
+if [ "$instructions" != "$retired" ] ||
+   ! awk -v e="$estimate" -v c="$cycles" -v m="$margin" \
+       'BEGIN { d = e - c; exit !(e != "" && (d < 0 ? -d : d) <= m + c / 50) }'
+then
+  echo "$program: $mode counts $instructions instructions and" \
+       "$estimate +/- $margin cycles, simulate $retired and $cycles"
+  exit 1
+fi
+echo "$program: $mode matches simulate, $estimate of $cycles cycles"
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+#  check_functional.sh <apex_sim> <program> <expected>
+#  Runs the program in 'simulate' and in 'functional' mode and fails unless
+#  their final registers and data memory differ in exactly the lines of the
+#  expected file, one "<simulate line> => <functional line>" per line. An
+#  empty file requires the same final state.
+#
+sim=$1
+program=$2
+expected=$3
+tmp=${TMPDIR:-/tmp}/check_functional.$$
+trap 'rm -f "$tmp".*' EXIT
+
+# Final state lines, with runs of blanks squeezed
+state() {
+  grep -o '\(REGS\|MEM\)\[[0-9]*\] *| *-\{0,1\}[0-9]*' "$1" | tr -s ' '
+}
+
+"$sim" "$program" simulate 100000 > "$tmp.simulate" 2>&1 || exit 1
+"$sim" "$program" functional 100000 > "$tmp.functional" 2>&1 || exit 1
+state "$tmp.simulate" > "$tmp.s"
+state "$tmp.functional" > "$tmp.f"
+awk 'NR == FNR { line[FNR] = $0; next }
+     $0 != line[FNR] { print line[FNR] " => " $0 }' "$tmp.s" "$tmp.f" \
+  > "$tmp.diff"
+if [ "$(wc -l < "$tmp.s")" -ne "$(wc -l < "$tmp.f")" ] ||
+   ! cmp -s "$expected" "$tmp.diff"; then
+  echo "$program: simulate and functional final states differ unexpectedly"
+  diff "$expected" "$tmp.diff"
+  exit 1
+fi
+echo "$program: functional and simulate final states differ only as in $expected"
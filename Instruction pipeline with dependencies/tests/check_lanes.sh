@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+#  check_lanes.sh <apex_sim> <program> <lane file>
+#  Runs the program in 'lanes' mode, then every lane of the lane file on its
+#  own, and fails if a lane's cycles, retired count, flag or registers differ
+#  from its separate run.
+#
+sim=$1
+program=$2
+lanes=$3
+tmp=${TMPDIR:-/tmp}/check_lanes.$$
+trap 'rm -f "$tmp".*' EXIT
+
+# Lane rows: "<lane> | <mode> | <cycles> | <retired> | <z> | <regs>"
+rows() {
+  sed -n '/LOCKSTEP LANES/,$p' "$1" | grep '^ *[0-9][0-9]* |' |
+    awk -F'|' '{ print $3 "|" $4 "|" $5 "|" $6 }'
+}
+
+"$sim" "$program" lanes 10000 --lanes="$lanes" > "$tmp.all" 2>&1 || exit 1
+rows "$tmp.all" > "$tmp.rows"
+
+status=0
+lane=0
+grep -v '^[[:space:]]*\(#.*\)\{0,1\}$' "$lanes" | while IFS= read -r line; do
+  lane=$((lane + 1))
+  printf '%s\n' "$line" > "$tmp.one"
+  "$sim" "$program" lanes 10000 --lanes="$tmp.one" > "$tmp.out" 2>&1 || exit 1
+  separate=$(rows "$tmp.out")
+  lockstep=$(sed -n "${lane}p" "$tmp.rows")
+  if [ "$separate" != "$lockstep" ]; then
+    echo "lane $((lane - 1)) of $lanes: lockstep$lockstep, separate$separate"
+    exit 1
+  fi
+done || status=1
+
+if [ $status -eq 0 ]; then
+  echo "$program: every lane of $lanes matches its separate run"
+fi
+exit $status
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+#  check_parse.sh <apex_sim> <lines> <chunks>
+#  Generates a program of the given number of lines, converts it to an
+#  image once from a file parsed in <chunks> parallel chunks and once from
+#  standard input, which is always parsed serially, and fails unless the
+#  two images are byte-identical.
+#
+sim=$1
+lines=$2
+chunks=$3
+tmp=${TMPDIR:-/tmp}/check_parse.$$
+trap 'rm -f "$tmp".*' EXIT
+
+# Every opcode and operand form, with blank lines and varying widths
+awk -v lines="$lines" 'BEGIN {
+  for (i = 0; i < lines; ++i) {
+    r = i % 32; s = (i * 7) % 32; t = (i * 13) % 32; n = i % 100003 - 50000
+    k = i % 17
+    if (k == 0) print "MOVC,R" r ",#" n
+    else if (k == 1) print "ADD,R" r ",R" s ",R" t
+    else if (k == 2) print "SUB,R" r ",R" s ",R" t
+    else if (k == 3) print "MUL,R" r ",R" s ",R" t
+    else if (k == 4) print "AND,R" r ",R" s ",R" t
+    else if (k == 5) print "OR,R" r ",R" s ",R" t
+    else if (k == 6) print "XOR,R" r ",R" s ",R" t
+    else if (k == 7) print "LOAD,R" r ",R" s ",#" n
+    else if (k == 8) print "LDR,R" r ",R" s ",R" t
+    else if (k == 9) print "STORE,R" r ",R" s ",#" n
+    else if (k == 10) print "BZ,#" n
+    else if (k == 11) print "BNZ,#" n
+    else if (k == 12) print "JUMP,R" r ",#" n
+    else if (k == 13) print "NOP,"
+    else if (k == 14) print ""
+    else if (k == 15) print "HALT,"
+    else print "ADD,R" t ",R" r ",R" s
+  }
+}' > "$tmp.asm"
+
+APEX_PARSE_CHUNKS=$chunks "$sim" "$tmp.asm" convert "$tmp.chunked" \
+  > /dev/null 2>&1 || exit 1
+"$sim" - convert "$tmp.serial" < "$tmp.asm" > /dev/null 2>&1 || exit 1
+if ! cmp -s "$tmp.chunked" "$tmp.serial"; then
+  echo "$lines lines in $chunks chunks: code memory differs from a serial parse"
+  exit 1
+fi
+echo "$lines lines in $chunks chunks: code memory matches a serial parse"
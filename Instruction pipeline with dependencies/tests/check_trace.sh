@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+#  check_trace.sh <apex_sim> <apex_trace> <program> <config>
+#  Records a --trace of the program in display and in simulate mode, decodes
+#  both with apex_trace and fails unless each matches, byte for byte, the
+#  per-cycle stage output that display mode prints.
+#
+sim=$1
+decoder=$2
+program=$3
+config=$4
+tmp=${TMPDIR:-/tmp}/check_trace.$$
+trap 'rm -f "$tmp".*' EXIT
+
+# Per-cycle stage output: after the code memory listing, before the state
+"$sim" "$program" display 100000 --config="$config" --trace="$tmp.display" \
+  > "$tmp.out" 2>&1 || exit 1
+sed -n '/^-----/,$p' "$tmp.out" | sed '/(apex) >> Simulation Complete/,$d' \
+  > "$tmp.expected"
+"$sim" "$program" simulate 100000 --config="$config" --trace="$tmp.simulate" \
+  > /dev/null 2>&1 || exit 1
+
+for mode in display simulate; do
+  "$decoder" "$tmp.$mode" "$tmp.decoded" 2> /dev/null || exit 1
+  if ! cmp -s "$tmp.expected" "$tmp.decoded"; then
+    echo "$program: decoded $mode trace differs from display output"
+    diff "$tmp.expected" "$tmp.decoded" | head -20
+    exit 1
+  fi
+done
+echo "$program: decoded traces match display output"
@@ -0,0 +1,8 @@
+MOVC,R5,#100
+MOVC,R6,#7
+LOAD,R2,R0,#0
+ADD,R7,R6,R6
+ADD,R7,R6,R6
+LOAD,R1,R2,#0
+AND,R3,R5,R5
+HALT,
@@ -0,0 +1,5 @@
+MOVC,R1,#5
+MOVC,R4,#0
+LOAD,R2,R4,#1
+ADD,R3,R1,R4
+HALT,
@@ -0,0 +1,9 @@
+MOVC,R1,#2000
+MOVC,R2,#1
+ADD,R3,R3,R1
+NOP,
+SUB,R1,R1,R2
+NOP,
+NOP,
+BNZ,#-24
+HALT,
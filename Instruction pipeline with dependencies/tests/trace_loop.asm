@@ -0,0 +1,10 @@
+MOVC,R1,#12
+MOVC,R2,#1
+MOVC,R5,#0
+STORE,R1,R5,#8
+LOAD,R6,R5,#8
+MUL,R7,R6,R1
+ADD,R5,R5,R2
+SUB,R1,R1,R2
+BNZ,#-24
+HALT,
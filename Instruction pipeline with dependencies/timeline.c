@@ -0,0 +1,211 @@
+/*
+ *  timeline.c
+ *  Contains the pipeline timeline export: the cycles every instruction
+ *  enters and leaves each stage, its retirement, and the squashing of
+ *  the instructions fetched behind a taken JUMP, BZ or BNZ, streamed as
+ *  a Kanata log that the Konata pipeline viewer opens.
+ *
+ *  Fetch tags each instruction it takes from code memory in CPU_Stage.id,
+ *  which travels with the latch. Tags wrap, and only have to tell apart
+ *  the few instructions in flight. The stages report what they show
+ *  every cycle, as in display mode, and an instruction has moved on when
+ *  it is shown in a later stage than before. Latches still holding a
+ *  copy of an instruction that moved on are ignored.
+ *
+ *  Kanata lines written, fields separated by tabs:
+ *    Kanata 0004            header
+ *    C= <cycle>             cycle of the lines that follow
+ *    C <n>                  n cycles later
+ *    I <id> <id> 0          instruction fetched
+ *    L <id> 0 <text>        pc and disassembly
+ *    L <id> 1 <text>        detail, why it was flushed
+ *    S <id> 0 <stage>       stage entered
+ *    E <id> 0 <stage>       stage left
+ *    R <id> <n> 0           retired as the nth instruction
+ *    R <id> 0 1             flushed
+ *  Ids are fetch order from 0. An instruction retires the cycle after
+ *  writeback shows it, so writeback lasts its one cycle in the viewer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+
+/* Instructions the timeline follows at once, a power of two */
+#define TIMELINE_SLOTS 64
+#define TIMELINE_BUFFER (1 << 20)
+
+static const char* timeline_stages[NUM_STAGES] = {
+  "F", "DRF", "EX", "MEM", "WB"
+};
+
+typedef struct APEX_Timeline_Slot
+{
+  unsigned short tag;	// CPU_Stage.id, 0 when the slot is free
+  int stage;		// Stage the instruction was last shown in
+  long id;		// Kanata id
+} APEX_Timeline_Slot;
+
+typedef struct APEX_Timeline
+{
+  FILE* fp;
+  char* buffer;
+  unsigned short fetched;	// Last tag handed to fetch
+  unsigned short newest;	// Last tag shown in fetch
+  APEX_Timeline_Slot* retiring;	// Shown in writeback this cycle, or NULL
+  long ids;		// Instructions followed so far
+  long retired;
+  int clock;		// Cycle of the lines written last
+  APEX_Timeline_Slot slot[TIMELINE_SLOTS];
+} APEX_Timeline;
+
+/* Returns 1 if tag a was handed out after tag b */
+static int
+later(unsigned short a, unsigned short b)
+{
+  return (short)(a - b) > 0;
+}
+
+/* Moves the log on to cycle clock, retiring what writeback showed */
+static void
+advance(APEX_Timeline* timeline, int clock)
+{
+  if (clock == timeline->clock) {
+    return;
+  }
+  if (timeline->retiring) {
+    long id = timeline->retiring->id;
+    fprintf(timeline->fp, "C\t1\nE\t%ld\t0\tWB\nR\t%ld\t%ld\t0\n", id, id,
+            timeline->retired++);
+    timeline->retiring->tag = 0;
+    timeline->retiring = NULL;
+    timeline->clock++;
+  }
+  if (clock > timeline->clock) {
+    fprintf(timeline->fp, "C\t%d\n", clock - timeline->clock);
+  }
+  timeline->clock = clock;
+}
+
+/*
+ * Starts the timeline of cpu in path, from the cycle it is at. Returns -1
+ * if the file cannot be written.
+ */
+int
+APEX_timeline_open(APEX_CPU* cpu, const char* path)
+{
+  APEX_Timeline* timeline = calloc(1, sizeof(*timeline));
+  if (!timeline) {
+    return -1;
+  }
+  timeline->fp = fopen(path, "w");
+  timeline->buffer = malloc(TIMELINE_BUFFER);
+  if (!timeline->fp || !timeline->buffer) {
+    if (timeline->fp) {
+      fclose(timeline->fp);
+    }
+    free(timeline->buffer);
+    free(timeline);
+    return -1;
+  }
+  setvbuf(timeline->fp, timeline->buffer, _IOFBF, TIMELINE_BUFFER);
+  fprintf(timeline->fp, "Kanata\t0004\nC=\t%d\n", cpu->clock);
+  timeline->clock = cpu->clock;
+  cpu->timeline = timeline;
+  cpu->display |= APEX_DISPLAY_TIMELINE;
+  return 0;
+}
+
+/* Returns the tag of an instruction fetch takes from code memory */
+unsigned short
+APEX_timeline_fetch(APEX_Timeline* timeline)
+{
+  if (!++timeline->fetched) {
+    timeline->fetched = 1;
+  }
+  return timeline->fetched;
+}
+
+void
+APEX_timeline_cycle(APEX_CPU* cpu)
+{
+  advance(cpu->timeline, cpu->clock);
+}
+
+/* Follows the instruction latch index shows this cycle */
+void
+APEX_timeline_stage(APEX_Timeline* timeline, int index, CPU_Stage* stage)
+{
+  unsigned short tag = stage->id;
+  APEX_Timeline_Slot* slot = &timeline->slot[tag & (TIMELINE_SLOTS - 1)];
+  if (!tag) {
+    return;
+  }
+  if (slot->tag != tag) {
+    /* Shown for the first time, by fetch */
+    if (index != F || !later(tag, timeline->newest)) {
+      return;
+    }
+    timeline->newest = tag;
+    slot->tag = tag;
+    slot->stage = F;
+    slot->id = timeline->ids++;
+    fprintf(timeline->fp, "I\t%ld\t%ld\t0\nL\t%ld\t0\t%d: ", slot->id,
+            slot->id, slot->id, stage->pc);
+    APEX_print_instruction(timeline->fp, stage);
+    fprintf(timeline->fp, "\nS\t%ld\t0\tF\n", slot->id);
+    return;
+  }
+  if (index <= slot->stage) {
+    return;
+  }
+  fprintf(timeline->fp, "E\t%ld\t0\t%s\nS\t%ld\t0\t%s\n", slot->id,
+          timeline_stages[slot->stage], slot->id, timeline_stages[index]);
+  slot->stage = index;
+  if (index == WB) {
+    timeline->retiring = slot;
+  }
+}
+
+/*
+ * Flushes the instructions in the F and DRF latches that were fetched
+ * after the control transfer in EX, which is squashing them.
+ */
+void
+APEX_timeline_flush(APEX_CPU* cpu)
+{
+  APEX_Timeline* timeline = cpu->timeline;
+  CPU_Stage* cause = &cpu->stage[EX];
+  for (int index = F; index <= DRF; ++index) {
+    unsigned short tag = cpu->stage[index].id;
+    APEX_Timeline_Slot* slot = &timeline->slot[tag & (TIMELINE_SLOTS - 1)];
+    if (!tag || slot->tag != tag || !later(tag, cause->id)) {
+      continue;
+    }
+    fprintf(timeline->fp, "L\t%ld\t1\tflushed by %d: ", slot->id, cause->pc);
+    APEX_print_instruction(timeline->fp, cause);
+    fprintf(timeline->fp, "\nE\t%ld\t0\t%s\nR\t%ld\t0\t1\n", slot->id,
+            timeline_stages[slot->stage], slot->id);
+    slot->tag = 0;
+  }
+}
+
+/* Ends the timeline, returns -1 if writing it failed */
+int
+APEX_timeline_close(APEX_CPU* cpu)
+{
+  APEX_Timeline* timeline = cpu->timeline;
+  if (!timeline) {
+    return 0;
+  }
+  advance(timeline, cpu->clock);
+  int status = ferror(timeline->fp) ? -1 : 0;
+  if (fclose(timeline->fp) != 0) {
+    status = -1;
+  }
+  free(timeline->buffer);
+  free(timeline);
+  cpu->timeline = NULL;
+  cpu->display &= ~APEX_DISPLAY_TIMELINE;
+  return status;
+}
@@ -0,0 +1,548 @@
+/*
+ *  trace.c
+ *  Contains the binary pipeline trace: what display mode prints of every
+ *  cycle, recorded raw into double-buffered chunks that a background
+ *  thread encodes to a few bytes per cycle, compresses and writes; and
+ *  its decoder.
+ *
+ *  File layout (host byte order):
+ *    APEX_Trace_Header
+ *    code memory   (code_memory_size APEX_Instruction records)
+ *    chunks        (raw size, compressed size, zlib data), ending with a
+ *                  chunk of raw size 0
+ *  Records never span chunks. A record starts with a varint v: an even
+ *  v is a cycle, v / 2 cycles after the one expected; an odd v repeats
+ *  the previous cycle v / 2 more times. A cycle continues with
+ *    byte  bits 0-4 latches shown (F..WB), bit 5 decode stalled, bit 6
+ *          EX held, bit 7 fetch flushed by a taken branch or jump
+ *    byte  bits 0-4 latches holding what was predicted: what the latch
+ *          before it showed last cycle, or the next instruction for F
+ *    per shown latch not predicted, WB first: opcode byte and a zigzag
+ *          varint of its pc less the predicted pc
+ *  The remaining latch fields are those of the instruction at pc.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "cpu.h"
+
+#define TRACE_MAGIC "APEXTRC"
+
+/* Cycles per chunk, and the longest record: varint, masks, five latches */
+#define TRACE_RECORDS 32768
+#define TRACE_MAX_RECORD (5 + 2 + NUM_STAGES * 6)
+#define TRACE_CHUNK (TRACE_RECORDS * TRACE_MAX_RECORD)
+
+/* APEX_Trace_Record flags, where the file has them in its flags byte */
+#define RECORD_REPEAT 0x01	// clock is a count of repeats instead
+#define RECORD_STALL 0x20
+#define RECORD_BUSY 0x40
+#define RECORD_FLUSH 0x80
+
+typedef struct APEX_Trace_Header
+{
+  char magic[8];
+  int version;
+  int instruction_size;	// sizeof(APEX_Instruction)
+  int code_memory_size;
+} APEX_Trace_Header;
+
+typedef struct APEX_Trace_Latch
+{
+  int pc;
+  int opcode;
+} APEX_Trace_Latch;
+
+/* Latch contents one cycle shows, and what predicts the next */
+typedef struct APEX_Trace_Cycle
+{
+  const APEX_Instruction* code;
+  int code_memory_size;
+  APEX_Trace_Latch last[NUM_STAGES];	// Last shown content per latch
+  long clock;			// Clock of the last cycle, -1 before any
+  long cycles;			// Cycles decoded
+} APEX_Trace_Cycle;
+
+/*
+ * The pipeline fills records, raw, into one buffer while the writer
+ * thread encodes, compresses and writes the other.
+ */
+typedef struct APEX_Trace
+{
+  FILE* fp;
+  long flushes;			// Counters when the cycle started
+  long decode_stalls;
+  long execute_busy;
+
+  APEX_Trace_Record* records[2];
+  int used;			// Records in records[fill]
+  int fill;
+
+  /* Hand-off of full buffers to the writer thread */
+  pthread_t writer;
+  int threaded;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int full;			// Buffer waiting to be written, or -1
+  int full_count;
+  int closing;
+  int error;
+
+  /* Writer side */
+  APEX_Trace_Cycle cycle;
+  unsigned char* encoded;
+  unsigned char* packed;
+} APEX_Trace;
+
+static unsigned char*
+put_varint(unsigned char* p, unsigned long v)
+{
+  while (v >= 0x80) {
+    *p++ = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (unsigned char)v;
+  return p;
+}
+
+static unsigned long
+zigzag(long v)
+{
+  return v < 0 ? ((unsigned long)~v << 1) | 1 : (unsigned long)v << 1;
+}
+
+static long
+unzigzag(unsigned long v)
+{
+  return v & 1 ? ~(long)(v >> 1) : (long)(v >> 1);
+}
+
+/* Predicted content of latch index this cycle, from last cycle */
+static APEX_Trace_Latch
+predict(const APEX_Trace_Cycle* cycle, int index)
+{
+  if (index > F) {
+    return cycle->last[index - 1];
+  }
+  APEX_Trace_Latch next = { cycle->last[F].pc + 4, OP_NOP };
+  int i = get_code_index(next.pc);
+  if (i >= 0 && i < cycle->code_memory_size) {
+    next.opcode = cycle->code[i].opcode;
+  }
+  return next;
+}
+
+/* Encodes one record, returns the end of its bytes */
+static unsigned char*
+encode_record(APEX_Trace_Cycle* cycle, const APEX_Trace_Record* record,
+              unsigned char* p)
+{
+  if (record->flags & RECORD_REPEAT) {
+    cycle->clock += record->clock;
+    return put_varint(p, 2 * (unsigned long)record->clock + 1);
+  }
+  p = put_varint(p, 2 * (unsigned long)(record->clock - cycle->clock - 1));
+  *p++ = record->shown | record->flags;
+
+  APEX_Trace_Latch predicted[NUM_STAGES];
+  unsigned int same = 0;
+  for (int i = 0; i < NUM_STAGES; ++i) {
+    predicted[i] = predict(cycle, i);
+    if ((record->shown >> i & 1) && record->pc[i] == predicted[i].pc &&
+        record->opcode[i] == predicted[i].opcode) {
+      same |= 1u << i;
+    }
+  }
+  *p++ = same;
+  for (int i = NUM_STAGES - 1; i >= 0; --i) {
+    if ((record->shown & ~same) >> i & 1) {
+      *p++ = record->opcode[i];
+      p = put_varint(p, zigzag((long)record->pc[i] - predicted[i].pc));
+    }
+    if (record->shown >> i & 1) {
+      cycle->last[i].pc = record->pc[i];
+      cycle->last[i].opcode = record->opcode[i];
+    }
+  }
+  cycle->clock = record->clock;
+  return p;
+}
+
+/* Encodes, compresses and writes one chunk, returns -1 on error */
+static int
+write_chunk(APEX_Trace* trace, const APEX_Trace_Record* records, int count)
+{
+  unsigned char* p = trace->encoded;
+  for (int i = 0; i < count; ++i) {
+    p = encode_record(&trace->cycle, &records[i], p);
+  }
+  uLongf packed_size = compressBound(TRACE_CHUNK);
+  unsigned int sizes[2] = { p - trace->encoded, 0 };
+  if (compress2(trace->packed, &packed_size, trace->encoded, sizes[0],
+                Z_BEST_SPEED) != Z_OK) {
+    return -1;
+  }
+  sizes[1] = packed_size;
+  if (fwrite(sizes, sizeof(sizes), 1, trace->fp) != 1 ||
+      fwrite(trace->packed, 1, packed_size, trace->fp) != packed_size) {
+    return -1;
+  }
+  return 0;
+}
+
+static void*
+trace_writer(void* arg)
+{
+  APEX_Trace* trace = arg;
+
+  pthread_mutex_lock(&trace->lock);
+  while (1) {
+    while (trace->full < 0 && !trace->closing) {
+      pthread_cond_wait(&trace->cond, &trace->lock);
+    }
+    if (trace->full < 0) {
+      break;
+    }
+    const APEX_Trace_Record* records = trace->records[trace->full];
+    int count = trace->full_count;
+    pthread_mutex_unlock(&trace->lock);
+    int status = write_chunk(trace, records, count);
+    pthread_mutex_lock(&trace->lock);
+    trace->error |= status != 0;
+    trace->full = -1;
+    pthread_cond_broadcast(&trace->cond);
+  }
+  pthread_mutex_unlock(&trace->lock);
+  return NULL;
+}
+
+/*
+ * Passes the buffer being filled to the writer and continues in the
+ * other one, once the writer is done with it. Without a writer thread
+ * the chunk is written here.
+ */
+static void
+hand_off(APEX_Trace* trace)
+{
+  if (!trace->used) {
+    return;
+  }
+  if (!trace->threaded) {
+    trace->error |= write_chunk(trace, trace->records[0], trace->used) != 0;
+    trace->used = 0;
+    return;
+  }
+  pthread_mutex_lock(&trace->lock);
+  while (trace->full >= 0) {
+    pthread_cond_wait(&trace->cond, &trace->lock);
+  }
+  trace->full = trace->fill;
+  trace->full_count = trace->used;
+  pthread_cond_broadcast(&trace->cond);
+  pthread_mutex_unlock(&trace->lock);
+  trace->fill ^= 1;
+  trace->used = 0;
+}
+
+/* Moves cpu on to the next record */
+static void
+next_record(APEX_CPU* cpu)
+{
+  APEX_Trace* trace = cpu->trace;
+  if (++trace->used == TRACE_RECORDS) {
+    hand_off(trace);
+  }
+  cpu->trace_record = &trace->records[trace->fill][trace->used];
+}
+
+static void
+free_trace(APEX_Trace* trace)
+{
+  free(trace->records[0]);
+  free(trace->records[1]);
+  free(trace->encoded);
+  free(trace->packed);
+  free(trace);
+}
+
+/*
+ * Starts tracing the pipeline of cpu to path. Every cycle cpu simulates
+ * from now on is recorded until APEX_trace_close.
+ */
+int
+APEX_trace_open(APEX_CPU* cpu, const char* path)
+{
+  APEX_Trace* trace = calloc(1, sizeof(*trace));
+  if (!trace) {
+    return -1;
+  }
+  trace->fp = fopen(path, "wb");
+  trace->records[0] = malloc(sizeof(APEX_Trace_Record) * TRACE_RECORDS);
+  trace->records[1] = malloc(sizeof(APEX_Trace_Record) * TRACE_RECORDS);
+  trace->encoded = malloc(TRACE_CHUNK);
+  trace->packed = malloc(compressBound(TRACE_CHUNK));
+
+  APEX_Trace_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  header.version = APEX_TRACE_VERSION;
+  header.instruction_size = sizeof(APEX_Instruction);
+  header.code_memory_size = cpu->code_memory_size;
+  if (!trace->fp || !trace->records[0] || !trace->records[1] ||
+      !trace->encoded || !trace->packed ||
+      fwrite(&header, sizeof(header), 1, trace->fp) != 1 ||
+      fwrite(cpu->code_memory, sizeof(APEX_Instruction),
+             cpu->code_memory_size, trace->fp) !=
+        (size_t)cpu->code_memory_size) {
+    if (trace->fp) {
+      fclose(trace->fp);
+    }
+    free_trace(trace);
+    return -1;
+  }
+
+  trace->cycle.code = cpu->code_memory;
+  trace->cycle.code_memory_size = cpu->code_memory_size;
+  trace->cycle.clock = -1;
+  trace->full = -1;
+  pthread_mutex_init(&trace->lock, NULL);
+  pthread_cond_init(&trace->cond, NULL);
+  trace->threaded = pthread_create(&trace->writer, NULL, trace_writer,
+                                   trace) == 0;
+  cpu->trace = trace;
+  cpu->trace_record = trace->records[0];
+  cpu->display |= APEX_DISPLAY_TRACE;
+  return 0;
+}
+
+/* Starts the record of a cycle; the stages fill in what they show */
+void
+APEX_trace_begin(APEX_CPU* cpu)
+{
+  APEX_Trace* trace = cpu->trace;
+  cpu->trace_record->clock = cpu->clock;
+  cpu->trace_record->shown = 0;
+  trace->flushes = cpu->flushes;
+  trace->decode_stalls = cpu->decode_stalls;
+  trace->execute_busy = cpu->execute_busy;
+}
+
+void
+APEX_trace_end(APEX_CPU* cpu)
+{
+  APEX_Trace* trace = cpu->trace;
+  APEX_Trace_Record* record = cpu->trace_record;
+  record->flags = 0;
+  if (cpu->decode_stalls != trace->decode_stalls) {
+    record->flags |= RECORD_STALL;
+  }
+  if (cpu->execute_busy != trace->execute_busy) {
+    record->flags |= RECORD_BUSY;
+  }
+  if (cpu->flushes != trace->flushes) {
+    record->flags |= RECORD_FLUSH;
+  }
+  next_record(cpu);
+}
+
+/* Records that the last cycle repeats count more times */
+void
+APEX_trace_repeat(APEX_CPU* cpu, long count)
+{
+  cpu->trace_record->clock = count;
+  cpu->trace_record->flags = RECORD_REPEAT;
+  next_record(cpu);
+}
+
+/* Writes the last chunk and closes the trace, returns -1 on error */
+int
+APEX_trace_close(APEX_CPU* cpu)
+{
+  APEX_Trace* trace = cpu->trace;
+  if (!trace) {
+    return 0;
+  }
+  hand_off(trace);
+  if (trace->threaded) {
+    pthread_mutex_lock(&trace->lock);
+    trace->closing = 1;
+    pthread_cond_broadcast(&trace->cond);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->writer, NULL);
+  }
+  unsigned int end[2] = { 0, 0 };
+  int status = trace->error ? -1 : 0;
+  if (fwrite(end, sizeof(end), 1, trace->fp) != 1) {
+    status = -1;
+  }
+  if (fclose(trace->fp) != 0) {
+    status = -1;
+  }
+  pthread_mutex_destroy(&trace->lock);
+  pthread_cond_destroy(&trace->cond);
+  free_trace(trace);
+  cpu->trace = NULL;
+  cpu->trace_record = NULL;
+  cpu->display &= ~APEX_DISPLAY_TRACE;
+  return status;
+}
+
+static int
+get_varint(const unsigned char** p, const unsigned char* end,
+           unsigned long* v)
+{
+  *v = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char byte = *(*p)++;
+    *v |= (unsigned long)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Prints one cycle as display mode does */
+static void
+print_cycle(FILE* out, const APEX_Trace_Cycle* cycle, unsigned int shown)
+{
+  fprintf(out, "--------------------------------\n");
+  fprintf(out, "Clock Cycle #: %ld\n", cycle->clock);
+  fprintf(out, "--------------------------------\n");
+  for (int i = NUM_STAGES - 1; i >= 0; --i) {
+    if (!(shown >> i & 1)) {
+      continue;
+    }
+    CPU_Stage stage = { 0 };
+    stage.pc = cycle->last[i].pc;
+    stage.opcode = cycle->last[i].opcode;
+    int index = get_code_index(stage.pc);
+    if (stage.opcode != OP_NONE && index >= 0 &&
+        index < cycle->code_memory_size) {
+      const APEX_Instruction* ins = &cycle->code[index];
+      stage.rd = ins->rd;
+      stage.rs1 = ins->rs1;
+      stage.rs2 = ins->rs2;
+      stage.imm = ins->imm;
+    }
+    APEX_print_stage(out, i, &stage);
+  }
+}
+
+/* Renders the records of one chunk, returns -1 if they are malformed */
+static int
+decode_chunk(FILE* out, APEX_Trace_Cycle* cycle, unsigned int* shown,
+             const unsigned char* p, const unsigned char* end)
+{
+  while (p < end) {
+    unsigned long v;
+    if (get_varint(&p, end, &v) != 0) {
+      return -1;
+    }
+    if (v & 1) {
+      for (unsigned long n = v >> 1; n > 0; --n) {
+        cycle->clock++;
+        cycle->cycles++;
+        print_cycle(out, cycle, *shown);
+      }
+      continue;
+    }
+    if (end - p < 2) {
+      return -1;
+    }
+    unsigned int flags = *p++;
+    unsigned int same = *p++;
+    APEX_Trace_Latch now[NUM_STAGES];
+    for (int i = 0; i < NUM_STAGES; ++i) {
+      now[i] = predict(cycle, i);
+    }
+    for (int i = NUM_STAGES - 1; i >= 0; --i) {
+      if ((flags & ~same) >> i & 1) {
+        unsigned long delta;
+        if (p >= end || *p >= NUM_OPCODES) {
+          return -1;
+        }
+        now[i].opcode = *p++;
+        if (get_varint(&p, end, &delta) != 0) {
+          return -1;
+        }
+        now[i].pc += unzigzag(delta);
+      }
+      if (flags >> i & 1) {
+        cycle->last[i] = now[i];
+      }
+    }
+    cycle->clock += 1 + (v >> 1);
+    cycle->cycles++;
+    *shown = flags & ((1u << NUM_STAGES) - 1);
+    print_cycle(out, cycle, *shown);
+  }
+  return 0;
+}
+
+/*
+ * Renders the trace at path to out as the text display mode prints for
+ * each cycle. Returns the number of cycles, or -1 on error.
+ */
+long
+APEX_trace_decode(const char* path, FILE* out)
+{
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open trace %s\n", path);
+    return -1;
+  }
+
+  APEX_Trace_Header header;
+  APEX_Trace_Cycle cycle = { 0 };
+  APEX_Instruction* code = NULL;
+  unsigned char* packed = malloc(compressBound(TRACE_CHUNK));
+  unsigned char* data = malloc(TRACE_CHUNK);
+  long status = -1;
+  if (!packed || !data || fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+      header.version != APEX_TRACE_VERSION ||
+      header.instruction_size != sizeof(APEX_Instruction) ||
+      header.code_memory_size < 0) {
+    fprintf(stderr, "APEX_Error : %s is not a compatible trace\n", path);
+    goto done;
+  }
+  code = malloc(sizeof(*code) * header.code_memory_size + 1);
+  if (!code || fread(code, sizeof(*code), header.code_memory_size, fp) !=
+                 (size_t)header.code_memory_size) {
+    goto done;
+  }
+  cycle.code = code;
+  cycle.code_memory_size = header.code_memory_size;
+  cycle.clock = -1;
+
+  unsigned int shown = 0;
+  unsigned int sizes[2];
+  while (fread(sizes, sizeof(sizes), 1, fp) == 1) {
+    if (sizes[0] == 0) {
+      status = cycle.cycles;
+      break;
+    }
+    uLongf size = TRACE_CHUNK;
+    if (sizes[0] > TRACE_CHUNK || sizes[1] > compressBound(TRACE_CHUNK) ||
+        fread(packed, 1, sizes[1], fp) != sizes[1] ||
+        uncompress(data, &size, packed, sizes[1]) != Z_OK ||
+        size != sizes[0] ||
+        decode_chunk(out, &cycle, &shown, data, data + size) != 0) {
+      break;
+    }
+  }
+  if (status < 0) {
+    fprintf(stderr, "APEX_Error : %s is truncated or corrupt\n", path);
+  }
+
+done:
+  free(code);
+  free(packed);
+  free(data);
+  fclose(fp);
+  return status;
+}
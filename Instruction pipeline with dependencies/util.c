@@ -0,0 +1,112 @@
+/*
+ *  util.c
+ *  Contains small helpers shared by the file readers and run modes.
+ */
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.h"
+
+/* Strips leading and trailing white space in place */
+char*
+APEX_trim(char* text)
+{
+  while (isspace((unsigned char)*text)) {
+    text++;
+  }
+  char* end = text + strlen(text);
+  while (end > text && isspace((unsigned char)end[-1])) {
+    *--end = '\0';
+  }
+  return text;
+}
+
+/* FNV-1a over size bytes of data, continuing from hash */
+unsigned long long
+APEX_hash_bytes(unsigned long long hash, const void* data, size_t size)
+{
+  const unsigned char* bytes = data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* Xorshift generator, deterministic so a seed repeats its sequence */
+unsigned int
+APEX_random_next(unsigned int* state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+double
+APEX_now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Tasks are handed to the workers in order through next */
+typedef struct APEX_Task_Pool
+{
+  APEX_Task task;
+  void* context;
+  long count;
+  long next;
+  pthread_mutex_t lock;
+} APEX_Task_Pool;
+
+static void*
+task_worker(void* arg)
+{
+  APEX_Task_Pool* pool = arg;
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    long index = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (index >= pool->count) {
+      return NULL;
+    }
+    pool->task(pool->context, index);
+  }
+}
+
+/*
+ * Calls task(context, index) for every index below count on up to
+ * threads workers. Returns the number of threads that ran tasks; without
+ * workers they all run on the calling thread.
+ */
+int
+APEX_run_tasks(APEX_Task task, void* context, long count, int threads)
+{
+  APEX_Task_Pool pool = { task, context, count, 0 };
+  pthread_mutex_init(&pool.lock, NULL);
+
+  if (threads > count) {
+    threads = count;
+  }
+  pthread_t* workers = threads > 0 ? calloc(threads, sizeof(*workers)) : NULL;
+  int started = 0;
+  while (workers && started < threads &&
+         pthread_create(&workers[started], NULL, task_worker, &pool) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    task_worker(&pool);
+  }
+  for (int i = 0; i < started; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  pthread_mutex_destroy(&pool.lock);
+  return started ? started : 1;
+}